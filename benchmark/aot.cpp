@@ -0,0 +1,142 @@
+#include "StdAfx.h"
+
+#include <clocale>
+#include <cstdio>
+#include <cctype>
+#include <codecvt>
+#include <fstream>
+#include <iterator>
+#include <locale>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "cmm.h"
+#include "Compiler.h"
+#include "CppGenerator.h"
+#include "Prototype.h"
+
+// Compiles scripts to the C++ sources of modules (CppGenerator.h) for the differential check of the
+// ahead-of-time compiler, which the Makefile next to this file runs with `make check` (check.cpp).
+// A module is named after its script, and written to <name>.cpp in the output directory. modules.cpp is
+// written next to them, with RegisterModules() which registers them all in a context, and the lists of
+// the names and the scripts which the check runs in the interpreter.
+//
+// usage: cmm-aot <output directory> script.cmm ...
+
+namespace
+{
+
+// The scripts are read as UTF-8, which takes in the ASCII ones. The samples written in EUC-KR are converted
+// by the Makefile (iconv), since the scanner classifies the characters in the ctype of the locale, which main sets to UTF-8.
+bool LoadFile(const std::string& fileName, std::wstring& code)
+{
+	std::ifstream file(fileName, std::ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+
+	try {
+		code = converter.from_bytes(bytes);
+	} catch (std::range_error&) {
+		return false; // not UTF-8
+	}
+	return true;
+}
+
+// The name of the script without the directory and the extension, made a C++ identifier
+std::string ModuleNameOf(const std::string& fileName)
+{
+	size_t begin = fileName.find_last_of('/');
+	begin = (begin == std::string::npos) ? 0 : begin + 1;
+	size_t end = fileName.find_last_of('.');
+	if (end == std::string::npos || end < begin) {
+		end = fileName.size();
+	}
+
+	std::string name = fileName.substr(begin, end - begin);
+	for (char& c : name) {
+		if (std::isalnum(static_cast<unsigned char>(c)) == 0) {
+			c = '_';
+		}
+	}
+	return name;
+}
+
+bool Generate(const std::string& fileName, const std::string& moduleName, const std::string& outputName)
+{
+	std::wstring code;
+
+	if (LoadFile(fileName, code) == false) {
+		fprintf(stderr, "%s: the file does not exist, or is not in UTF-8\n", fileName.c_str());
+		return false;
+	}
+
+	try {
+		cmm::ObjectManager objectManager;
+		cmm::Compiler compiler(objectManager);
+		cmm::Ref<cmm::Prototype> prototype = compiler.compile(code.c_str());
+		cmm::CppGenerator generator;
+		const std::wstring& source = generator.generate(*prototype, std::wstring(moduleName.begin(), moduleName.end()));
+
+		std::ofstream output(outputName, std::ios::binary);
+		output << std::string(source.begin(), source.end()); // the source is written in ASCII
+		return output.good();
+	} catch (cmm::Error& error) {
+		const std::wstring message = error.errorStr();
+		fprintf(stderr, "%s: %s\n", fileName.c_str(), std::string(message.begin(), message.end()).c_str());
+		return false;
+	}
+}
+
+} // The end of anomymous namespace
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <output directory> script.cmm ...\n", argv[0]);
+		return 1;
+	}
+
+	setlocale(LC_CTYPE, "C.UTF-8");
+
+	const std::string directory(argv[1]);
+	std::vector<std::string> moduleNames;
+
+	for (int i = 2; i < argc; i++) {
+		const std::string moduleName = ModuleNameOf(argv[i]);
+
+		if (Generate(argv[i], moduleName, directory + "/" + moduleName + ".cpp") == false) {
+			return 1;
+		}
+		moduleNames.push_back(moduleName);
+	}
+
+	std::ofstream output(directory + "/modules.cpp", std::ios::binary);
+
+	output << "// The modules generated by cmm-aot for the differential check (check.cpp)\n\n"
+	       << "#include \"Context.h\"\n\n";
+	for (const std::string& moduleName : moduleNames) {
+		output << "void RegisterModule_" << moduleName << "(cmm::Context& context);\n";
+	}
+
+	output << "\nvoid RegisterModules(cmm::Context& context)\n{\n";
+	for (const std::string& moduleName : moduleNames) {
+		output << "\tRegisterModule_" << moduleName << "(context);\n";
+	}
+	output << "}\n\nextern const wchar_t* const moduleNames[] = {\n";
+	for (const std::string& moduleName : moduleNames) {
+		output << "\tL\"" << moduleName << "\",\n";
+	}
+	output << "\tnullptr\n};\n\nextern const char* const moduleScripts[] = {\n";
+	for (int i = 2; i < argc; i++) {
+		output << "\t\"" << argv[i] << "\",\n";
+	}
+	output << "\tnullptr\n};\n";
+
+	return output.good() ? 0 : 1;
+}
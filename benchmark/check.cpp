@@ -0,0 +1,239 @@
+#include "StdAfx.h"
+
+#include <clocale>
+#include <cstdio>
+#include <cwchar>
+#include <algorithm>
+#include <codecvt>
+#include <fstream>
+#include <iterator>
+#include <locale>
+#include <stdexcept>
+#include <string>
+
+#include "cmm.h"
+
+// The differential check of the ahead-of-time compiler, which the Makefile next to this file builds and runs
+// with `make check`. The scripts are compiled to modules by cmm-aot (aot.cpp) and linked into this program.
+// Each script is run from its source by the interpreter, then loaded as a module (Context::loadModule)
+// whose native code runs wherever it can, and the output of print() and the result of main() have to be
+// the same. A script can come with check/<name>.expected, the output the interpreter has to give as well,
+// so that the scripts which test the language are checked and not only compared. It prints a line
+// per script, and exits with 1 if any of them differs.
+//
+// usage: cmm-check
+
+void RegisterModules(cmm::Context& context);
+extern const wchar_t* const moduleNames[];
+extern const char* const moduleScripts[];
+
+namespace
+{
+
+std::wstring output; // of the script being run
+
+std::wstring Describe(cmm::Context& context, uint32_t index)
+{
+	wchar_t buffer[32];
+
+	switch(context.type(index)) {
+	case cmm::TypeNull:      return L"null";
+	case cmm::TypeInt:       swprintf(buffer, 32, L"%d", context.getInt(index)); return buffer;
+	case cmm::TypeFloat:     swprintf(buffer, 32, L"%f", context.getFloat(index)); return buffer;
+	case cmm::TypeString:    return context.getString(index);
+	case cmm::TypeArray:     return L"array";
+	case cmm::TypeTable:     return L"table";
+	case cmm::TypeFunc:      return L"function";
+	case cmm::TypeCoroutine: return L"coroutine";
+	case cmm::TypeCFunc:     return L"C function";
+	default:                 return L"?";
+	}
+}
+
+void print(cmm::Context& context)
+{
+	if (context.stackSize() != 0) {
+		output += Describe(context, 0);
+	}
+	output += L"\n";
+	context.clear();
+}
+
+void size(cmm::Context& context)
+{
+	int32_t size = -1;
+
+	if (context.stackSize() != 0) {
+		switch(context.type(0)) {
+		case cmm::TypeString: size = static_cast<int32_t>(wcslen(context.getString(0))); break;
+		case cmm::TypeArray:  size = context.arraySize(0); break;
+		case cmm::TypeTable:  size = context.tableSize(0); break;
+		default:              break;
+		}
+	}
+
+	context.clear();
+	if (size == -1) {
+		context.pushNull();
+	} else {
+		context.pushInt(size);
+	}
+}
+
+// Bound with Context::bind (Binding.h) for check/binding*.cmm, so the thunks are checked in both of the runs
+int32_t clamp(int32_t value, int32_t low, int32_t high)
+{
+	return std::min(std::max(value, low), high);
+}
+
+float half(float value)
+{
+	return value / 2.0f;
+}
+
+std::wstring repeat(const std::wstring& text, int32_t count)
+{
+	std::wstring repeated;
+
+	for (int32_t i = 0; i < count; i++) {
+		repeated += text;
+	}
+	return repeated;
+}
+
+const wchar_t* digitName(int32_t digit)
+{
+	static const wchar_t* const names[] = { L"zero", L"one", L"two" };
+
+	return (digit >= 0 && digit < 3) ? names[digit] : nullptr;
+}
+
+bool isEmpty(const wchar_t* text)
+{
+	return text[0] == L'\0';
+}
+
+// The scripts are read as UTF-8, which takes in the ASCII ones. The samples written in EUC-KR are converted
+// by the Makefile (iconv), since the scanner classifies the characters in the ctype of the locale, which main sets to UTF-8.
+bool LoadFile(const std::string& fileName, std::wstring& code)
+{
+	std::ifstream file(fileName, std::ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+
+	try {
+		code = converter.from_bytes(bytes);
+	} catch (std::range_error&) {
+		return false; // not UTF-8
+	}
+	return true;
+}
+
+// Runs the script from the source if there is one, or else from the module, and returns what it has printed
+// followed by the result of main() or the error which has stopped it. A main() which returns no value
+// leaves the function itself in the place of the result, as RETURN without values does not fill it.
+std::wstring Run(const std::wstring* code, const wchar_t moduleName[])
+{
+	output.clear();
+
+	try {
+		cmm::Context context;
+		context.registerCfunction(L"print", print);
+		context.registerCfunction(L"sizeof", size);
+		context.bind<decltype(&clamp), &clamp>(L"clamp");
+		CMM_BIND(context, L"half", half);
+		CMM_BIND(context, L"repeat", repeat);
+		CMM_BIND(context, L"digitName", digitName);
+		CMM_BIND(context, L"isEmpty", isEmpty);
+
+		if (code != nullptr) {
+			context.load(code->c_str());
+		} else {
+			RegisterModules(context);
+			context.loadModule(moduleName);
+		}
+		context.run(0, 0);
+		context.getGlobal(L"main");
+		context.run(0, 1);
+		output += L"main: " + Describe(context, 0) + L"\n";
+	} catch (cmm::Error& error) {
+		output += L"error: " + error.errorStr() + L"\n";
+	}
+	return output;
+}
+
+std::string Narrow(const std::wstring& string)
+{
+	return std::string(string.begin(), string.end());
+}
+
+// The first line where the outputs differ, numbered from 1
+size_t FirstDifference(const std::wstring& expected, const std::wstring& actual, std::wstring& expectedLine, std::wstring& actualLine)
+{
+	size_t line = 1;
+	size_t begin = 0;
+
+	for (;;) {
+		const size_t expectedEnd = expected.find(L'\n', begin);
+		const size_t actualEnd = actual.find(L'\n', begin);
+
+		expectedLine = expected.substr(begin, expectedEnd - begin);
+		actualLine = actual.substr(begin, actualEnd - begin);
+		if (expectedLine != actualLine || expectedEnd == std::wstring::npos || actualEnd == std::wstring::npos) {
+			return line;
+		}
+		begin = expectedEnd + 1;
+		line++;
+	}
+}
+
+} // The end of anomymous namespace
+
+int main()
+{
+	int numFailed = 0;
+	int numScripts = 0;
+
+	setlocale(LC_CTYPE, "C.UTF-8");
+
+	for (; moduleNames[numScripts] != nullptr; numScripts++) {
+		const char* script = moduleScripts[numScripts];
+		std::wstring code;
+
+		if (LoadFile(script, code) == false) {
+			printf("FAIL %s: the file does not exist, or is not in UTF-8\n", script);
+			numFailed++;
+			continue;
+		}
+
+		const std::wstring interpreted = Run(&code, nullptr);
+		const std::wstring compiled = Run(nullptr, moduleNames[numScripts]);
+		std::wstring expected;
+		std::wstring expectedLine;
+		std::wstring actualLine;
+
+		if (LoadFile("check/" + Narrow(moduleNames[numScripts]) + ".expected", expected) && expected != interpreted) {
+			const size_t line = FirstDifference(expected, interpreted, expectedLine, actualLine);
+
+			printf("FAIL %s: line %zu is \"%s\" in the interpreter but \"%s\" is expected\n",
+			       script, line, Narrow(actualLine).c_str(), Narrow(expectedLine).c_str());
+			numFailed++;
+		} else if (interpreted != compiled) {
+			const size_t line = FirstDifference(interpreted, compiled, expectedLine, actualLine);
+
+			printf("FAIL %s: line %zu is \"%s\" in the interpreter but \"%s\" in the module\n",
+			       script, line, Narrow(expectedLine).c_str(), Narrow(actualLine).c_str());
+			numFailed++;
+		} else {
+			printf("ok   %s\n", script);
+		}
+	}
+
+	printf("%d of %d scripts match the interpreter\n", numScripts - numFailed, numScripts);
+	return numFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,316 @@
+#include "StdAfx.h"
+
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <codecvt>
+#include <fstream>
+#include <iterator>
+#include <locale>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "cmm.h"
+#include "Config.h"
+
+// The benchmark suite of the C-- virtual machine, which the Makefile next to this file builds on Linux.
+// Each workload (workloads/*.cmm) is a script whose main() does a fixed amount of work and returns the number
+// of operations it has done. main() is run a few times to warm up, so the quickening and the JIT settle,
+// then timed over the repeated runs. A garbage collection follows each run and is counted in its time.
+// The results are written to the standard output as JSON:
+//
+// {"config": {"dispatch": "threaded", ...},
+//  "workloads": [{"name": "int_loop", "ops": 1000000, "mean_ms": 10.5, "ops_per_sec": 95238095.2, ...}, ...]}
+//
+// The instructions executed by a run are counted in another context with the profiler and without the JIT,
+// so they are null unless the runtime is built with CMM_USE_PROFILER. The peak memory is the peak resident
+// set of the process while the workload runs, which Linux lets us reset before each workload.
+//
+// usage: cmm-bench [-jit] [-warmup <runs>] [-repeat <runs>] workload.cmm ...
+
+namespace
+{
+
+struct Result
+{
+	std::string  name;
+	std::string  error;      // empty if the workload has run
+	uint32_t     numOps;     // returned by main()
+	uint32_t     numRuns;
+	double       mean;       // in milliseconds
+	double       min;
+	double       max;
+	double       deviation;
+	uint64_t     numInstructions; // of a run, 0 if they are not counted
+	uint64_t     peakMemory; // in bytes
+	uint32_t     numQuickened;
+	uint32_t     numDequickened;
+};
+
+void silentPrint(cmm::Context& context)
+{
+	context.clear();
+}
+
+void size(cmm::Context& context)
+{
+	int32_t size = -1;
+
+	if (context.stackSize() != 0) {
+		switch(context.type(0)) {
+		case cmm::TypeString: size = static_cast<int32_t>(wcslen(context.getString(0))); break;
+		case cmm::TypeArray:  size = context.arraySize(0); break;
+		case cmm::TypeTable:  size = context.tableSize(0); break;
+		default:              break;
+		}
+	}
+
+	context.clear();
+	if (size == -1) {
+		context.pushNull();
+	} else {
+		context.pushInt(size);
+	}
+}
+
+// The scripts are read as UTF-8 like in the check (check.cpp), so the samples converted by the Makefile can be run
+bool LoadFile(const std::string& fileName, std::wstring& code)
+{
+	std::ifstream file(fileName, std::ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+
+	try {
+		code = converter.from_bytes(bytes);
+	} catch (std::range_error&) {
+		return false; // not UTF-8
+	}
+	return true;
+}
+
+std::string NameOf(const std::string& fileName)
+{
+	size_t begin = fileName.find_last_of('/');
+	begin = (begin == std::string::npos) ? 0 : begin + 1;
+	size_t end = fileName.find_last_of('.');
+	if (end == std::string::npos || end < begin) {
+		end = fileName.size();
+	}
+	return fileName.substr(begin, end - begin);
+}
+
+// Resets the peak resident set of the process to the current one, which needs Linux 4.0 or later
+bool ResetPeakMemory()
+{
+	std::ofstream file("/proc/self/clear_refs");
+	file << "5";
+	file.flush();
+	return file.good();
+}
+
+uint64_t PeakMemory()
+{
+	std::ifstream file("/proc/self/status");
+	std::string line;
+
+	while (std::getline(file, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+		}
+	}
+
+	// ru_maxrss is the peak of the whole process, and is in kilobytes on Linux
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+void SetUp(cmm::Context& context, const std::wstring& code)
+{
+	context.registerCfunction(L"print", silentPrint);
+	context.registerCfunction(L"sizeof", size);
+	context.load(code.c_str());
+	context.run(0, 0);
+}
+
+uint32_t RunMain(cmm::Context& context)
+{
+	context.getGlobal(L"main");
+	context.run(0, 1);
+	uint32_t numOps = (context.type(0) == cmm::TypeInt) ? context.getInt(0) : 0;
+	context.clear();
+	return numOps;
+}
+
+void Run(const std::string& fileName, uint32_t numWarmups, uint32_t numRuns, bool enableJit, Result& result)
+{
+	typedef std::chrono::steady_clock Clock;
+	std::wstring code;
+
+	result.name = NameOf(fileName);
+	if (LoadFile(fileName, code) == false) {
+		result.error = "the file does not exist, or is not in UTF-8";
+		return;
+	}
+
+	try {
+		cmm::Context context;
+		context.enableJit(enableJit);
+		SetUp(context, code);
+
+		for (uint32_t i = 0; i < numWarmups; i++) {
+			result.numOps = RunMain(context);
+			context.garbageCollect();
+		}
+
+		std::vector<double> times;
+		for (uint32_t i = 0; i < numRuns; i++) {
+			Clock::time_point begin = Clock::now();
+			result.numOps = RunMain(context);
+			context.garbageCollect();
+			times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - begin).count());
+		}
+
+		result.numRuns = numRuns;
+		result.min = times.empty() ? 0.0 : times[0];
+		result.max = result.min;
+		double sum = 0.0;
+		for (double time : times) {
+			sum += time;
+			result.min = std::min(result.min, time);
+			result.max = std::max(result.max, time);
+		}
+		result.mean = times.empty() ? 0.0 : sum / times.size();
+		double squares = 0.0;
+		for (double time : times) {
+			squares += (time - result.mean) * (time - result.mean);
+		}
+		result.deviation = times.size() < 2 ? 0.0 : std::sqrt(squares / (times.size() - 1));
+
+		result.peakMemory = PeakMemory();
+		result.numQuickened = context.numQuickened();
+		result.numDequickened = context.numDequickened();
+
+		if (CMM_USE_PROFILER) {
+			cmm::Context counter;
+			SetUp(counter, code);
+			counter.enableProfiler(true);
+			RunMain(counter);
+			result.numInstructions = counter.profiler().numExecuted();
+		}
+	} catch (cmm::Error& error) {
+		const std::wstring message = error.errorStr();
+		result.error.assign(message.begin(), message.end());
+	}
+}
+
+std::string Escape(const std::string& string)
+{
+	std::string escaped;
+
+	for (char c : string) {
+		if (c == '"' || c == '\\') {
+			escaped.push_back('\\');
+			escaped.push_back(c);
+		} else if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) > 0x7e) {
+			escaped.push_back('?'); // the messages are narrowed from wide strings
+		} else {
+			escaped.push_back(c);
+		}
+	}
+	return escaped;
+}
+
+double PerSecond(double count, double milliseconds)
+{
+	return milliseconds <= 0.0 ? 0.0 : count * 1000.0 / milliseconds;
+}
+
+void PrintJson(const std::vector<Result>& results, uint32_t numWarmups, uint32_t numRuns, bool enableJit, bool perWorkloadMemory)
+{
+	printf("{\n  \"config\": {\"dispatch\": \"%s\", \"quickening\": %s, \"jit\": \"%s\", \"profiler\": %s, "
+	       "\"warmup\": %u, \"repeat\": %u, \"peak_memory\": \"%s\"},\n  \"workloads\": [",
+	       CMM_USE_COMPUTED_GOTO ? "threaded" : "switch",
+	       CMM_USE_QUICKENING ? "true" : "false",
+	       (enableJit && CMM_USE_JIT) ? (CMM_USE_TRACING ? "tracing" : "baseline") : "off",
+	       CMM_USE_PROFILER ? "true" : "false",
+	       numWarmups, numRuns, perWorkloadMemory ? "workload" : "process");
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& result = results[i];
+
+		printf("%s\n    {\"name\": \"%s\"", i == 0 ? "" : ",", Escape(result.name).c_str());
+		if (result.error.empty() == false) {
+			printf(", \"error\": \"%s\"}", Escape(result.error).c_str());
+			continue;
+		}
+
+		printf(", \"ops\": %u, \"runs\": %u, \"mean_ms\": %.6f, \"min_ms\": %.6f, \"max_ms\": %.6f, \"stddev_ms\": %.6f, "
+		       "\"ops_per_sec\": %.1f, ",
+		       result.numOps, result.numRuns, result.mean, result.min, result.max, result.deviation,
+		       PerSecond(result.numOps, result.mean));
+		if (result.numInstructions != 0) {
+			printf("\"instructions\": %llu, \"instructions_per_sec\": %.1f, ",
+			       static_cast<unsigned long long>(result.numInstructions), PerSecond(static_cast<double>(result.numInstructions), result.mean));
+		} else {
+			printf("\"instructions\": null, \"instructions_per_sec\": null, ");
+		}
+		printf("\"peak_memory_bytes\": %llu, \"quickened\": %u, \"dequickened\": %u}",
+		       static_cast<unsigned long long>(result.peakMemory), result.numQuickened, result.numDequickened);
+	}
+	printf("\n  ]\n}\n");
+}
+
+} // The end of anomymous namespace
+
+int main(int argc, char* argv[])
+{
+	uint32_t numWarmups = 3;
+	uint32_t numRuns = 10;
+	bool enableJit = false;
+	std::vector<std::string> fileNames;
+
+	setlocale(LC_CTYPE, "C.UTF-8");
+
+	for (int i = 1; i < argc; i++) {
+		const std::string arg(argv[i]);
+
+		if (arg == "-jit") {
+			enableJit = true;
+		} else if (arg == "-warmup" && i + 1 < argc) {
+			numWarmups = strtoul(argv[++i], nullptr, 10);
+		} else if (arg == "-repeat" && i + 1 < argc) {
+			numRuns = strtoul(argv[++i], nullptr, 10);
+		} else {
+			fileNames.push_back(arg);
+		}
+	}
+
+	if (fileNames.empty()) {
+		fprintf(stderr, "usage: %s [-jit] [-warmup <runs>] [-repeat <runs>] workload.cmm ...\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<Result> results(fileNames.size(), Result());
+	bool perWorkloadMemory = true;
+
+	for (size_t i = 0; i < fileNames.size(); i++) {
+		perWorkloadMemory = ResetPeakMemory() && perWorkloadMemory;
+		Run(fileNames[i], numWarmups, numRuns, enableJit, results[i]);
+	}
+
+	PrintJson(results, numWarmups, numRuns, enableJit, perWorkloadMemory);
+	return 0;
+}
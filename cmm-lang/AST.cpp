@@ -114,7 +114,7 @@ void CompoundStmt::accept(Visitor& visitor)
 
 
 LoopStmt::LoopStmt()
-: continueLabel(UINT32_MAX), breakLabel(UINT32_MAX)
+: continueLabel(UINT32_MAX), breakLabel(UINT32_MAX), registerLevel(UINT32_MAX), numCaptured(0)
 {
 }
 
@@ -125,7 +125,8 @@ LoopStmt::~LoopStmt()
 
 
 ForStmt::ForStmt(StatementPtr init, ExpressionPtr cond, StatementPtr iter, StatementPtr contents)
-: initial(std::move(init)), condition(std::move(cond)), iteration(std::move(iter)), contents(std::move(contents))
+: initial(std::move(init)), condition(std::move(cond)), iteration(std::move(iter)), contents(std::move(contents)),
+  counter(nullptr), limit(nullptr), step(0)
 {
 }
 
@@ -222,7 +223,8 @@ void JumpStmt::accept(Visitor& visitor)
 
 
 VariableStmt::VariableStmt(const std::wstring& name, ExpressionPtr init)
-: name(name), init(std::move(init)), registerOffset(UINT32_MAX), scopeLevel(UINT32_MAX), functionLevel(UINT32_MAX)
+: name(name), init(std::move(init)), registerOffset(UINT32_MAX), scopeLevel(UINT32_MAX), functionLevel(UINT32_MAX),
+  captured(false)
 {
 }
 
@@ -28,6 +28,9 @@ constexpr uint32_t FLAG_INTVALUE  = 0x00000100; // An expression is an integer t
 constexpr uint32_t FLAG_ARRAY     = 0x00000200; // A table initializer does not has a key or its key is an integer terminal
 constexpr uint32_t FLAG_TEMP      = 0x00000400; // The result of an expression is located on temporary register
 constexpr uint32_t FLAG_TEMPTABLE = 0x00000800; // The table and key value of an expression is located on temporary register
+constexpr uint32_t FLAG_CONSTANT  = 0x00001000; // An expression is a literal constant terminal
+constexpr uint32_t FLAG_CONSTKEY  = 0x00002000; // The key of a table value is a constant, which is not located on any register
+constexpr uint32_t FLAG_COMPARE   = 0x00004000; // An expression is a relational comparison, which can be fused with a conditional jump
 
 class Visitor;
 
@@ -74,7 +77,8 @@ struct Expression : public Base
 	uint32_t             lvalue2;
 	// If an expression is table value then offset of register that stores table and key are assigned to lvalue1 and lvalue2
 	// If an expression is constant then index of corresponding constant is assigned to lvalue1
-	// If an expression is upvalue then offset and function level of corresponding upvalue are assigned to lvalue1 and lvalue2
+	// If an expression is table value with constant key then index of the key constant is assigned to lvalue2
+	// If an expression is upvalue then index of corresponding upvalue is assigned to lvalue1
 };
 
 
@@ -128,6 +132,8 @@ struct LoopStmt : public Statement
 
 	uint32_t             continueLabel;
 	uint32_t             breakLabel;
+	uint32_t             registerLevel; // the locals declared in the loop are on this register and above
+	uint32_t             numCaptured;   // the captured locals the code generator had met before the loop
 };
 
 
@@ -141,6 +147,12 @@ struct ForStmt : public LoopStmt
 	ExpressionPtr        condition;
 	StatementPtr         iteration;
 	StatementPtr         contents;
+
+	// If the loop counts a local variable as "i < n; i++" then the analyzer sets the counter (i), the limit (n)
+	// which is a local variable or a number literal, and the step of the iteration (i++, i--, i += 2 ...)
+	TerminalExpr*        counter;
+	TerminalExpr*        limit;
+	int32_t              step;
 };
 
 
@@ -219,6 +231,7 @@ struct VariableStmt : public Statement
 	uint32_t             registerOffset;
 	uint32_t             scopeLevel;
 	uint32_t             functionLevel;
+	bool                 captured; // referred by an inner function, so it has an upvalue
 };
 
 
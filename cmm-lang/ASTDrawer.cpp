@@ -56,6 +56,9 @@ void ASTDrawer::appendFlagInfo_(const AST::Base& node)
 	if (node.flag & AST::FLAG_ARRAY)     { append_(L"ARRAY "); }
 	if (node.flag & AST::FLAG_TEMP)      { append_(L"TEMP "); }
 	if (node.flag & AST::FLAG_TEMPTABLE) { append_(L"TEMPTABLE "); }
+	if (node.flag & AST::FLAG_CONSTANT)  { append_(L"CONSTANT "); }
+	if (node.flag & AST::FLAG_CONSTKEY)  { append_(L"CONSTKEY "); }
+	if (node.flag & AST::FLAG_COMPARE)   { append_(L"COMPARE "); }
 	append_(L"\n");
 }
 
@@ -226,6 +229,7 @@ void ASTDrawer::visit(AST::FunctionDefinition& functionDef)
 	appendNumberInfo_(L"Function Level : %d", functionDef.functionLevel);
 	appendNumberInfo_(L"Function Number : %d", functionDef.functionNum);
 	appendNumberInfo_(L"Number of Variables : %d", functionDef.numVariable);
+	appendNumberInfo_(L"Number of Upvalues : %d", functionDef.upValues.size());
 	pushTreeLine_(true);
 	appendNewline_();
 
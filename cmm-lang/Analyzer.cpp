@@ -3,6 +3,7 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cwchar>
 #include <algorithm>
 
 #include "Error.h"
@@ -80,7 +81,9 @@ void Analyzer::visit(AST::ForStmt& forStmt)
 	scopeManager_.openScope();
 	safeVisit_(forStmt.initial.get());
 	safeVisit_(forStmt.condition.get());
+	lastStep_ = Step_();
 	safeVisit_(forStmt.iteration.get());
+	recognizeCountingLoop_(forStmt);
 	scopeManager_.openLoop(forStmt);
 	safeVisit_(forStmt.contents.get());
 	scopeManager_.closeLoop();
@@ -164,6 +167,11 @@ void Analyzer::visit(AST::UnaryExpr& unaryExpr)
 		} else {
 			throw Error(L"Operand of increment/decrement must be non-conditional l-value");			
 		}
+		if (unaryExpr.op == AST::UnaryExpr::PREFIX_INC || unaryExpr.op == AST::UnaryExpr::POSTFIX_INC) {
+			recordStep_(unaryExpr, firstExpr, 1);
+		} else {
+			recordStep_(unaryExpr, firstExpr, -1);
+		}
 		return;
 	default: return;
 	}
@@ -199,6 +207,23 @@ void Analyzer::visit(AST::BinaryExpr& binaryExpr)
 		} else {
 			throw Error(L"left operand of assign operator must be non-conditional l-value");
 		}
+		if ((binaryExpr.op == AST::BinaryExpr::ASSIGN_ADD || binaryExpr.op == AST::BinaryExpr::ASSIGN_SUB) &&
+		    (binaryExpr.first->flag & AST::FLAG_INTVALUE)) {
+			const AST::TerminalExpr &valueExpr = static_cast<const AST::TerminalExpr&>(*binaryExpr.first);
+			const long value = std::wcstol(valueExpr.lexeme.c_str(), nullptr, 10);
+			if (value <= INT32_MAX) {
+				const int32_t step = static_cast<int32_t>(value);
+				recordStep_(binaryExpr, secondExpr, (binaryExpr.op == AST::BinaryExpr::ASSIGN_ADD) ? step : -step);
+			}
+		}
+		return;
+	case AST::BinaryExpr::LOGIC_EQ:
+	case AST::BinaryExpr::LOGIC_NOTEQ:
+	case AST::BinaryExpr::LOGIC_GREATER:
+	case AST::BinaryExpr::LOGIC_GE:
+	case AST::BinaryExpr::LOGIC_LESS:
+	case AST::BinaryExpr::LOGIC_LE:
+		binaryExpr.flag |= AST::FLAG_COMPARE;
 		return;
 	default:
 		return;
@@ -224,12 +249,85 @@ void Analyzer::visit(AST::TerminalExpr& terminalExpr)
 			terminalExpr.flag = AST::FLAG_LVALUE | AST::FLAG_GLOBAL;
 		} else if (terminalExpr.correspondingVar->functionLevel < scopeManager_.functionLevel()) {
 			terminalExpr.flag = AST::FLAG_LVALUE | AST::FLAG_UPVALUE;
+			scopeManager_.registerUpValue(*terminalExpr.correspondingVar);
 		} else {
 			terminalExpr.flag = AST::FLAG_LVALUE;
 		}
-	} else if (terminalExpr.type == AST::TerminalExpr::INTEGER) {
-		terminalExpr.flag |= AST::FLAG_INTVALUE;
+	} else {
+		terminalExpr.flag |= AST::FLAG_CONSTANT;
+		if (terminalExpr.type == AST::TerminalExpr::INTEGER) {
+			terminalExpr.flag |= AST::FLAG_INTVALUE;
+		}
+	}
+}
+
+
+// If an expression is a local variable of the current function then returns it as a terminal expression
+AST::TerminalExpr* Analyzer::localVariable_(AST::Expression& expr)
+{
+	const uint32_t kind = AST::FLAG_LVALUE | AST::FLAG_TABLE | AST::FLAG_GLOBAL | AST::FLAG_UPVALUE;
+
+	if ((expr.flag & kind) == AST::FLAG_LVALUE) {
+		return static_cast<AST::TerminalExpr*>(&expr); // only an identifier is l-value without being a table value
+	}
+	return nullptr;
+}
+
+void Analyzer::recordStep_(AST::Expression& expr, AST::Expression& variable, int32_t step)
+{
+	AST::TerminalExpr *localVar = localVariable_(variable);
+
+	if (localVar != nullptr) {
+		lastStep_.expression = &expr;
+		lastStep_.variable = localVar;
+		lastStep_.step = step;
+	}
+}
+
+/*
+ * Recognize a counting for loop, which is compiled to FORPREP and FORLOOP
+ *
+ *  for (...; i < n; i++)       - i is a local variable
+ *  for (...; i >= 0; i -= 2)   - n is a local variable or a number literal
+ */
+void Analyzer::recognizeCountingLoop_(AST::ForStmt& forStmt)
+{
+	if (forStmt.condition == nullptr || forStmt.iteration == nullptr || lastStep_.variable == nullptr) {
+		return;
+	}
+	// the iteration of a for statement is always an expression statement
+	if (static_cast<AST::ExpressionStmt&>(*forStmt.iteration).expression.get() != lastStep_.expression) {
+		return;
+	}
+	if (!(forStmt.condition->flag & AST::FLAG_COMPARE)) {
+		return;
+	}
+
+	AST::BinaryExpr &compareExpr = static_cast<AST::BinaryExpr&>(*forStmt.condition);
+	if (compareExpr.op == AST::BinaryExpr::LOGIC_EQ || compareExpr.op == AST::BinaryExpr::LOGIC_NOTEQ) {
+		return;
+	}
+
+	AST::TerminalExpr *counter = localVariable_(*compareExpr.first);
+	if (counter == nullptr || counter->correspondingVar != lastStep_.variable->correspondingVar) {
+		return;
+	}
+
+	AST::TerminalExpr *limit = localVariable_(*compareExpr.second);
+	if (limit == nullptr && (compareExpr.second->flag & AST::FLAG_CONSTANT)) {
+		limit = static_cast<AST::TerminalExpr*>(compareExpr.second.get());
+		if (limit->type != AST::TerminalExpr::INTEGER && limit->type != AST::TerminalExpr::HEX &&
+		    limit->type != AST::TerminalExpr::FLOAT) {
+			return;
+		}
+	}
+	if (limit == nullptr) {
+		return;
 	}
+
+	forStmt.counter = counter;
+	forStmt.limit = limit;
+	forStmt.step = lastStep_.step;
 }
 
 
@@ -336,6 +434,22 @@ void ScopeManager::registerVariable(AST::VariableStmt& variableStmt)
 	functionStack_.back().numVariable++;
 }
 
+// A new function copies its upvalues from the function which creates it, so every function between
+// the one declaring the variable and the current one has the variable as an upvalue as well.
+void ScopeManager::registerUpValue(AST::VariableStmt& variableStmt)
+{
+	assert(variableStmt.functionLevel < functionStack_.size());
+
+	variableStmt.captured = true;
+	for (uint32_t i = variableStmt.functionLevel + 1; i < functionStack_.size(); i++) {
+		AST::FunctionDefinition::VariableVector &upValues = functionStack_[i].functionDef->upValues;
+
+		if (std::find(upValues.begin(), upValues.end(), &variableStmt) == upValues.end()) {
+			upValues.push_back(&variableStmt);
+		}
+	}
+}
+
 AST::FunctionDefinition& ScopeManager::currentFunction()
 {
 	return *functionStack_.back().functionDef;
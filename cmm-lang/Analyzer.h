@@ -27,6 +27,7 @@ public:
 	void                      openLoop(AST::LoopStmt& loopStmt);
 	void                      closeLoop();
 	void                      registerVariable(AST::VariableStmt& variableStmt);
+	void                      registerUpValue(AST::VariableStmt& variableStmt);
 	AST::FunctionDefinition&  currentFunction();
 	AST::LoopStmt*            retrieveNearestLoop();
 	AST::VariableStmt*        retrieveVariable(const std::wstring& identifier);
@@ -93,7 +94,23 @@ private:
 
 	bool                safeVisit_(AST::Base* host);
 
+	void                recordStep_(AST::Expression& expr, AST::Expression& variable, int32_t step);
+	void                recognizeCountingLoop_(AST::ForStmt& forStmt);
+	static AST::TerminalExpr*  localVariable_(AST::Expression& expr);
+
+	// The last increment, decrement or compound assignment by an integer literal of a local variable,
+	// which is the iteration of a counting for loop if it is the iteration expression itself
+	struct Step_
+	{
+		Step_() : expression(nullptr), variable(nullptr), step(0) {}
+
+		AST::Expression*    expression;
+		AST::TerminalExpr*  variable;
+		int32_t             step;
+	};
+
 	ScopeManager        scopeManager_;
+	Step_               lastStep_;
 };
 
 } // namespace "cmm"
@@ -0,0 +1,206 @@
+#ifndef BINDING_H
+#define BINDING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <type_traits>
+
+#include "Context.h"
+#include "DataType.h"
+#include "Error.h"
+
+// Context::bind() registers a plain C++ function as a C function of C--.
+//
+//   int32_t add(int32_t a, int32_t b) { return a + b; }
+//
+//   context.bind<decltype(&add), &add>(L"add");
+//   CMM_BIND(context, L"add", add); // same as above
+//
+// The argument and return types are deduced at compile time, and the generated thunk reads the arguments
+// straight from the argument window of the call and writes the result in place, checking each argument once.
+//  - argument types : int32_t, float, bool, const wchar_t*, std::wstring, Array&, Table&
+//  - return types   : void, int32_t, float, bool, const wchar_t*, std::wstring
+// An int is accepted as a float argument, and any value is accepted as a bool argument. The function has to be
+// called with as many arguments as it takes, and a null const wchar_t* it returns becomes null.
+
+#define CMM_BIND(context, name, function) (context).bind<decltype(&function), &function>(name)
+
+namespace cmm
+{
+
+namespace Binding
+{
+
+// Opens the communication stack of a context to the thunks
+struct Access
+{
+	static Variable*       window(Context& context)        { return context.window_; }
+	static uint32_t&       size(Context& context)          { return context.bufferSize_; }
+	static ObjectManager*  objectManager(Context& context) { return &context.objectManager_; }
+};
+
+
+// Marshal<T> converts a C-- value to the C++ type T and back
+template <typename T>
+struct Marshal;
+
+template <>
+struct Marshal<int32_t>
+{
+	static const wchar_t*  name()                             { return L"integer"; }
+	static bool            check(const Variable& value)       { return value.t == TypeInt; }
+	static int32_t         get(const Variable& value)         { return value.v.i; }
+	static Variable        make(Context&, int32_t value)      { return Variable(value); }
+};
+
+template <>
+struct Marshal<float>
+{
+	static const wchar_t*  name()                             { return L"number"; }
+	static bool            check(const Variable& value)       { return value.isNumber(); }
+	static float           get(const Variable& value)         { return (value.t == TypeInt) ? static_cast<float>(value.v.i) : value.v.f; }
+	static Variable        make(Context&, float value)        { return Variable(value); }
+};
+
+template <>
+struct Marshal<bool>
+{
+	static const wchar_t*  name()                             { return L"boolean"; }
+	static bool            check(const Variable&)             { return true; }
+	static Variable        make(Context&, bool value)         { return Variable(value); }
+	static bool            get(const Variable& value)
+	{
+		switch (value.t) {
+		case TypeNull:  return false;
+		case TypeInt:   return value.v.i != 0;
+		case TypeFloat: return value.v.f != 0.0f;
+		default:        return true;
+		}
+	}
+};
+
+template <>
+struct Marshal<const wchar_t*>
+{
+	static const wchar_t*  name()                             { return L"string"; }
+	static bool            check(const Variable& value)       { return value.t == TypeString; }
+	static const wchar_t*  get(const Variable& value)         { return static_cast<String*>(value.v.obj)->value().c_str(); }
+	static Variable        make(Context& context, const wchar_t* value)
+	{
+		if (value == nullptr) {
+			return Variable(TypeNull);
+		}
+		return Variable(TypeString, new String(value, Access::objectManager(context)));
+	}
+};
+
+template <>
+struct Marshal<std::wstring>
+{
+	static const wchar_t*  name()                             { return L"string"; }
+	static bool            check(const Variable& value)       { return value.t == TypeString; }
+	static std::wstring    get(const Variable& value)         { return static_cast<String*>(value.v.obj)->value(); }
+	static Variable        make(Context& context, const std::wstring& value)
+	{
+		return Variable(TypeString, new String(value, Access::objectManager(context)));
+	}
+};
+
+template <>
+struct Marshal<Array>
+{
+	static const wchar_t*  name()                             { return L"array"; }
+	static bool            check(const Variable& value)       { return value.t == TypeArray; }
+	static Array&          get(const Variable& value)         { return *static_cast<Array*>(value.v.obj); }
+};
+
+template <>
+struct Marshal<Table>
+{
+	static const wchar_t*  name()                             { return L"table"; }
+	static bool            check(const Variable& value)       { return value.t == TypeTable; }
+	static Table&          get(const Variable& value)         { return *static_cast<Table*>(value.v.obj); }
+};
+
+
+// Invoker<R> calls a function and leaves its result of the type R as the only value of the stack
+template <typename R>
+struct Invoker
+{
+	template <typename Function, typename... Args>
+	static void invoke(Context& context, Function function, Args&&... args)
+	{
+		Variable result = Marshal<typename std::decay<R>::type>::make(context, function(std::forward<Args>(args)...));
+		Access::window(context)[0] = std::move(result);
+		Access::size(context) = 1;
+	}
+};
+
+template <>
+struct Invoker<void>
+{
+	template <typename Function, typename... Args>
+	static void invoke(Context& context, Function function, Args&&... args)
+	{
+		function(std::forward<Args>(args)...);
+		Access::size(context) = 0;
+	}
+};
+
+
+// The arguments are numbered from 1 in the message, as the script writer counts them
+template <typename T>
+inline int checkArgument(const Variable& value, std::size_t index)
+{
+	if (Marshal<T>::check(value) == false) {
+		throw Error(L"argument %d of a bound function should be %ls value.", static_cast<int>(index + 1), Marshal<T>::name());
+	}
+	return 0;
+}
+
+// Thunk<Signature, function>::call is the C function registered for the C++ function.
+// The arguments left in the window are released by the caller after the call.
+template <typename Signature, Signature function>
+struct Thunk;
+
+template <typename R, typename... Args, R (*function)(Args...)>
+struct Thunk<R (*)(Args...), function>
+{
+	static void call(Context& context)
+	{
+		call_(context, std::index_sequence_for<Args...>());
+	}
+
+private:
+	template <std::size_t... Index>
+	static void call_(Context& context, std::index_sequence<Index...>)
+	{
+		const Variable* args = Access::window(context);
+
+		if (Access::size(context) != sizeof...(Args)) {
+			throw Error(L"a bound function needs %d arguments, but %d arguments are given.",
+			            static_cast<int>(sizeof...(Args)), static_cast<int>(Access::size(context)));
+		}
+
+		int checked[] = { 0, checkArgument<typename std::decay<Args>::type>(args[Index], Index)... };
+		(void)checked;
+		(void)args;
+
+		Invoker<R>::invoke(context, function, Marshal<typename std::decay<Args>::type>::get(args[Index])...);
+	}
+};
+
+} // namespace "Binding"
+
+
+template <typename Signature, Signature function>
+inline void Context::bind(const wchar_t name[])
+{
+	registerCfunction(name, &Binding::Thunk<Signature, function>::call);
+}
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
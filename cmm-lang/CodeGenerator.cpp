@@ -42,12 +42,34 @@ float wtof(const wchar_t lexeme[])
 }
 #pragma warning (pop)
 
+// Returns the K-variant of an opcode, which takes a constant as its third operand.
+// If the constant is the first operand of the original operation (swapped), the returned opcode
+// computes the same result with the operands exchanged. OPCODE_END means there is no such variant.
+Instruction::Opcode constantOpcode(Instruction::Opcode op, bool swapped)
+{
+	switch (op) {
+	case Instruction::ADD:   return swapped ? Instruction::OPCODE_END : Instruction::ADDK; // String concatenation is not commutative
+	case Instruction::SUB:   return swapped ? Instruction::OPCODE_END : Instruction::SUBK;
+	case Instruction::MUL:   return Instruction::MULK;
+	case Instruction::DIV:   return swapped ? Instruction::OPCODE_END : Instruction::DIVK;
+	case Instruction::MOD:   return swapped ? Instruction::OPCODE_END : Instruction::MODK;
+	case Instruction::EQ:    return Instruction::EQK;
+	case Instruction::NOTEQ: return Instruction::NOTEQK;
+	case Instruction::LT:    return swapped ? Instruction::GTK : Instruction::LTK;
+	case Instruction::LE:    return swapped ? Instruction::GEK : Instruction::LEK;
+	case Instruction::JEQ:   return Instruction::JEQK;
+	case Instruction::JLT:   return swapped ? Instruction::JGTK : Instruction::JLTK;
+	case Instruction::JLE:   return swapped ? Instruction::JGEK : Instruction::JLEK;
+	default:                 return Instruction::OPCODE_END;
+	}
+}
+
 } // The end of anonymous namespace for utility functions only used in code generator class
 
 
 
 CodeGenerator::CodeGenerator(ObjectManager& objectManager)
-: objectManager_(objectManager)
+: objectManager_(objectManager), functionDef_(nullptr), line_(0), numCaptured_(0)
 {
 }
 
@@ -61,6 +83,9 @@ CodeGenerator::~CodeGenerator()
 Ref<Prototype> CodeGenerator::createPrototype(AST::FunctionDefinition& functionDef)
 {
 	prototype_ = Ref<Prototype>(new Prototype(&objectManager_));
+	functionDef_ = &functionDef;
+	prototype_->lineDefined_ = functionDef.position.startLine;
+	line_ = functionDef.position.startLine;
 
 	safeVisit_(functionDef.arguments.get());
 	safeVisit_(functionDef.contents.get());
@@ -73,6 +98,7 @@ Ref<Prototype> CodeGenerator::createPrototype(AST::FunctionDefinition& functionD
 	prototype_->localSize_ = register_.maxSize();
 	prototype_->functionLevel_ = functionDef.functionLevel;
 	prototype_->numArgs_ = functionDef.arguments->statementList.size();
+	prototype_->globalCaches_.resize(prototype_->constants_.size());
 
 	return prototype_;
 }
@@ -104,20 +130,60 @@ uint32_t CodeGenerator::addConstant_(const Variable& constant)
 	return constTable.size() - 1;
 }
 
+uint32_t CodeGenerator::addConstant_(const AST::TerminalExpr& terminalExpr)
+{
+	switch (terminalExpr.type) {
+	case AST::TerminalExpr::INTEGER:
+		return addConstant_(Variable(wtoi(terminalExpr.lexeme.c_str())));
+	case AST::TerminalExpr::HEX:
+		return addConstant_(Variable(whtoi(terminalExpr.lexeme.c_str())));
+	case AST::TerminalExpr::FLOAT:
+		return addConstant_(Variable(wtof(terminalExpr.lexeme.c_str())));
+	case AST::TerminalExpr::NULLTYPE:
+		return addConstant_(Variable(TypeNull));
+	case AST::TerminalExpr::STRING:
+		return addConstant_(Variable(TypeString, new String(terminalExpr.lexeme, &objectManager_)));
+	default:
+		assert(false);
+		return UINT32_MAX;
+	}
+}
+
+// If an expression is a constant which can be an operand of a K-variant instruction then
+// returns the index of the constant, otherwise returns UINT32_MAX. The expression should not be visited
+// when it is used as a constant operand, since it does not need a register.
+uint32_t CodeGenerator::constantOperand_(const AST::Expression& expr)
+{
+	if (!(expr.flag & AST::FLAG_CONSTANT)) {
+		return UINT32_MAX;
+	}
+
+	uint32_t constIndex = addConstant_(static_cast<const AST::TerminalExpr&>(expr));
+	return (constIndex <= Instruction::MAX_C) ? constIndex : UINT32_MAX;
+}
+
+uint32_t CodeGenerator::upValueIndex_(const AST::VariableStmt& variableStmt) const
+{
+	auto &upValues = functionDef_->upValues;
+	auto result = std::find(upValues.begin(), upValues.end(), &variableStmt);
+
+	assert(result != upValues.end()); // every upvalue should be registered by the analyzer
+	return result - upValues.begin();
+}
+
 void CodeGenerator::substitueLabelToOffset()
 {
 	auto &code = prototype_->code_;
 
-	for (uint32_t offset = 0; offset < code.size(); offset++) {
-		if (code[offset].opcode == Instruction::JUMP) {
-			assert(labelManager_.getOffset(code[offset].operand1) != UINT32_MAX);
-			code[offset].operand1 = labelManager_.getOffset(code[offset].operand1) - offset;
-		} else if (code[offset].opcode == Instruction::BRANCH) {
-			assert(labelManager_.getOffset(code[offset].operand2) != UINT32_MAX);
-			code[offset].operand2 = labelManager_.getOffset(code[offset].operand2) - offset;
-		} else if (code[offset].opcode == Instruction::BRANCHNOT) {
-			assert(labelManager_.getOffset(code[offset].operand2) != UINT32_MAX);
-			code[offset].operand2 = labelManager_.getOffset(code[offset].operand2) - offset;
+	for (auto jump = jumpList_.begin(); jump != jumpList_.end(); jump++) {
+		Instruction &inst = code[jump->offset];
+		assert(labelManager_.getOffset(jump->label) != UINT32_MAX);
+		int32_t distance = labelManager_.getOffset(jump->label) - jump->offset;
+
+		if (Instruction::type[inst.opcode()] == Instruction::JUMP_OP) {
+			encode_(inst, inst.opcode(), distance);
+		} else {
+			encode_(inst, inst.opcode(), inst.a(), distance);
 		}
 	}
 }
@@ -131,7 +197,37 @@ inline void CodeGenerator::appendCode_(const Instruction::Opcode op, const int32
 	if (op == Instruction::ASSIGN && operand1 == operand2) { return; }
 	
 	auto &code = prototype_->code_;
-	code.push_back(Instruction(op, operand1, operand2, operand3));
+
+	// the destination of a jump is a label until substitueLabelToOffset() resolves it
+	switch (Instruction::type[op]) {
+	case Instruction::JUMP_OP:
+		jumpList_.push_back(Jump_(code.size(), operand1));
+		code.push_back(Instruction());
+		encode_(code.back(), op, 0);
+		break;
+	case Instruction::BRANCH_OP:
+		jumpList_.push_back(Jump_(code.size(), operand2));
+		code.push_back(Instruction());
+		encode_(code.back(), op, operand1, 0);
+		break;
+	default:
+		code.push_back(Instruction());
+		encode_(code.back(), op, operand1, operand2, operand3);
+		break;
+	}
+
+	prototype_->addLine_(line_);
+}
+
+inline void CodeGenerator::encode_(Instruction& inst, const uint32_t op, const int32_t operand1,
+                                   const int32_t operand2, const int32_t operand3)
+{
+	if (Instruction::fits(op, operand1, operand2, operand3) == false) {
+		throw Error(L"an operand of %ls instruction is out of range (the function is too complex)",
+		            Instruction::name[op].c_str());
+	}
+
+	inst = Instruction(op, operand1, operand2, operand3);
 }
 
 inline uint32_t CodeGenerator::nextOffset_()
@@ -140,6 +236,15 @@ inline uint32_t CodeGenerator::nextOffset_()
 	return code.size();
 }
 
+// The instructions appended from now on come from the line of the node. The parser locates statements,
+// and the conditions and iterations of loops which are evaluated apart from their statements.
+inline void CodeGenerator::locate_(const AST::Base& node)
+{
+	if (node.position.startLine != 0) {
+		line_ = node.position.startLine;
+	}
+}
+
 /*
  * Append unary operation
  *
@@ -150,7 +255,8 @@ inline uint32_t CodeGenerator::nextOffset_()
  * Post-condition :
  *  - a register of first sub-node would be freed if it was temporary register
  *  - a newly allocated register will store the result of operation and be returned
- *  - GETCONST 0 and a corresponding unary instruction will be appended to the instruction vector
+ *  - a corresponding unary instruction (or binary instruction with constant 0) will be appended to
+ *    the instruction vector
  */
 void CodeGenerator::appendUnaryOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op)
 {
@@ -164,11 +270,11 @@ void CodeGenerator::appendUnaryOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcod
 	unaryExpr.registerOffset = register_.allocate();
 	unaryExpr.flag |= AST::FLAG_TEMP;
 
-	uint32_t constant_0 = addConstant_(Variable(0));
-	uint32_t constRegister = register_.allocate();
-	appendCode_(Instruction::GETCONST, constRegister, constant_0);
-	appendCode_(op, unaryExpr.registerOffset, constRegister, firstExpr.registerOffset);
-	register_.deallocate(constRegister);
+	if (Instruction::type[op] == Instruction::TWO_OP) {
+		appendCode_(op, unaryExpr.registerOffset, firstExpr.registerOffset);
+	} else {
+		appendConstantOp_(op, unaryExpr.registerOffset, firstExpr.registerOffset, Variable(0));
+	}
 }
 
 /*
@@ -182,7 +288,7 @@ void CodeGenerator::appendUnaryOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcod
  * Post-condition :
  *  - a register of first sub-node would be freed if it was temporary register
  *  - a newly allocated register will store the result of operation and be returned
- *  - GETCONST 1 and a corresponding binary, store instruction will be appended to the instruction vector
+ *  - a corresponding binary instruction with constant 1 and store instruction will be appended to the instruction vector
  */
 void CodeGenerator::appendPrefixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op)
 {
@@ -192,13 +298,7 @@ void CodeGenerator::appendPrefixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opco
 	assert((firstExpr.flag & AST::FLAG_STORE) && (firstExpr.flag & AST::FLAG_LVALUE));
 	assert(firstExpr.registerOffset != UINT32_MAX);
 
-	uint32_t constant_1 = addConstant_(Variable(1));
-	uint32_t constRegister = register_.allocate();
-	appendCode_(Instruction::GETCONST, constRegister, constant_1);
-
-	appendCode_(op, firstExpr.registerOffset, firstExpr.registerOffset, constRegister);
-	
-	register_.deallocate(constRegister);
+	appendConstantOp_(op, firstExpr.registerOffset, firstExpr.registerOffset, Variable(1));
 
 	appendStoreOp_(firstExpr, firstExpr);
 	register_.deallocate(firstExpr);
@@ -221,7 +321,7 @@ void CodeGenerator::appendPrefixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opco
  *  - a register of first sub-node would be freed if it was temporary register
  *  - a newly allocated register will store original value
  *  - the result of postfix operation will be stored in the original register
- *  - GETCONST 1 and a corresponding binary, store instruction will be appended to the instruction vector
+ *  - a corresponding binary instruction with constant 1 and store instruction will be appended to the instruction vector
  */
 void CodeGenerator::appendPostfixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op)
 {
@@ -234,18 +334,15 @@ void CodeGenerator::appendPostfixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opc
 	uint32_t tempRegister = register_.allocate();
 	appendCode_(Instruction::ASSIGN, tempRegister, firstExpr.registerOffset);
 
-	uint32_t constRegister = register_.allocate();
-	uint32_t constant_1 = addConstant_(Variable(1));
-	appendCode_(Instruction::GETCONST, constRegister, constant_1);
-
 	if (firstExpr.flag & AST::FLAG_TEMP) {
-		appendCode_(op, constRegister, firstExpr.registerOffset, constRegister);
-		appendStoreOp_(constRegister, firstExpr);
+		uint32_t resultRegister = register_.allocate();
+		appendConstantOp_(op, resultRegister, firstExpr.registerOffset, Variable(1));
+		appendStoreOp_(resultRegister, firstExpr);
+		register_.deallocate(resultRegister);
 	} else {
-		appendCode_(op, firstExpr.registerOffset, firstExpr.registerOffset, constRegister);		
+		appendConstantOp_(op, firstExpr.registerOffset, firstExpr.registerOffset, Variable(1));
 	}
 
-	register_.deallocate(constRegister);
 	register_.deallocate(tempRegister);
 	register_.deallocate(firstExpr);
 	
@@ -255,6 +352,63 @@ void CodeGenerator::appendPostfixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opc
 }
 
 
+/*
+ * Append operands of binary operation
+ *
+ * Pre-condition :
+ *  - both sub-nodes can be any of l-value or r-value
+ *
+ * Post-condition :
+ *  - both sub-nodes are visited in order, except a constant which is read by K-variant instruction
+ *  - registers of both sub-node would be freed if they are temporary registers
+ *  - the opcode to be appended (op or its K-variant) is returned with its second and third operands
+ */
+Instruction::Opcode CodeGenerator::appendOperands_(AST::BinaryExpr& binaryExpr, Instruction::Opcode op, bool inverted,
+                                                   uint32_t& operand2, uint32_t& operand3)
+{
+	// lhs and rhs are the operands in the order of the instruction
+	AST::Expression &lhs = inverted ? *binaryExpr.second : *binaryExpr.first;
+	AST::Expression &rhs = inverted ? *binaryExpr.first : *binaryExpr.second;
+
+	AST::Expression *constExpr = nullptr;
+	uint32_t constIndex = UINT32_MAX;
+	Instruction::Opcode constOp = Instruction::OPCODE_END;
+
+	if ((constOp = constantOpcode(op, false)) != Instruction::OPCODE_END &&
+	    (constIndex = constantOperand_(rhs)) != UINT32_MAX) {
+		constExpr = &rhs;
+	} else if ((constOp = constantOpcode(op, true)) != Instruction::OPCODE_END &&
+	           (constIndex = constantOperand_(lhs)) != UINT32_MAX) {
+		constExpr = &lhs;
+	}
+
+	if (constExpr != binaryExpr.first.get()) {
+		safeVisit_(binaryExpr.first.get());
+		assert(binaryExpr.first->registerOffset != UINT32_MAX);
+	}
+	if (constExpr != binaryExpr.second.get()) {
+		safeVisit_(binaryExpr.second.get());
+		assert(binaryExpr.second->registerOffset != UINT32_MAX);
+	}
+
+	register_.deallocate(*binaryExpr.second);
+	register_.deallocate(*binaryExpr.first);
+
+	if (constExpr == &rhs) {
+		operand2 = lhs.registerOffset;
+		operand3 = constIndex;
+		return constOp;
+	} else if (constExpr == &lhs) {
+		operand2 = rhs.registerOffset;
+		operand3 = constIndex;
+		return constOp;
+	} else {
+		operand2 = lhs.registerOffset;
+		operand3 = rhs.registerOffset;
+		return op;
+	}
+}
+
 /*
  * Append binary operation
  *
@@ -266,29 +420,17 @@ void CodeGenerator::appendPostfixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opc
  *  - registers of both sub-node would be freed if they are temporary registers
  *  - a newly allocated register will store the result of operation value and be returned
  *  - a corresponding binary instruction will be appended to the instruction vector
+ *  - if one of sub-nodes is a constant then it is not visited, and K-variant instruction reads the constant
  */
 void CodeGenerator::appendBinaryOp_(AST::BinaryExpr& binaryExpr, Instruction::Opcode op, bool inverted)
 {
-	AST::Expression &firstExpr = *binaryExpr.first;
-	AST::Expression &secondExpr = *binaryExpr.second;
-
-	safeVisit_(binaryExpr.first.get());
-	assert(firstExpr.registerOffset != UINT32_MAX);
-	
-	safeVisit_(binaryExpr.second.get());
-	assert(secondExpr.registerOffset != UINT32_MAX);
-
-	register_.deallocate(secondExpr);
-	register_.deallocate(firstExpr);		
+	uint32_t operand2, operand3;
+	Instruction::Opcode appendedOp = appendOperands_(binaryExpr, op, inverted, operand2, operand3);
 
 	binaryExpr.registerOffset = register_.allocate();
 	binaryExpr.flag |= AST::FLAG_TEMP;
 
-	if (inverted == true) {
-		appendCode_(op, binaryExpr.registerOffset, secondExpr.registerOffset, firstExpr.registerOffset);
-	} else {
-		appendCode_(op, binaryExpr.registerOffset, firstExpr.registerOffset, secondExpr.registerOffset);
-	}
+	appendCode_(appendedOp, binaryExpr.registerOffset, operand2, operand3);
 }
 
 
@@ -306,14 +448,20 @@ void CodeGenerator::appendBinaryOp_(AST::BinaryExpr& binaryExpr, Instruction::Op
  *  - registers of both sub-node would be freed if they are temporary registers
  *  - a newly allocated register will store the result of operation and be returned
  *  - a corresponding binary instruction will be appended to the instruction vector
+ *  - if first sub-node is a constant then it is not visited, and K-variant instruction reads the constant
  */
 void CodeGenerator::appendAssignOp_(AST::BinaryExpr& binaryExpr, Instruction::Opcode op)
 {
 	AST::Expression &firstExpr = *binaryExpr.first;
 	AST::Expression &secondExpr = *binaryExpr.second;
+
+	Instruction::Opcode constOp = constantOpcode(op, false);
+	uint32_t constIndex = (constOp != Instruction::OPCODE_END) ? constantOperand_(firstExpr) : UINT32_MAX;
 		
-	safeVisit_(binaryExpr.first.get());
-	assert(firstExpr.registerOffset != UINT32_MAX);
+	if (constIndex == UINT32_MAX) {
+		safeVisit_(binaryExpr.first.get());
+		assert(firstExpr.registerOffset != UINT32_MAX);
+	}
 	
 	safeVisit_(binaryExpr.second.get());
 	assert(secondExpr.registerOffset != UINT32_MAX || secondExpr.lvalue1 != UINT32_MAX);
@@ -324,7 +472,11 @@ void CodeGenerator::appendAssignOp_(AST::BinaryExpr& binaryExpr, Instruction::Op
 	binaryExpr.registerOffset = register_.allocate();
 	binaryExpr.flag |= AST::FLAG_TEMP;
 	
-	appendCode_(op, binaryExpr.registerOffset, secondExpr.registerOffset, firstExpr.registerOffset);
+	if (constIndex != UINT32_MAX) {
+		appendCode_(constOp, binaryExpr.registerOffset, secondExpr.registerOffset, constIndex);
+	} else {
+		appendCode_(op, binaryExpr.registerOffset, secondExpr.registerOffset, firstExpr.registerOffset);
+	}
 	appendStoreOp_(binaryExpr, secondExpr);
 }
 
@@ -366,6 +518,46 @@ void CodeGenerator::appendAssignOp_(AST::BinaryExpr& binaryExpr)
 	appendCode_(Instruction::ASSIGN, binaryExpr.registerOffset, firstExpr.registerOffset);
 }
 
+/*
+ * Append conditional jump (jump to the label if the condition is evaluated as jumpIf)
+ *
+ * Post-condition :
+ *  - if the condition is a comparison then a fused compare-and-jump instruction followed by JUMP
+ *    will be appended, and the result of the comparison is not stored to any register
+ *  - otherwise BRANCH or BRANCHNOT will be appended after the instructions of the condition
+ */
+void CodeGenerator::appendConditionalJump_(AST::Expression& condition, bool jumpIf, uint32_t label)
+{
+	if (!(condition.flag & AST::FLAG_COMPARE)) {
+		safeVisit_(&condition);
+		assert(condition.registerOffset != UINT32_MAX);
+		appendCode_(jumpIf ? Instruction::BRANCH : Instruction::BRANCHNOT, condition.registerOffset, label);
+		register_.deallocate(condition);
+		return;
+	}
+
+	AST::BinaryExpr &compareExpr = static_cast<AST::BinaryExpr&>(condition);
+	Instruction::Opcode op = Instruction::OPCODE_END;
+	bool inverted = false;
+
+	// same as the comparison instructions which are appended by visit(AST::BinaryExpr&)
+	switch (compareExpr.op) {
+		case AST::BinaryExpr::LOGIC_EQ:      op = Instruction::JEQ; break;
+		case AST::BinaryExpr::LOGIC_NOTEQ:   op = Instruction::JEQ; jumpIf = !jumpIf; break;
+		case AST::BinaryExpr::LOGIC_GREATER: op = Instruction::JLE; inverted = true; break;
+		case AST::BinaryExpr::LOGIC_GE:      op = Instruction::JLT; inverted = true; break;
+		case AST::BinaryExpr::LOGIC_LESS:    op = Instruction::JLT; break;
+		case AST::BinaryExpr::LOGIC_LE:      op = Instruction::JLE; break;
+		default:                             assert(false); break;
+	}
+
+	uint32_t operand2, operand3;
+	Instruction::Opcode appendedOp = appendOperands_(compareExpr, op, inverted, operand2, operand3);
+
+	appendCode_(appendedOp, jumpIf ? 1 : 0, operand2, operand3);
+	appendCode_(Instruction::JUMP, label);
+}
+
 /*
  * Append store operation
  *
@@ -381,11 +573,15 @@ inline void CodeGenerator::appendStoreOp_(const uint32_t valueRegister, const AS
 	assert(valueRegister != UINT32_MAX);
 
 	if (dest.flag & AST::FLAG_TABLE) {
-		appendCode_(Instruction::SETTABLE, dest.lvalue1, valueRegister, dest.lvalue2);
+		if (dest.flag & AST::FLAG_CONSTKEY) {
+			appendCode_(Instruction::SETTABLEK, dest.lvalue1, valueRegister, dest.lvalue2);
+		} else {
+			appendCode_(Instruction::SETTABLE, dest.lvalue1, valueRegister, dest.lvalue2);
+		}
 	} else if (dest.flag & AST::FLAG_UPVALUE) {
-		appendCode_(Instruction::SETUPVAL, dest.lvalue2, valueRegister, dest.lvalue1);
+		appendCode_(Instruction::SETUPVAL, dest.lvalue1, valueRegister);
 	} else if (dest.flag & AST::FLAG_GLOBAL) {
-		appendCode_(Instruction::SETGLOBAL, dest.lvalue1, valueRegister);
+		appendCode_(Instruction::SETGLOBAL, valueRegister, dest.lvalue1);
 	} else {
 		appendCode_(Instruction::ASSIGN, dest.registerOffset, valueRegister);
 	}
@@ -396,6 +592,30 @@ inline void CodeGenerator::appendStoreOp_(const AST::Expression& value, const AS
 	appendStoreOp_(value.registerOffset, dest);
 }
 
+/*
+ * Append binary operation with a constant operand (dest = source op constant)
+ *
+ * Post-condition :
+ *  - a K-variant instruction will be appended to the instruction vector
+ *  - if the constant cannot be an operand then GETCONST and a corresponding binary instruction
+ *    will be appended instead
+ */
+void CodeGenerator::appendConstantOp_(const Instruction::Opcode op, const uint32_t dest,
+                                      const uint32_t source, const Variable& constant)
+{
+	Instruction::Opcode constOp = constantOpcode(op, false);
+	uint32_t constIndex = addConstant_(constant);
+
+	if (constOp != Instruction::OPCODE_END && constIndex <= Instruction::MAX_C) {
+		appendCode_(constOp, dest, source, constIndex);
+	} else {
+		uint32_t constRegister = register_.allocate();
+		appendCode_(Instruction::GETCONST, constRegister, constIndex);
+		appendCode_(op, dest, source, constRegister);
+		register_.deallocate(constRegister);
+	}
+}
+
 
 /*
  * The below code is psuedo assembly code for short-cut binary AND/OR operation
@@ -470,6 +690,7 @@ void CodeGenerator::appendShortCutLogic_(AST::BinaryExpr& binaryExpr)
  *
  * Post-condition :
  *  - a corresponding table load instruction will be appended to the instruction vector
+ *  - if the key is a constant then it is not visited, and CONSTKEY flag is set to the binary node
  */
 void CodeGenerator::appendTableLoadOp_(AST::BinaryExpr& binaryExpr)
 {
@@ -486,16 +707,24 @@ void CodeGenerator::appendTableLoadOp_(AST::BinaryExpr& binaryExpr)
 	safeVisit_(binaryExpr.first.get());
 	assert(firstExpr.registerOffset != UINT32_MAX);
 	
-	safeVisit_(binaryExpr.second.get());
-	assert(secondExpr.registerOffset != UINT32_MAX);
+	uint32_t keyIndex = constantOperand_(secondExpr);
+
+	if (keyIndex != UINT32_MAX) {
+		binaryExpr.flag |= AST::FLAG_CONSTKEY;
+	} else {
+		safeVisit_(binaryExpr.second.get());
+		assert(secondExpr.registerOffset != UINT32_MAX);
+		keyIndex = secondExpr.registerOffset;
+	}
 
 	if (!(binaryExpr.flag & AST::FLAG_NOLOAD)) {
-		appendCode_(Instruction::GETTABLE, binaryExpr.registerOffset, firstExpr.registerOffset, secondExpr.registerOffset);
+		Instruction::Opcode op = (binaryExpr.flag & AST::FLAG_CONSTKEY) ? Instruction::GETTABLEK : Instruction::GETTABLE;
+		appendCode_(op, binaryExpr.registerOffset, firstExpr.registerOffset, keyIndex);
 	}
 
 	if (binaryExpr.flag & AST::FLAG_STORE) {
 		binaryExpr.lvalue1 = firstExpr.registerOffset;
-		binaryExpr.lvalue2 = secondExpr.registerOffset;
+		binaryExpr.lvalue2 = keyIndex;
 		binaryExpr.flag |= AST::FLAG_TEMPTABLE;
 	} else {
 		register_.deallocate(secondExpr);
@@ -509,7 +738,13 @@ void CodeGenerator::visit(AST::StmtSequence& stmtSequence)
 	AST::StmtSequence::StatementVector &stmtList = stmtSequence.statementList;
 
 	std::for_each(stmtList.begin(), stmtList.end(),
-		[this](decltype(*stmtList.begin()) i) { safeVisit_(i.get()); } );
+		[this](decltype(*stmtList.begin()) i) {
+			if (i != nullptr) {
+				locate_(*i);
+			}
+			safeVisit_(i.get());
+		}
+	);
 }
 
 
@@ -518,13 +753,21 @@ void CodeGenerator::visit(AST::TableInitializer& tableInit)
 	AST::Expression& keyExpr = *tableInit.key;
 	AST::Expression& valueExpr = *tableInit.value;
 
-	safeVisit_(tableInit.key.get());
-	assert(keyExpr.registerOffset != UINT32_MAX);
+	uint32_t keyIndex = constantOperand_(keyExpr);
+
+	if (keyIndex == UINT32_MAX) {
+		safeVisit_(tableInit.key.get());
+		assert(keyExpr.registerOffset != UINT32_MAX);
+	}
 
 	safeVisit_(tableInit.value.get());
 	assert(valueExpr.registerOffset != UINT32_MAX);
 
-	appendCode_(Instruction::SETTABLE, tableInit.tableOffset, valueExpr.registerOffset, keyExpr.registerOffset);
+	if (keyIndex != UINT32_MAX) {
+		appendCode_(Instruction::SETTABLEK, tableInit.tableOffset, valueExpr.registerOffset, keyIndex);
+	} else {
+		appendCode_(Instruction::SETTABLE, tableInit.tableOffset, valueExpr.registerOffset, keyExpr.registerOffset);
+	}
 
 	register_.deallocate(valueExpr);
 	register_.deallocate(keyExpr);
@@ -538,12 +781,29 @@ void CodeGenerator::visit(AST::FunctionDefinition& functionDef)
 	functionDef.functionNum = prototype_->localPrototypes_.size();
 	Ref<Prototype> localPrototype = codeGen.createPrototype(functionDef);
 	prototype_->localPrototypes_.push_back(localPrototype);
+
+	// An upvalue of the new function is either a local variable of this function or an upvalue of this function
+	std::for_each(functionDef.upValues.begin(), functionDef.upValues.end(),
+		[this, &localPrototype](decltype(*functionDef.upValues.begin()) i) {
+			Prototype::UpValueInfo info;
+
+			info.isLocal = (i->functionLevel == functionDef_->functionLevel);
+			info.index = info.isLocal ? i->registerOffset : upValueIndex_(*i);
+			assert(info.index != UINT32_MAX);
+
+			localPrototype->upValues_.push_back(info);
+		}
+	);
 }
 
 
 void CodeGenerator::visit(AST::CompoundStmt& compoundStmt)
 {
+	const uint32_t level = register_.level();
+	const uint32_t numCaptured = numCaptured_;
+
 	safeVisit_(compoundStmt.contents.get());
+	appendClose_(level, numCaptured);
 }
 
 /*
@@ -551,11 +811,24 @@ void CodeGenerator::visit(AST::CompoundStmt& compoundStmt)
  *
  *            init()
  * condition: R1 = cond()
- *            BRANCHNOT R1 break
+ *            BRANCHNOT R1 break      (or JLT 0 R2 R3; JUMP break if cond is R2 < R3)
  *            content()
- * continue:  iter()
+ * continue:  CLOSE level             (if the loop declares captured locals)
+ *            iter()
  *            JUMP condition
- * break:
+ * break:     CLOSE level             (if the loop declares captured locals)
+ *
+ * A counting loop (AST::ForStmt::counter) keeps the comparison and the step in two instructions,
+ * so an iteration dispatches FORLOOP only instead of the iteration, the comparison and the jump.
+ *
+ *            init()
+ *            FORPREP i n step; JUMP break
+ * content:   content()
+ * continue:  CLOSE level; FORLOOP i n step; JUMP content
+ * break:     CLOSE level
+ *
+ * The upvalues of the locals declared in the loop are closed at the end of each iteration, so a closure
+ * keeps the counter and the locals of the iteration it is made in.
  *
  */
 
@@ -565,27 +838,109 @@ void CodeGenerator::visit(AST::ForStmt& forStmt)
 	uint32_t conditionLabel = labelManager_.newLabel();
 	forStmt.continueLabel = labelManager_.newLabel();
 	forStmt.breakLabel = labelManager_.newLabel();
+	forStmt.registerLevel = register_.level();
+	forStmt.numCaptured = numCaptured_;
 
 	// generate byte code for initial statement
 	safeVisit_(forStmt.initial.get());
 
+	if (forStmt.counter != nullptr && forStmt.step >= Instruction::MIN_FOR_STEP &&
+	    forStmt.step <= Instruction::MAX_FOR_STEP && forStmt.step != 0) {
+		appendCountingLoop_(forStmt);
+		return;
+	}
+
 	labelManager_.setOffset(conditionLabel, nextOffset_());
-	safeVisit_(forStmt.condition.get());
-	assert(forStmt.condition->registerOffset != UINT32_MAX);
 	
 	// if the condition is satisfied then branch to content (which is right after break instruction)
-	appendCode_(Instruction::BRANCHNOT, forStmt.condition->registerOffset, forStmt.breakLabel);
-	register_.deallocate(*forStmt.condition);
+	appendConditionalJump_(*forStmt.condition, false, forStmt.breakLabel);
 		
 	safeVisit_(forStmt.contents.get());
 
 	labelManager_.setOffset(forStmt.continueLabel, nextOffset_());
+	locate_(forStmt);
+	appendClose_(forStmt.registerLevel, forStmt.numCaptured);
+	if (forStmt.iteration != nullptr) {
+		locate_(*forStmt.iteration);
+	}
 	safeVisit_(forStmt.iteration.get());
 	
 	// jump to condition check
 	appendCode_(Instruction::JUMP, conditionLabel);
 
 	labelManager_.setOffset(forStmt.breakLabel, nextOffset_());
+	appendClose_(forStmt.registerLevel, forStmt.numCaptured);
+}
+
+/*
+ * Append counting for loop
+ *
+ * Pre-condition :
+ *  - the initial statement has been appended, and the counter is a local variable
+ *
+ * Post-condition :
+ *  - the limit is read from its local register, or a literal limit is loaded to a register which is
+ *    kept until the end of the function like a local variable, since the contents may declare variables above it
+ *  - the comparison is same as the one appendConditionalJump_ appends for the condition
+ */
+void CodeGenerator::appendCountingLoop_(AST::ForStmt& forStmt)
+{
+	AST::BinaryExpr &compareExpr = static_cast<AST::BinaryExpr&>(*forStmt.condition);
+	uint32_t contentLabel = labelManager_.newLabel();
+	bool inverted = false, inclusive = false;
+
+	switch (compareExpr.op) {
+		case AST::BinaryExpr::LOGIC_GREATER: inverted = true; inclusive = true; break;
+		case AST::BinaryExpr::LOGIC_GE:      inverted = true; break;
+		case AST::BinaryExpr::LOGIC_LESS:    break;
+		case AST::BinaryExpr::LOGIC_LE:      inclusive = true; break;
+		default:                             assert(false); break;
+	}
+
+	assert(forStmt.counter->correspondingVar->registerOffset != UINT32_MAX);
+	uint32_t counterRegister = forStmt.counter->correspondingVar->registerOffset;
+	uint32_t limitRegister;
+
+	if (forStmt.limit->flag & AST::FLAG_CONSTANT) {
+		limitRegister = register_.allocate();
+		appendCode_(Instruction::GETCONST, limitRegister, addConstant_(*forStmt.limit));
+	} else {
+		assert(forStmt.limit->correspondingVar->registerOffset != UINT32_MAX);
+		limitRegister = forStmt.limit->correspondingVar->registerOffset;
+	}
+
+	uint32_t operand3 = Instruction::forOperand(forStmt.step, inverted, inclusive);
+
+	appendCode_(Instruction::FORPREP, counterRegister, limitRegister, operand3);
+	appendCode_(Instruction::JUMP, forStmt.breakLabel);
+
+	labelManager_.setOffset(contentLabel, nextOffset_());
+	safeVisit_(forStmt.contents.get());
+
+	labelManager_.setOffset(forStmt.continueLabel, nextOffset_());
+	locate_(forStmt);
+	appendClose_(forStmt.registerLevel, forStmt.numCaptured);
+	locate_(*forStmt.iteration);
+	appendCode_(Instruction::FORLOOP, counterRegister, limitRegister, operand3);
+	appendCode_(Instruction::JUMP, contentLabel);
+
+	labelManager_.setOffset(forStmt.breakLabel, nextOffset_());
+	appendClose_(forStmt.registerLevel, forStmt.numCaptured);
+}
+
+/*
+ * Append the close of the upvalues at the end of a block or an iteration
+ *
+ * Every local has a register of its own in the function, so an upvalue left open at the end of its block
+ * would be shared by the closures made by the next run of the block, e.g. the next iteration of a loop.
+ * CLOSE is appended only if a captured local has been declared since the beginning of the block,
+ * which numCaptured is the count of.
+ */
+void CodeGenerator::appendClose_(uint32_t level, uint32_t numCaptured)
+{
+	if (numCaptured_ != numCaptured) {
+		appendCode_(Instruction::CLOSE, level);
+	}
 }
 
 
@@ -593,7 +948,7 @@ void CodeGenerator::visit(AST::ForStmt& forStmt)
  * Below is psuedo assembly code of while statement
  *
  * continue:  R1 = cond()
- *            BRANCHNOT R1 break
+ *            BRANCH R1 break         (or JLT 1 R2 R3; JUMP break if cond is R2 < R3)
  *            content()
  *            JUMP continue
  * break:
@@ -604,19 +959,18 @@ void CodeGenerator::visit(AST::WhileStmt& whileStmt)
 	// allocate new label for continue and break destination
 	whileStmt.continueLabel = labelManager_.newLabel();
 	whileStmt.breakLabel = labelManager_.newLabel();
+	whileStmt.registerLevel = register_.level();
+	whileStmt.numCaptured = numCaptured_;
 
 	labelManager_.setOffset(whileStmt.continueLabel, nextOffset_());
 
-	safeVisit_(whileStmt.condition.get());
-	assert(whileStmt.condition->registerOffset != UINT32_MAX);
-
 	// if the condition is satisfied then branch to content (which is right after break instruction)
-	appendCode_(Instruction::BRANCH, whileStmt.condition->registerOffset, whileStmt.breakLabel);
-	register_.deallocate(*whileStmt.condition);
+	appendConditionalJump_(*whileStmt.condition, true, whileStmt.breakLabel);
 
 	safeVisit_(whileStmt.contents.get());
 
 	// jump to continue label
+	locate_(whileStmt);
 	appendCode_(Instruction::JUMP, whileStmt.continueLabel);
 
 	labelManager_.setOffset(whileStmt.breakLabel, nextOffset_());
@@ -627,7 +981,7 @@ void CodeGenerator::visit(AST::WhileStmt& whileStmt)
  *
  * begin:      content()
  * continue:   R1 = cond()
- *             BRANCH R1 begin
+ *             BRANCH R1 begin        (or JLT 1 R2 R3; JUMP begin if cond is R2 < R3)
  * break:
  */
 
@@ -637,16 +991,16 @@ void CodeGenerator::visit(AST::DoWhileStmt& doWhileStmt)
 	uint32_t beginLabel = labelManager_.newLabel();
 	doWhileStmt.continueLabel = labelManager_.newLabel();
 	doWhileStmt.breakLabel = labelManager_.newLabel();
+	doWhileStmt.registerLevel = register_.level();
+	doWhileStmt.numCaptured = numCaptured_;
 
 	labelManager_.setOffset(beginLabel, nextOffset_());
 	safeVisit_(doWhileStmt.contents.get());
 
 	// if the condition is satisfied then branch to content (which is right after break instruction)
 	labelManager_.setOffset(doWhileStmt.continueLabel, nextOffset_());
-	safeVisit_(doWhileStmt.condition.get());
-	assert(doWhileStmt.condition->registerOffset != UINT32_MAX);
-	appendCode_(Instruction::BRANCH, doWhileStmt.condition->registerOffset, beginLabel);
-	register_.deallocate(*doWhileStmt.condition);
+	locate_(*doWhileStmt.condition);
+	appendConditionalJump_(*doWhileStmt.condition, true, beginLabel);
 
 	labelManager_.setOffset(doWhileStmt.breakLabel, nextOffset_());
 }
@@ -655,7 +1009,7 @@ void CodeGenerator::visit(AST::DoWhileStmt& doWhileStmt)
  * Below is psuedo assembly code of if-else statement
  *
  *        R1 = cond()
- *        BRANCHNOT R1 else
+ *        BRANCHNOT R1 else           (or JLT 0 R2 R3; JUMP else if cond is R2 < R3)
  * if:    if()
  *        JUMP end
  * else:  else()
@@ -667,12 +1021,8 @@ void CodeGenerator::visit(AST::IfElseStmt& ifElseStmt)
 	uint32_t elseLabel = labelManager_.newLabel();
 	uint32_t endLabel = labelManager_.newLabel();
 
-	safeVisit_(ifElseStmt.condition.get());
-	assert(ifElseStmt.condition->registerOffset != UINT32_MAX);
-
 	// If the condition is not satisfied then branch to else label
-	appendCode_(Instruction::BRANCHNOT, ifElseStmt.condition->registerOffset, elseLabel);
-	register_.deallocate(*ifElseStmt.condition);
+	appendConditionalJump_(*ifElseStmt.condition, false, elseLabel);
 		
 	safeVisit_(ifElseStmt.ifContents.get());
 
@@ -701,6 +1051,16 @@ void CodeGenerator::visit(AST::ReturnStmt& returnStmt)
 		type = Instruction::YIELD;
 	}
 
+	// When the returned value is the result of the call which was emitted last, the caller has nothing left to do
+	// after the call, so it becomes a tail call. RETURN still follows, since a C function is called by TAILCALL
+	// as usual and other branches of the expression may jump to it.
+	auto &code = prototype_->code_;
+
+	if (type == Instruction::RETURN && returnStmt.returnExpr != nullptr && code.empty() == false &&
+	    code.back().opcode() == Instruction::CALL && code.back().a() == returnStmt.returnExpr->registerOffset) {
+		encode_(code.back(), Instruction::TAILCALL, code.back().a(), code.back().b(), code.back().c());
+	}
+
 	if (returnStmt.returnExpr == nullptr) {
 		appendCode_(type, 0, 0);
 	} else {
@@ -714,6 +1074,8 @@ void CodeGenerator::visit(AST::JumpStmt& jumpStmt)
 	AST::LoopStmt &loop = *jumpStmt.correspondingLoop;
 	uint32_t jumpLabel = (jumpStmt.type == AST::JumpStmt::BREAK) ? loop.breakLabel : loop.continueLabel; 
 
+	// The blocks left by the jump do not reach their own CLOSE
+	appendClose_(loop.registerLevel, loop.numCaptured);
 	appendCode_(Instruction::JUMP, jumpLabel);
 }
 
@@ -721,6 +1083,9 @@ void CodeGenerator::visit(AST::JumpStmt& jumpStmt)
 void CodeGenerator::visit(AST::VariableStmt& variableStmt)
 {
 	variableStmt.registerOffset = register_.allocate();
+	if (variableStmt.captured) {
+		numCaptured_++;
+	}
 		
 	safeVisit_(variableStmt.init.get());
 
@@ -745,7 +1110,7 @@ void CodeGenerator::visit(AST::UnaryExpr& unaryExpr)
 {
 	switch (unaryExpr.op) {
 	case AST::UnaryExpr::PLUS:        appendUnaryOp_(unaryExpr, Instruction::ADD); break;
-	case AST::UnaryExpr::MINUS:       appendUnaryOp_(unaryExpr, Instruction::SUB); break;
+	case AST::UnaryExpr::MINUS:       appendUnaryOp_(unaryExpr, Instruction::UNM); break;
 	case AST::UnaryExpr::PREFIX_INC:  appendPrefixOp_(unaryExpr, Instruction::ADD); break; 
 	case AST::UnaryExpr::PREFIX_DEC:  appendPrefixOp_(unaryExpr, Instruction::SUB); break; 
 	case AST::UnaryExpr::POSTFIX_INC: appendPostfixOp_(unaryExpr, Instruction::ADD); break;
@@ -870,12 +1235,10 @@ void CodeGenerator::visit(AST::TerminalExpr& terminalExpr)
 			if (!(terminalExpr.flag & AST::FLAG_NOLOAD)) {
 				terminalExpr.registerOffset = register_.allocate();
 				terminalExpr.flag |= AST::FLAG_TEMP;
-				appendCode_(Instruction::GETUPVAL, terminalExpr.registerOffset,
-				            corresponding.registerOffset, corresponding.functionLevel);
+				appendCode_(Instruction::GETUPVAL, terminalExpr.registerOffset, upValueIndex_(corresponding));
 			} 
 			if (terminalExpr.flag & AST::FLAG_STORE) {
-				terminalExpr.lvalue1 = corresponding.functionLevel;
-				terminalExpr.lvalue2 = corresponding.registerOffset;
+				terminalExpr.lvalue1 = upValueIndex_(corresponding);
 			}
 		} else {
 			if (terminalExpr.flag & AST::FLAG_LOAD) {
@@ -887,40 +1250,7 @@ void CodeGenerator::visit(AST::TerminalExpr& terminalExpr)
 			}
 		}
 	} else {
-		uint32_t constIndex = UINT32_MAX; // To remove compiler warning
-
-		switch (terminalExpr.type) {
-		case AST::TerminalExpr::INTEGER:
-		{
-			int32_t integer = wtoi(terminalExpr.lexeme.c_str());
-			constIndex = addConstant_(Variable(integer));
-			break;
-		}
-		case AST::TerminalExpr::HEX:
-		{
-			int32_t integer = whtoi(terminalExpr.lexeme.c_str());
-			constIndex = addConstant_(Variable(integer));
-			break;
-		}
-		case AST::TerminalExpr::FLOAT:
-		{
-			float floating = wtof(terminalExpr.lexeme.c_str());
-			constIndex = addConstant_(Variable(floating));
-			break;
-		}
-		case AST::TerminalExpr::NULLTYPE:
-		{
-			constIndex = addConstant_(Variable(TypeNull));
-			break;
-		}
-		case AST::TerminalExpr::STRING:
-		{
-			String* constString = new String(terminalExpr.lexeme, &objectManager_);
-			constIndex = addConstant_(Variable(TypeString, constString));
-			break;
-		}
-		default: assert(false);
-		}
+		uint32_t constIndex = addConstant_(terminalExpr);
 
 		terminalExpr.registerOffset = register_.allocate();
 		appendCode_(Instruction::GETCONST, terminalExpr.registerOffset, constIndex);
@@ -1067,6 +1397,8 @@ void Register::deallocate(const AST::Expression& expr)
 		if (expr.flag & AST::FLAG_TEMP) {
 			deallocate(expr.registerOffset);
 		}
+	} else if (expr.registerOffset == UINT32_MAX) {
+		assert(expr.flag & AST::FLAG_CONSTANT); // a constant operand is not located on any register
 	} else {
 		assert(expr.registerOffset == numRegister_ - 1);
 		numRegister_--;
@@ -1090,6 +1422,11 @@ uint32_t Register::maxSize()
 	return maxNumRegister_;
 }
 
+uint32_t Register::level()
+{
+	return numRegister_;
+}
+
 
 
 } // namespace "cmm"
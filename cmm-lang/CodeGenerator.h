@@ -56,6 +56,7 @@ public:
 	void        deallocate(const AST::Expression& expr);
 	void        reset();
 	uint32_t    maxSize();
+	uint32_t    level(); // the register allocated next
 
 private:
 	uint32_t    numRegister_;
@@ -99,29 +100,57 @@ private:
     bool            safeVisit_(AST::Base* host);
 
 	uint32_t        addConstant_(const Variable& constant);
+	uint32_t        addConstant_(const AST::TerminalExpr& terminalExpr);
+	uint32_t        constantOperand_(const AST::Expression& expr);
+	uint32_t        upValueIndex_(const AST::VariableStmt& variableStmt) const;
 	void            substitueLabelToOffset();
 
 	void            appendCode_(Instruction::Opcode op, int32_t operand1,
 	                            int32_t operand2 = 0, int32_t operand3 = 0);
+	void            encode_(Instruction& inst, uint32_t op, int32_t operand1,
+	                        int32_t operand2 = 0, int32_t operand3 = 0);
 	uint32_t        nextOffset_();
+	void            locate_(const AST::Base& node);
+
+	void            appendConstantOp_(Instruction::Opcode op, uint32_t dest, uint32_t source, const Variable& constant);
 
 	void            appendUnaryOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op);
 	void            appendPrefixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op);
 	void            appendPostfixOp_(AST::UnaryExpr& unaryExpr, Instruction::Opcode op);
 
+	Instruction::Opcode appendOperands_(AST::BinaryExpr& binaryExpr, Instruction::Opcode op, bool inverted,
+	                                    uint32_t& operand2, uint32_t& operand3);
 	void            appendBinaryOp_(AST::BinaryExpr& binaryExpr, Instruction::Opcode op, bool inverted = false);
 	void            appendAssignOp_(AST::BinaryExpr& binaryExpr, Instruction::Opcode Op);
 	void            appendAssignOp_(AST::BinaryExpr& binaryExpr);
 	void            appendShortCutLogic_(AST::BinaryExpr& binaryExpr);
 	void            appendTableLoadOp_(AST::BinaryExpr& binaryExpr);
 
+	void            appendConditionalJump_(AST::Expression& condition, bool jumpIf, uint32_t label);
+	void            appendCountingLoop_(AST::ForStmt& forStmt);
+	void            appendClose_(uint32_t level, uint32_t numCaptured);
+
 	void            appendStoreOp_(const AST::Expression& value, const AST::Expression& dest);
 	void            appendStoreOp_(uint32_t valueRegister, const AST::Expression& dest);
 
-	ObjectManager&  objectManager_;
-	Ref<Prototype>  prototype_;
-	LabelManager    labelManager_;
-	Register        register_;
+	struct Jump_
+	{
+		Jump_(uint32_t offset, uint32_t label) : offset(offset), label(label) {}
+
+		uint32_t  offset;
+		uint32_t  label;
+	};
+
+	typedef std::vector<Jump_> JumpVector_;
+
+	ObjectManager&            objectManager_;
+	Ref<Prototype>            prototype_;
+	AST::FunctionDefinition*  functionDef_;
+	LabelManager              labelManager_;
+	Register                  register_;
+	JumpVector_               jumpList_;
+	uint32_t                  line_; // the source line of the instructions being appended
+	uint32_t                  numCaptured_; // the captured locals declared so far, see appendClose_
 };
 
 } // namespace "cmm"
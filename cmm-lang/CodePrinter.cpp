@@ -9,12 +9,13 @@
 #include "Prototype.h"
 #include "Instruction.h"
 #include "Memory.h"
+#include "Profiler.h"
 
 namespace cmm
 {
 
 CodePrinter::CodePrinter()
-: indentionLevel_(0)
+: indentionLevel_(0), profiler_(nullptr)
 {
 }
 
@@ -29,6 +30,15 @@ std::wstring& CodePrinter::print(const Prototype& prototype)
 	return output_;
 }
 
+std::wstring& CodePrinter::print(const Prototype& prototype, const Profiler& profiler)
+{
+	profiler_ = &profiler;
+	appendPrototype_(prototype, 0);
+	profiler_ = nullptr;
+
+	return output_;
+}
+
 void CodePrinter::appendPrototype_(const Prototype& prototype, uint32_t prototypeNum)
 {
 	appendPrototypeInfo_(prototype, prototypeNum);
@@ -41,6 +51,8 @@ void CodePrinter::appendPrototype_(const Prototype& prototype, uint32_t prototyp
 
 	for (uint32_t i = 0; i < prototype.numInstruction(); i++) {
 		appendCode_(prototype.instruction(i), i);
+		appendHits_(prototype, i);
+		append_(L"\n");
 	}
 
 	append_(L"\n");
@@ -58,8 +70,13 @@ void CodePrinter::appendPrototypeInfo_(const Prototype& prototype, uint32_t prot
 	appendIndention_();
 	append_(L"; function [%02d] definition\n", prototypeNum);
 	appendIndention_();
-	append_(L"; function level: %d, argument: %d, local size: %d\n",
-	        prototype.functionLevel(), prototype.numArgs(), prototype.localSize());
+	append_(L"; function level: %d, argument: %d, local size: %d, upvalue: %d\n",
+	        prototype.functionLevel(), prototype.numArgs(), prototype.localSize(), prototype.numUpValue());
+	for (uint32_t i = 0; i < prototype.numUpValue(); i++) {
+		const Prototype::UpValueInfo &info = prototype.upValueInfo(i);
+		appendIndention_();
+		append_(L"; upvalue[%02d] = %ls(%d)\n", i, info.isLocal ? L"R" : L"U", info.index);
+	}
 	appendIndention_();
 	append_(L"function[%02d] (%d, %d, %d)\n",
 	        prototypeNum, prototype.functionLevel(), prototype.numArgs(), prototype.localSize());
@@ -78,21 +95,45 @@ void CodePrinter::appendPrototypeEnd_()
 void CodePrinter::appendCode_(const Instruction& inst, uint32_t offset)
 {
 	appendIndention_();
-	append_(L"code[%02d] = ", offset);		
+	append_(L"code[%02d] = %08x ", offset, inst.code);
+
+	const wchar_t* name = Instruction::name[inst.opcode()].c_str();
 
-	switch (Instruction::type[inst.opcode]) {
+	switch (Instruction::type[inst.opcode()]) {
 	case Instruction::ONE_OP:
-		append_(L"%-10s %d", Instruction::name[inst.opcode].c_str(), inst.operand1);
+		append_(L"%-10s %d", name, inst.a());
 		break;
 	case Instruction::TWO_OP:
-		append_(L"%-10s %d, %d", Instruction::name[inst.opcode].c_str(), inst.operand1, inst.operand2);
+		append_(L"%-10s %d, %d", name, inst.a(), inst.b());
 		break;
 	case Instruction::THREE_OP:
-		append_(L"%-10s %d, %d, %d", Instruction::name[inst.opcode].c_str(), inst.operand1, inst.operand2, inst.operand3);
+		append_(L"%-10s %d, %d, %d", name, inst.a(), inst.b(), inst.c());
+		break;
+	case Instruction::WIDE_OP:
+		append_(L"%-10s %d, %d", name, inst.a(), inst.bx());
+		break;
+	case Instruction::BRANCH_OP:
+		append_(L"%-10s %d, %d", name, inst.a(), inst.sbx());
+		break;
+	case Instruction::JUMP_OP:
+		append_(L"%-10s %d", name, inst.sax());
 		break;
 	}
+}
 
-	append_(L"\n");
+// The count goes to a column of its own, after the longest instruction
+void CodePrinter::appendHits_(const Prototype& prototype, uint32_t offset)
+{
+	if (profiler_ == nullptr) {
+		return;
+	}
+
+	const size_t HITS_COLUMN = 64;
+	const size_t column = output_.size() - (output_.rfind(L'\n') + 1);
+	if (column < HITS_COLUMN) {
+		output_.append(HITS_COLUMN - column, L' ');
+	}
+	append_(L" ; %llu", static_cast<unsigned long long>(profiler_->numExecuted(prototype, offset)));
 }
 
 void CodePrinter::appendConstant_(const Variable& constant, uint32_t constNum)
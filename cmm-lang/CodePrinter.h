@@ -8,6 +8,7 @@ namespace cmm
 {
 
 class Prototype;
+class Profiler;
 struct Instruction;
 struct Variable;
 
@@ -20,18 +21,23 @@ public:
     const CodePrinter& operator=(const CodePrinter&) = delete;
 
 	std::wstring&      print(const Prototype& prototype);
+
+	// Annotates each instruction with the number of times the profiler has counted it
+	std::wstring&      print(const Prototype& prototype, const Profiler& profiler);
                       
 private:              
 	void               appendPrototype_(const Prototype& prototype, uint32_t prototypeNum);
 	void               appendPrototypeInfo_(const Prototype& prototype, uint32_t prototypeNum);
 	void               appendPrototypeEnd_();
 	void               appendCode_(const Instruction& inst, uint32_t offset);
+	void               appendHits_(const Prototype& prototype, uint32_t offset);
 	void               appendConstant_(const Variable& constant, uint32_t constNum);
 	void               appendIndention_();
 	void               append_(const wchar_t format[], ...);
                       
 	std::wstring       output_;
 	uint32_t           indentionLevel_;
+	const Profiler*    profiler_;
 };
 
 } // namespace "cmm"
@@ -38,7 +38,7 @@ Ref<Prototype> Compiler::compile(const wchar_t code[], bool drawTree, bool print
 		ASTDrawer drawer;
 		//treeString_ = drawer.draw(*rootFunction.get());
 		std::wofstream f;
-		f.open(L"tree.txt");
+		f.open("tree.txt");
 		f << drawer.draw(*rootFunction.get());
 		f.close();
 	}
@@ -50,7 +50,7 @@ Ref<Prototype> Compiler::compile(const wchar_t code[], bool drawTree, bool print
 		CodePrinter printer;
 		//codeString_ = printer.print(*rootPrototype.get());
 		std::wofstream f;
-		f.open(L"code.txt");
+		f.open("code.txt");
 		f << printer.print(*rootPrototype.get());
 		f.close();
 	}
@@ -0,0 +1,86 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Compile-time switches of the C-- virtual machine.
+// Every switch can be overridden by defining it before this header is included (e.g. on the command line).
+
+// CMM_USE_COMPUTED_GOTO selects the direct-threaded dispatch of Context::loop_.
+// Each opcode handler jumps straight to the handler of the next instruction through a label table,
+// so the indirect branch is replicated per handler instead of being shared by one switch statement.
+// It relies on the "labels as values" extension of GCC and Clang, so the other compilers (MSVC)
+// always use the portable switch dispatch.
+#ifndef CMM_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define CMM_USE_COMPUTED_GOTO 1
+#else
+#define CMM_USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+#if CMM_USE_COMPUTED_GOTO && !(defined(__GNUC__) || defined(__clang__))
+#error "computed goto dispatch requires GCC or Clang"
+#endif
+
+// CMM_USE_QUICKENING lets Context::loop_ rewrite an instruction in place to a type-specialized form
+// (ADD_II, LT_II, GETTABLE_ARRAY_INT ...) once the types of its operands are observed.
+// The specialized form only checks a type guard, and falls back to the generic form when the guard fails.
+#ifndef CMM_USE_QUICKENING
+#define CMM_USE_QUICKENING 1
+#endif
+
+// CMM_USE_JIT builds the baseline JIT (Jit.h), which translates a hot prototype into x86-64 machine code.
+// It is available on x86-64 only, and still has to be turned on for each context with Context::enableJit().
+// A prototype becomes hot when it has been called or has jumped backward CMM_JIT_THRESHOLD times.
+#ifndef CMM_USE_JIT
+#if defined(_M_X64) || defined(__x86_64__)
+#define CMM_USE_JIT 1
+#else
+#define CMM_USE_JIT 0
+#endif
+#endif
+
+#if CMM_USE_JIT && !(defined(_M_X64) || defined(__x86_64__))
+#error "the baseline JIT generates x86-64 code only"
+#endif
+
+#ifndef CMM_JIT_THRESHOLD
+#define CMM_JIT_THRESHOLD 1000
+#endif
+
+// CMM_USE_TRACING lets the JIT record a hot loop as it runs in the interpreter, and compile the recorded trace
+// with the types observed then (Trace.h). A loop which can not be traced is left to the baseline JIT.
+// A loop becomes hot when it has jumped backward CMM_TRACE_THRESHOLD times.
+#ifndef CMM_USE_TRACING
+#define CMM_USE_TRACING CMM_USE_JIT
+#endif
+
+#if CMM_USE_TRACING && !CMM_USE_JIT
+#error "tracing requires the JIT"
+#endif
+
+#ifndef CMM_TRACE_THRESHOLD
+#define CMM_TRACE_THRESHOLD 50
+#endif
+
+// CMM_USE_PROFILER lets Context::loop_ count the executed instructions and measure the time of each
+// opcode class (Profiler.h), once it is turned on with Context::enableProfiler().
+// It is off by default, since the switch dispatch checks a flag for every instruction then.
+#ifndef CMM_USE_PROFILER
+#define CMM_USE_PROFILER 0
+#endif
+
+// CMM_BUDGET_SLICE is the number of ticks (backward jumps and calls) between two checks of the budget of a context
+// (Context::setBudget). The interpreter and the native code count the ticks down, and the context checks the time limit
+// and hands out the next slice when they run out, so a smaller slice stops a script sooner at a higher cost.
+#ifndef CMM_BUDGET_SLICE
+#define CMM_BUDGET_SLICE 10000
+#endif
+
+// CMM_SCHEDULER_SLICE is the number of ticks a task of Scheduler (Scheduler.h) runs at a turn, before it is suspended
+// and queued behind the other tasks. A smaller slice shares the threads more fairly between long and short tasks,
+// while every turn costs a few locks.
+#ifndef CMM_SCHEDULER_SLICE
+#define CMM_SCHEDULER_SLICE 50000
+#endif
+
+#endif
\ No newline at end of file
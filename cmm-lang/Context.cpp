@@ -5,10 +5,15 @@
 #include <cstdint>
 #include <cstdio>
 #include <algorithm>
+#include <iterator>
 
+#include "Config.h"
 #include "Compiler.h"
 #include "Context.h"
 #include "Prototype.h"
+#include "Jit.h"
+#include "Module.h"
+#include "Script.h"
 #include "Utility.h"
 #include "DataType.h"
 #include "Error.h"
@@ -22,7 +27,7 @@ namespace // Anonymous namespace for utility functions only for the Context clas
 // TODO: Currently calculation routine is quite bit inefficient - it should be optimized
 
 template <typename CompOp>
-inline const Variable CompareOp(Variable &rhs1, Variable &rhs2)
+inline const Variable CompareOp(const Variable &rhs1, const Variable &rhs2)
 {
 	switch (rhs1.t) {
 	case TypeNull:
@@ -30,24 +35,22 @@ inline const Variable CompareOp(Variable &rhs1, Variable &rhs2)
 	case TypeInt:
 		if (rhs2.t == TypeInt) {
 			return CompOp::op(rhs1.v.i, rhs2.v.i);
-		} else if (rhs2.t = TypeFloat) {
+		} else if (rhs2.t == TypeFloat) {
 			return CompOp::op(rhs1.v.i, rhs2.v.f);
 		} else {
 			return CompOp::op(rhs1.t, rhs2.t);
 		}
 	case TypeFloat:
 		if (rhs2.t == TypeInt) {
-			CompOp::op(rhs1.v.f, rhs2.v.i);
-		} else if (rhs2.t = TypeFloat) {
-			CompOp::op(rhs1.v.f, rhs2.v.f);
+			return CompOp::op(rhs1.v.f, rhs2.v.i);
+		} else if (rhs2.t == TypeFloat) {
+			return CompOp::op(rhs1.v.f, rhs2.v.f);
 		} else {
-			CompOp::op(rhs1.t, rhs2.t);
+			return CompOp::op(rhs1.t, rhs2.t);
 		}
 	case TypeString:		
-		if (rhs2.t == TypeString) {
-			String& rhs1Str = static_cast<String&>(*rhs1.v.obj);
-			String& rhs2Str = static_cast<String&>(*rhs2.v.obj);
-			return CompOp::op(rhs1.v.obj, rhs2.v.obj);
+		if (rhs2.t == TypeString) { // strings are equal by the value, as the keys of a table are
+			return CompOp::op(static_cast<const String*>(rhs1.v.obj)->value(), static_cast<const String*>(rhs2.v.obj)->value());
 		} else {
 			return CompOp::op(rhs1.t, rhs2.t);
 		}
@@ -59,7 +62,7 @@ inline const Variable CompareOp(Variable &rhs1, Variable &rhs2)
 }
 
 template <typename BinaryOp>
-inline const Variable NumericOp(Variable &rhs1, Variable &rhs2)
+inline const Variable NumericOp(const Variable &rhs1, const Variable &rhs2)
 {
 	if (!rhs1.isNumber() || !rhs2.isNumber()) {
 		throw Error(L"wrong attempt to perform arithmetic on non-numeric value.");
@@ -81,7 +84,7 @@ inline const Variable NumericOp(Variable &rhs1, Variable &rhs2)
 }
 
 template <typename UnaryOp>
-inline const Variable NumericOp(Variable &rhs, const bool checkNumber)
+inline const Variable NumericOp(const Variable &rhs, const bool checkNumber)
 {
 	if (checkNumber == true && (!rhs.isNumber())) {
 		throw Error(L"wrong attempt to perform an arithmetic operation on non-numeric value.");
@@ -97,7 +100,7 @@ inline const Variable NumericOp(Variable &rhs, const bool checkNumber)
 }
 
 template <typename BinaryOp>
-inline const Variable IntegerOp(Variable &rhs1, Variable &rhs2)
+inline const Variable IntegerOp(const Variable &rhs1, const Variable &rhs2)
 {
 	if (rhs1.t != TypeInt || rhs2.t != TypeInt) {
 		throw Error(L"wrong attempt to perform an integer operation on non-integer value.");
@@ -107,7 +110,7 @@ inline const Variable IntegerOp(Variable &rhs1, Variable &rhs2)
 }
 
 template <typename UnaryOp>
-inline const Variable IntegerOp(Variable &rhs)
+inline const Variable IntegerOp(const Variable &rhs)
 {
 	if (rhs.t != TypeInt) {
 		throw Error(L"wrong attempt to perform an integer operation on non-integer value.");
@@ -116,16 +119,76 @@ inline const Variable IntegerOp(Variable &rhs)
 	return UnaryOp::op(rhs.v.i);
 }
 
-template <typename BinaryOp>
-inline const int32_t LogicalOp(Variable &rhs1, Variable &rhs2)
+// Below tests are used by the fused compare-and-jump instructions, which do not need the result as a Variable
+template <typename CompOp>
+inline bool CompareTest(const Variable &rhs1, const Variable &rhs2)
 {
-	return BinaryOp::op(toBool(rhs1), toBool(rhs2));
+	if (rhs1.t == TypeInt && rhs2.t == TypeInt) {
+		return CompOp::op(rhs1.v.i, rhs2.v.i);
+	}
+
+	return CompareOp<CompOp>(rhs1, rhs2).v.i != 0;
 }
 
-template <typename UnaryOp>
-inline const int32_t LogicalOp(Variable &rhs1)
+template <typename CompOp>
+inline bool NumericTest(const Variable &rhs1, const Variable &rhs2)
 {
-	return UnaryOp::op(toBool(rhs1));
+	if (rhs1.t == TypeInt && rhs2.t == TypeInt) {
+		return CompOp::op(rhs1.v.i, rhs2.v.i);
+	}
+
+	return NumericOp<CompOp>(rhs1, rhs2).v.i != 0;
+}
+
+// String concatenation if both operands are string, numeric addition otherwise
+inline const Variable AddOp(const Variable &rhs1, const Variable &rhs2, ObjectManager *objectManager)
+{
+	if (rhs1.t == TypeString && rhs2.t == TypeString) {
+		const String& rhs1Str = static_cast<const String&>(*rhs1.v.obj);
+		const String& rhs2Str = static_cast<const String&>(*rhs2.v.obj);
+		return Variable(TypeString, new String(rhs1Str.value() + rhs2Str.value(), objectManager));
+	} else {
+		return NumericOp<OpAdd>(rhs1, rhs2);
+	}
+}
+
+// The comparison of FORPREP and FORLOOP, which is one of the tests of JLT and JLE
+inline bool ForTest(const Variable &counter, const Variable &limit, const Instruction &inst)
+{
+	const Variable &lhs = inst.forInverted() ? limit : counter;
+	const Variable &rhs = inst.forInverted() ? counter : limit;
+
+	return inst.forInclusive() ? NumericTest<OpLessEqual>(lhs, rhs) : NumericTest<OpLess>(lhs, rhs);
+}
+
+// The step of FORLOOP is same as ADD (i++, i += 2) or SUB (i--, i -= 2) with a constant
+inline void ForStep(Variable &counter, int32_t step, ObjectManager *objectManager)
+{
+	if (counter.t == TypeInt) {
+		counter.v.i += step;
+	} else if (step > 0) {
+		counter = AddOp(counter, Variable(step), objectManager);
+	} else {
+		counter = NumericOp<OpSubtract>(counter, Variable(-step));
+	}
+}
+
+inline const Variable DivideOp(const Variable &rhs1, const Variable &rhs2)
+{
+	if (rhs1.t == TypeInt && rhs2.t == TypeInt && rhs2.v.i == 0) {
+		throw Error(L"attempt to divide an integer by zero");
+	}
+
+	return NumericOp<OpDivide>(rhs1, rhs2);
+}
+
+inline const Variable ModularOp(const Variable &rhs1, const Variable &rhs2)
+{
+	if (rhs1.t == TypeInt && rhs2.t == TypeInt && rhs2.v.i == 0) {
+		throw Error(L"attempt to divide an integer by zero");
+	}
+
+	return IntegerOp<OpModular>(rhs1, rhs2);
 }
 
 inline const int32_t toBool(const Variable &var)
@@ -138,14 +201,108 @@ inline const int32_t toBool(const Variable &var)
 	}
 }
 
+template <typename BinaryOp>
+inline const int32_t LogicalOp(const Variable &rhs1, const Variable &rhs2)
+{
+	return BinaryOp::op(toBool(rhs1), toBool(rhs2));
+}
+
+template <typename UnaryOp>
+inline const int32_t LogicalOp(const Variable &rhs1)
+{
+	return UnaryOp::op(toBool(rhs1));
+}
+
+inline void GetIndex(Variable &lhs, const Variable &container, const Variable &key)
+{
+	switch (container.t) {
+		case TypeTable:
+			lhs = static_cast<Table*>(container.v.obj)->getValue(key);
+			break;
+		case TypeArray:
+			if (key.t == TypeInt) {
+				lhs = static_cast<Array*>(container.v.obj)->getValue(key.v.i);
+			} else {
+				throw Error(L"non-integer value for index value on array type");
+			}
+			break;
+		default:
+			throw Error(L"wrong type for index operation");
+			break;
+	};
+}
+
+inline void SetIndex(const Variable &container, const Variable &key, const Variable &value)
+{
+	switch (container.t) {
+		case TypeTable:
+			static_cast<Table*>(container.v.obj)->setValue(key, value);
+			break;
+		case TypeArray:
+			if (key.t == TypeInt) {
+				static_cast<Array*>(container.v.obj)->setValue(key.v.i, value);
+			} else {
+				throw Error(L"non-integer value for index value on array type");
+			}
+			break;
+		default:
+			throw Error(L"wrong type for index operation");
+			break;
+	};
+}
+
+// Below functions choose the quickened form of an instruction from the types of its operands.
+// OPCODE_END means that the instruction stays generic.
+inline uint32_t QuickenNumeric(const Variable &rhs1, const Variable &rhs2, uint32_t intOpcode, uint32_t floatOpcode)
+{
+	if (rhs1.t == TypeInt && rhs2.t == TypeInt) {
+		return intOpcode;
+	} else if (rhs1.t == TypeFloat && rhs2.t == TypeFloat) {
+		return floatOpcode;
+	}
+	return Instruction::OPCODE_END;
+}
+
+inline uint32_t QuickenInteger(const Variable &rhs1, const Variable &rhs2, uint32_t intOpcode)
+{
+	return (rhs1.t == TypeInt && rhs2.t == TypeInt) ? intOpcode : Instruction::OPCODE_END;
+}
+
+inline uint32_t QuickenIndex(const Variable &container, const Variable &key, uint32_t arrayOpcode)
+{
+	return (container.t == TypeArray && key.t == TypeInt) ? arrayOpcode : Instruction::OPCODE_END;
+}
+
+// Returns the slot of a global, or nullptr if it does not exist. The global table is searched only
+// when the cache was filled with another table or before the table had a key inserted or erased.
+inline Variable* FindGlobal(Prototype::GlobalCache &cache, Table &global, const Variable &name)
+{
+	if (cache.table != &global || cache.version != global.version()) {
+		cache.table = &global;
+		cache.version = global.version();
+		cache.slot = global.findValue(name);
+	}
+	return cache.slot;
+}
+
+const uint32_t INITIAL_STACK_SIZE = 256;
+const uint32_t MIN_WINDOW_SIZE = 100; // a C function can push at least as many values as buffer_ holds
+const uint32_t MAX_STACK_SIZE = 1024 * 1024;
+
 } // The end of anomymous namespace
 
 
 
 
 Context::Context()
-: objectManager_(), global_(new Table(&objectManager_)), buffer_(100, TypeNull), reentrant_(false)
+: scripts_(), objectManager_(), global_(new Table(&objectManager_)), buffer_(MIN_WINDOW_SIZE, TypeNull), bufferSize_(0),
+  stack_(INITIAL_STACK_SIZE, TypeNull), numQuickened_(0), numDequickened_(0), jitEnabled_(false),
+  profilerEnabled_(false), ticks_(INT32_MAX), budgetTicks_(UINT64_MAX), hasDeadline_(false), suspendOnBudget_(false),
+  suspended_(false), suspendedDepth_(0), suspendedPosition_(0), suspendedNumRets_(0)
 {
+	resetWindow_();
+	registerCfunction(L"coroutine", createCoroutine_);
+	registerCfunction(L"status", coroutineStatus_);
 }
 
 Context::~Context()
@@ -153,268 +310,849 @@ Context::~Context()
 }
 
 
+// Calls the function on the communication stack, which is followed by its arguments, and replaces them
+// with the results. A C function can call back into the script as well, then the script runs on top of
+// the frames which are already running and loop_ returns when the called function returns.
 void Context::run(uint32_t numArgs, uint32_t numRets)
 {
-	if (reentrant_ == true) {
-		throw Error(L"currently C-- does not support to reentrant active C-- context");
+	if (suspended_) {
+		throw Error(L"a suspended script has to be resumed before running another");
 	}
-
-	if (bufferSize_ != numArgs+1) {
+	if (bufferSize_ < numArgs+1) {
 		throw Error(L"the number of argument is not according to the size of stack");
 	}
 
-	if (buffer_[0].t != TypeFunc) {
+	uint32_t position = bufferSize_ - numArgs - 1;
+
+	if (window_[position].t != TypeFunc) {
 		throw Error(L"wrong attempt to call non-function value");
 	}
+	if (position + numRets > windowCapacity_) {
+		throw Error(L"Communication stack overflow.");
+	}
+
+	CallStack_::size_type depth = callStack_.size();
+
+	functionCall_(&window_[position], numArgs, numRets);
+	execute_(depth, position, numRets);
+}
+
+void Context::resume()
+{
+	if (suspended_ == false) {
+		throw Error(L"no script is suspended");
+	}
+
+	suspended_ = false;
+	execute_(suspendedDepth_, suspendedPosition_, suspendedNumRets_);
+}
+
+// Runs the frames above the depth until they return, then leaves the results at the position of the communication
+// stack, where the called function was. Only the script run by the host can be suspended, since the frames of
+// a C function which called back into the script can not be left and continued later.
+void Context::execute_(size_t depth, uint32_t position, uint32_t numRets)
+{
+	const bool suspendable = (window_ == buffer_.data());
+	bool finished;
 
-	functionCall_(&buffer_[0], numArgs, numRets);
 	try {
-		loop_();
-		bufferSize_ = numRets;
+		finished = loop_(depth, suspendable);
+		profiler_.pause();
 	} catch (...) {
-		callStack_.clear();
+		profiler_.pause();
+		abandonCoroutines_(depth);
+		while (callStack_.size() > depth) {
+			popFrame_();
+		}
 		throw;
 	}
+
+	if (finished == false) {
+		suspended_ = true;
+		suspendedDepth_ = depth;
+		suspendedPosition_ = position;
+		suspendedNumRets_ = numRets;
+		return;
+	}
+
+	for (uint32_t i = position + numRets; i < bufferSize_; i++) {
+		window_[i] = TypeNull;
+	}
+	bufferSize_ = position + numRets;
 }
 
-void Context::load(const wchar_t code[])
+void Context::load(const wchar_t code[], bool linkGlobals)
 {
 	Compiler compiler(objectManager_);
 
-	Ref<Prototype> prototype = compiler.compile(code, false, false);
+	loadPrototype_(compiler.compile(code, false, false), linkGlobals);
+}
+
+void Context::load(std::shared_ptr<const Script> script, bool linkGlobals)
+{
+	loadPrototype_(script->instantiate(objectManager_), linkGlobals);
+	scripts_.push_back(std::move(script));
+}
 
-	buffer_[0] = Variable(TypeFunc, new Function(prototype, nullptr, &objectManager_));
+void Context::registerModule(const Module& module)
+{
+	modules_[module.name] = &module;
+}
+
+void Context::loadModule(const wchar_t name[], bool linkGlobals)
+{
+	auto module = modules_.find(name);
+	if (module == modules_.end()) {
+		throw Error(L"module '%ls' is not registered", name);
+	}
+
+	loadPrototype_(module->second->instantiate(objectManager_), linkGlobals);
+}
+
+// Places the main function of the prototype on the communication stack to be run
+void Context::loadPrototype_(Ref<Prototype> prototype, bool linkGlobals)
+{
+	if (linkGlobals == true) {
+		linkGlobals_(*prototype);
+	}
+
+	buffer_[0] = Variable(TypeFunc, new Function(prototype, &objectManager_));
 	bufferSize_ = 1;
 }
 
+// Rewrites GETGLOBAL and SETGLOBAL in the prototype and its local prototypes to GETGLOBALSLOT and
+// SETGLOBALSLOT, which refer to the global by a dense slot number instead of looking its name up.
+// A slot points to the value in global_, so the host APIs and the unlinked code still find it by
+// the name, and the collector still reaches it through global_. Since a key of global_ is never
+// erased, the value does not move while the context is alive.
+void Context::linkGlobals_(Prototype& prototype)
+{
+	for (uint32_t offset = 0; offset < prototype.numInstruction(); offset++) {
+		const Instruction& instruction = prototype.instruction(offset);
+		uint32_t opcode;
+
+		switch (instruction.opcode()) {
+		case Instruction::GETGLOBAL: opcode = Instruction::GETGLOBALSLOT; break;
+		case Instruction::SETGLOBAL: opcode = Instruction::SETGLOBALSLOT; break;
+		default:                     continue;
+		}
+
+		Variable* value = global_->findOrInsertValue(prototype.constant(instruction.bx()));
+		auto slot = globalSlotIndex_.find(value);
+
+		if (slot == globalSlotIndex_.end()) {
+			if (globalSlots_.size() > Instruction::MAX_BX) {
+				continue; // too many globals, it is left to look the name up
+			}
+			slot = globalSlotIndex_.insert(std::make_pair(value, static_cast<uint32_t>(globalSlots_.size()))).first;
+			globalSlots_.push_back(value);
+		}
+
+		prototype.rewrite(offset, Instruction(opcode, instruction.a(), slot->second, 0));
+	}
+
+	for (uint32_t i = 0; i < prototype.numPrototype(); i++) {
+		linkGlobals_(*prototype.localPrototype(i));
+	}
+}
+
 void Context::registerCfunction(const wchar_t name[], CFunction func)
 {
 	Ref<String> string = new String(name, &objectManager_);
 	global_->setValue(Variable(TypeString, string.get()), Variable(func));
 }
 
+// Besides the globals, the registers of the frames and the communication stack are the roots,
+// since a script may be suspended or a C function may collect while the script is running.
+// The registers above the frames are always null (popFrame_).
 void Context::garbageCollect()
 {
-	objectManager_.garbageCollect(*global_);
+	std::vector<const Object*> roots;
+
+	auto addRoot = [&roots](const Variable& value) {
+		if (value.isObject()) {
+			roots.push_back(value.v.obj);
+		}
+	};
+	std::for_each(stack_.begin(), stack_.end(), addRoot);
+	std::for_each(window_, window_ + bufferSize_, addRoot);
+	std::for_each(callStack_.begin(), callStack_.end(), [&roots](const CallInfo_& frame) {
+		roots.push_back(frame.function.get());
+	});
+	std::for_each(openUpValues_.begin(), openUpValues_.end(), [&roots](const Ref<UpValue>& upValue) {
+		roots.push_back(upValue.get());
+	});
+	if (coroutine_.get() != nullptr) {
+		roots.push_back(coroutine_.get()); // and the coroutines which have resumed it
+	}
+
+	profiler_.detachPrototypes(); // the collector may free a prototype the profiler has seen
+	objectManager_.garbageCollect(*global_, roots);
 }
 
 
 
 
-void Context::loop_()
+/*
+ * Instruction dispatch
+ *
+ * VM_SWITCH, VM_CASE and VM_DISPATCH hide the dispatch technique from the opcode handlers.
+ *  - switch dispatch : every handler goes back to one switch statement at the top of the loop
+ *                      (portable fallback)
+ *  - threaded dispatch : every handler jumps directly to the handler of the next instruction
+ *                        through the label table (CMM_USE_COMPUTED_GOTO)
+ *
+ * While the profiler is enabled (CMM_USE_PROFILER), every instruction is counted before it is executed,
+ * in the same way as it is shown to the trace recorder.
+ *
+ * The state of the running frame (function, register base and program counter) is cached
+ * in local variables. It is written back to the call stack only when the frame is left, which is on
+ * CALL and RETURN, and when an error is thrown.
+ */
+
+#if CMM_USE_COMPUTED_GOTO
+#define VM_DISPATCH()      goto *dispatch[pc->opcode()]
+#define VM_SWITCH(opcode)  VM_DISPATCH();
+#define VM_CASE(opcode)    op_##opcode
+#else
+#define VM_DISPATCH()      continue
+#define VM_SWITCH(opcode)  switch (opcode)
+#define VM_CASE(opcode)    case Instruction::opcode
+#endif
+
+#define VM_NEXT()          ++pc; VM_DISPATCH()
+#define VM_JUMP(distance)  pc += (distance); VM_DISPATCH()
+
+// A fused compare-and-jump instruction takes the JUMP right after it when the result of the comparison
+// is same as operand A, and skips the JUMP otherwise
+#define VM_TEST_JUMP(test)\
+	if ((test) == (pc->a() != 0)) { VM_LOOP_JUMP(1 + pc[1].sax()); }\
+	VM_JUMP(2)
+
+// A backward jump closes a loop, so the loop can be continued in native code (enterLoop_).
+// The native code runs until it meets an instruction it does not translate, and the interpreter goes on from there.
+// A function is entered in native code only by the baseline JIT, since a trace starts at the head of a loop.
+// A prototype loaded from a module has native code compiled ahead of time (Module.h), which takes the place
+// of the JIT. Since it can be entered at any instruction it translates, it is also entered where the interpreter
+// continues the frame after a call.
+#define VM_ENTER_NATIVE()\
+	if (prototype->nativeCode() != nullptr) {\
+		pc = code + prototype->nativeCode()(base, constants, static_cast<uint32_t>(pc - code), &ticks_);\
+	}
+
+#if CMM_USE_JIT
+#define VM_ENTER_LOOP()\
+	if (prototype->nativeCode() != nullptr) {\
+		VM_ENTER_NATIVE();\
+	} else if (jitEnabled_) {\
+		pc = code + enterLoop_(*prototype, base, static_cast<uint32_t>(pc - code));\
+		if (recorder_.isRecording()) { VM_START_RECORDING(); }\
+	}
+#else
+#define VM_ENTER_LOOP()  VM_ENTER_NATIVE()
+#endif
+
+#if CMM_USE_JIT && !CMM_USE_TRACING
+#define VM_ENTER_FUNCTION()\
+	if (prototype->nativeCode() != nullptr) {\
+		VM_ENTER_NATIVE();\
+	} else if (jitEnabled_) {\
+		const JitCode *jitCode = prototype->jitCode();\
+		if (jitCode != nullptr) {\
+			pc = code + jitCode->run(base, constants, static_cast<uint32_t>(pc - code), &ticks_);\
+		}\
+	}
+#else
+#define VM_ENTER_FUNCTION()  VM_ENTER_NATIVE()
+#endif
+
+#define VM_LOOP_JUMP(distance)\
+	{\
+		const int32_t jumpDistance = (distance);\
+		pc += jumpDistance;\
+		if (jumpDistance < 0) { VM_TICK(); VM_SAMPLE(); VM_ENTER_LOOP(); }\
+		VM_DISPATCH();\
+	}
+
+// While a trace is recorded, every instruction is shown to the recorder before it is executed.
+// The threaded dispatch swaps its label table for one that sends every opcode to op_RECORD,
+// and the switch dispatch checks a flag.
+#if CMM_USE_COMPUTED_GOTO
+#define VM_START_RECORDING()  dispatch = recordTable
+#define VM_STOP_RECORDING()   dispatch = handlerTable
+#else
+#define VM_START_RECORDING()  recording = true
+#define VM_STOP_RECORDING()   recording = false
+#endif
+
+#define VM_RECORD()\
+	if (recorder_.record(prototype, base, static_cast<uint32_t>(pc - code)) == false) {\
+		VM_STOP_RECORDING();\
+	}
+
+// The threaded dispatch goes through op_PROFILE while profiling, and the switch dispatch checks a flag.
+// A de-quickened instruction is dispatched again, so its count is taken back not to count it twice.
+// The sampler is checked where a function is entered and a loop jumps backward.
+#if CMM_USE_PROFILER
+#define VM_PROFILE()  profiler_.count(*prototype, static_cast<uint32_t>(pc - code), pc->opcode())
+#define VM_UNCOUNT()  if (profiling) { profiler_.uncount(); }
+#define VM_SAMPLE()   if (sampler_.isDue()) { sample_(static_cast<uint32_t>(pc - code)); }
+#else
+#define VM_UNCOUNT()
+#define VM_SAMPLE()
+#endif
+
+// A backward jump and a call count a tick of the budget. When the ticks run out, checkBudget_ hands out the next slice
+// of the budget, or the script is suspended before the instruction it would execute next (the head of the loop
+// or the start of the callee), or stopped by BudgetError. The native code counts the ticks down the same way.
+#define VM_TICK()\
+	if (--ticks_ < 0 && checkBudget_(suspendable) == false) {\
+		VM_SAVE_PC(0);\
+		recorder_.abort();\
+		return false;\
+	}
+
+#define VM_LOAD_FRAME()\
+	function = callStack_.back().function.get();\
+	prototype = function->prototype().get();\
+	code = prototype->code();\
+	constants = prototype->constants();\
+	base = stack_.data() + callStack_.back().base;\
+	pc = code + callStack_.back().programCounter
+
+#define VM_LOAD_BASE()\
+	base = stack_.data() + callStack_.back().base
+
+#define VM_SAVE_PC(offset)\
+	callStack_.back().programCounter = static_cast<uint32_t>(pc - code) + (offset)
+
+// A generic instruction is rewritten to the quickened opcode chosen from the types of its operands.
+// The operands are examined before the instruction is executed, since R(A) may be one of them.
+// A quickened instruction whose type guard fails is rewritten back, then dispatched again.
+#if CMM_USE_QUICKENING
+#define VM_QUICKEN(quickenedOpcode)\
+	{\
+		const uint32_t opcode = (quickenedOpcode);\
+		if (opcode != Instruction::OPCODE_END && prototype->quicken(static_cast<uint32_t>(pc - code), opcode)) {\
+			++numQuickened_;\
+		}\
+	}
+#else
+#define VM_QUICKEN(quickenedOpcode)
+#endif
+
+#define VM_DEQUICKEN()\
+	prototype->dequicken(static_cast<uint32_t>(pc - code));\
+	++numDequickened_;\
+	VM_UNCOUNT();\
+	VM_DISPATCH()
+
+// Returns true when the frame called above the depth has returned, and false when the script is suspended
+bool Context::loop_(size_t depth, bool suspendable)
 {
-	for (;;) {
-		Function &currentFunction = *callStack_.back().function;
-		Closure &currentClosure = *callStack_.back().closure;
-		const Instruction &inst = currentFunction.prototype()->instruction(callStack_.back().programCounter);
-		int32_t jumpDistance = 1;
+#if CMM_USE_COMPUTED_GOTO
+	// The order of labels must be same as the order of Instruction::Opcode
+	static void* const dispatchTable[] = {
+		&&op_ASSIGN, &&op_GETCONST, &&op_GETGLOBAL, &&op_GETGLOBALSLOT, &&op_GETUPVAL, &&op_GETTABLE, &&op_GETTABLEK,
+		&&op_SETGLOBAL, &&op_SETGLOBALSLOT, &&op_SETUPVAL, &&op_SETTABLE, &&op_SETTABLEK,
+		&&op_NEWTABLE, &&op_NEWARRAY, &&op_NEWFUNC,
+		&&op_ADD, &&op_SUB, &&op_MUL, &&op_DIV, &&op_MOD, &&op_UNM,
+		&&op_ADDK, &&op_SUBK, &&op_MULK, &&op_DIVK, &&op_MODK,
+		&&op_BITNOT, &&op_BITAND, &&op_BITOR, &&op_BITXOR, &&op_SL, &&op_SR,
+		&&op_NOT, &&op_EQ, &&op_NOTEQ, &&op_LT, &&op_LE,
+		&&op_EQK, &&op_NOTEQK, &&op_LTK, &&op_LEK, &&op_GTK, &&op_GEK,
+		&&op_JUMP, &&op_BRANCH, &&op_BRANCHNOT,
+		&&op_JEQ, &&op_JLT, &&op_JLE, &&op_JEQK, &&op_JLTK, &&op_JLEK, &&op_JGTK, &&op_JGEK,
+		&&op_FORPREP, &&op_FORLOOP, &&op_CALL, &&op_TAILCALL, &&op_RETURN, &&op_YIELD, &&op_CLOSE,
+		&&op_ADD_II, &&op_ADD_FF, &&op_SUB_II, &&op_SUB_FF, &&op_MUL_II, &&op_MUL_FF, &&op_ADDK_II, &&op_SUBK_II,
+		&&op_LT_II, &&op_LE_II, &&op_JLT_II, &&op_JLE_II, &&op_JLTK_II, &&op_JLEK_II,
+		&&op_GETTABLE_ARRAY_INT, &&op_SETTABLE_ARRAY_INT
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == Instruction::OPCODE_END,
+	              "dispatch table does not cover every opcode");
+
+#if CMM_USE_PROFILER
+	void* profileTable[Instruction::OPCODE_END];
+	std::fill(std::begin(profileTable), std::end(profileTable), &&op_PROFILE);
+
+	const bool profiling = profilerEnabled_;
+	const void* const* handlerTable = profiling ? profileTable : dispatchTable; // the table the recording goes back to
+#else
+	const void* const* handlerTable = dispatchTable;
+#endif
+	const void* const* dispatch = handlerTable;
+#if CMM_USE_JIT
+	void* recordTable[Instruction::OPCODE_END];
+	std::fill(std::begin(recordTable), std::end(recordTable), &&op_RECORD);
+#endif
+#else
+#if CMM_USE_JIT
+	bool recording = false;
+#endif
+#if CMM_USE_PROFILER
+	const bool profiling = profilerEnabled_;
+#endif
+#endif
+
+	Function *function;
+	Prototype *prototype;
+	const Instruction *code;
+	const Variable *constants;
+	Variable *base;
+	const Instruction *pc;
+
+	VM_LOAD_FRAME();
+	VM_ENTER_FUNCTION();
 
-#define operand(x) (currentClosure.local(inst.operand##x))
-		switch(inst.opcode) {
-			// Assign instructions
-			case Instruction::ASSIGN:
-				operand(1) = operand(2); break;
-			case Instruction::GETCONST:
-				operand(1) = currentFunction.prototype()->constant(inst.operand2); break;
-			case Instruction::GETGLOBAL: {
-				const Variable &constant = currentFunction.prototype()->constant(inst.operand2);
-				operand(1) = global_->getValue(constant);
-				break;
-			}
-			case Instruction::GETUPVAL:
-				operand(1) = currentClosure.upValue(inst.operand3, inst.operand2); break;
-			case Instruction::GETTABLE: {
-				Variable &lhs = operand(1);
-				Variable &container = operand(2);
-				Variable &key = operand(3);
-
-				switch (container.t) {
-					case TypeTable:
-						lhs = static_cast<Table*>(container.v.obj)->getValue(key);
-						break;
-					case TypeArray:
-						if (key.t == TypeInt) {
-							lhs = static_cast<Array*>(container.v.obj)->getValue(key.v.i);
-						} else {
-							throw Error(L"non-integer value for index value on array type");
-						}
-						break;
-					default:
-						throw Error(L"wrong type for index operation");
-						break;
-				};
-				break;
-			}
-			case Instruction::SETGLOBAL: {
-				const Variable &constant = currentFunction.prototype()->constant(inst.operand1);
-				global_->setValue(constant, operand(2));
-				break;
-			}
-			case Instruction::SETUPVAL:
-				currentClosure.upValue(inst.operand3, inst.operand1) = operand(2); break;
-			case Instruction::SETTABLE: {
-				Variable &container = operand(1);
-				Variable &value = operand(2);
-				Variable &key = operand(3);
-
-				switch (container.t) {
-					case TypeTable:
-						static_cast<Table*>(container.v.obj)->setValue(key, value);
-						break;
-					case TypeArray:
-						if (key.t == TypeInt) {
-							static_cast<Array*>(container.v.obj)->setValue(key.v.i, value);
-						} else {
-							throw Error(L"non-integer value for index value on array type");
-						}
-						break;
-					default:
-						throw Error(L"wrong type for index operation");
-						break;
-				};
-				break;
-			}
+	try {
+		for (;;) {
+#define RA (base[pc->a()])
+#define RB (base[pc->b()])
+#define RC (base[pc->c()])
+#define KC (constants[pc->c()])
+#if CMM_USE_JIT && !CMM_USE_COMPUTED_GOTO
+			if (recording) { VM_RECORD(); }
+#endif
+#if CMM_USE_PROFILER && !CMM_USE_COMPUTED_GOTO
+			if (profiling) { VM_PROFILE(); }
+#endif
+			VM_SWITCH(pc->opcode()) {
+#if CMM_USE_JIT && CMM_USE_COMPUTED_GOTO
+			op_RECORD:
+				VM_RECORD();
+				goto *handlerTable[pc->opcode()];
+#endif
+#if CMM_USE_PROFILER && CMM_USE_COMPUTED_GOTO
+			op_PROFILE:
+				VM_PROFILE();
+				goto *dispatchTable[pc->opcode()];
+#endif
+				// Assign instructions
+				VM_CASE(ASSIGN):
+					RA = RB; VM_NEXT();
+				VM_CASE(GETCONST):
+					RA = constants[pc->bx()]; VM_NEXT();
+				VM_CASE(GETGLOBAL): {
+					const Variable *slot = FindGlobal(prototype->globalCache(pc->bx()), *global_, constants[pc->bx()]);
+					RA = (slot != nullptr) ? *slot : Variable(TypeNull); VM_NEXT();
+				}
+				VM_CASE(GETGLOBALSLOT):
+					RA = *globalSlots_[pc->bx()]; VM_NEXT();
+				VM_CASE(GETUPVAL):
+					RA = function->upValue(pc->b())->value(); VM_NEXT();
+				VM_CASE(GETTABLE):
+					VM_QUICKEN(QuickenIndex(RB, RC, Instruction::GETTABLE_ARRAY_INT));
+					GetIndex(RA, RB, RC); VM_NEXT();
+				VM_CASE(GETTABLEK):
+					GetIndex(RA, RB, KC); VM_NEXT();
+				VM_CASE(SETGLOBAL): {
+					Variable *slot = FindGlobal(prototype->globalCache(pc->bx()), *global_, constants[pc->bx()]);
+					if (slot != nullptr) {
+						*slot = RA;
+					} else {
+						global_->setValue(constants[pc->bx()], RA);
+					}
+					VM_NEXT();
+				}
+				VM_CASE(SETGLOBALSLOT):
+					*globalSlots_[pc->bx()] = RA; VM_NEXT();
+				VM_CASE(SETUPVAL):
+					function->upValue(pc->a())->value() = RB; VM_NEXT();
+				VM_CASE(SETTABLE):
+					VM_QUICKEN(QuickenIndex(RA, RC, Instruction::SETTABLE_ARRAY_INT));
+					SetIndex(RA, RC, RB); VM_NEXT();
+				VM_CASE(SETTABLEK):
+					SetIndex(RA, KC, RB); VM_NEXT();
+
+				// Object creation instructions
+				VM_CASE(NEWTABLE): {
+					Table* newTable = new Table(&objectManager_);
+					RA = Variable(TypeTable, newTable); VM_NEXT();
+				}
+				VM_CASE(NEWARRAY): {
+					Array* newArray = new Array(&objectManager_);
+					RA = Variable(TypeArray, newArray); VM_NEXT();
+				}
+				VM_CASE(NEWFUNC): {
+					Ref<Function> newFunction = new Function(prototype->localPrototype(pc->bx()), &objectManager_);
+					const Prototype &newPrototype = *newFunction->prototype();
+
+					for (uint32_t i = 0; i < newPrototype.numUpValue(); i++) {
+						const Prototype::UpValueInfo &info = newPrototype.upValueInfo(i);
+						newFunction->upValue(i) = info.isLocal ? findUpValue_(&base[info.index]) : function->upValue(info.index);
+					}
+					
+					RA = Variable(TypeFunc, newFunction.get());
+					VM_NEXT();
+				}
 
-			// Object creation instructions
-			case Instruction::NEWTABLE: {
-				Table* newTable = new Table(&objectManager_);
-				operand(1) = Variable(TypeTable, newTable); break;
-			}
-			case Instruction::NEWARRAY: {
-				Array* newArray = new Array(&objectManager_);
-				operand(1) = Variable(TypeArray, newArray); break;
-			}
-			case Instruction::NEWFUNC: {
-				Prototype& currentPrototype = *currentFunction.prototype();
-				Function *newFunction = new Function(currentPrototype.localPrototype(inst.operand2), &currentClosure, &objectManager_);
+				// Arithmetic operation instructions
+				VM_CASE(ADD):
+					VM_QUICKEN(QuickenNumeric(RB, RC, Instruction::ADD_II, Instruction::ADD_FF));
+					RA = AddOp(RB, RC, &objectManager_); VM_NEXT();
+				VM_CASE(SUB):
+					VM_QUICKEN(QuickenNumeric(RB, RC, Instruction::SUB_II, Instruction::SUB_FF));
+					RA = NumericOp<OpSubtract>(RB, RC); VM_NEXT();
+				VM_CASE(MUL):
+					VM_QUICKEN(QuickenNumeric(RB, RC, Instruction::MUL_II, Instruction::MUL_FF));
+					RA = NumericOp<OpMultiply>(RB, RC); VM_NEXT();
+				VM_CASE(DIV):    RA = DivideOp(RB, RC); VM_NEXT();
+				VM_CASE(MOD):    RA = ModularOp(RB, RC); VM_NEXT();
+				VM_CASE(ADDK):
+					VM_QUICKEN(QuickenInteger(RB, KC, Instruction::ADDK_II));
+					RA = AddOp(RB, KC, &objectManager_); VM_NEXT();
+				VM_CASE(SUBK):
+					VM_QUICKEN(QuickenInteger(RB, KC, Instruction::SUBK_II));
+					RA = NumericOp<OpSubtract>(RB, KC); VM_NEXT();
+				VM_CASE(MULK):   RA = NumericOp<OpMultiply>(RB, KC); VM_NEXT();
+				VM_CASE(DIVK):   RA = DivideOp(RB, KC); VM_NEXT();
+				VM_CASE(MODK):   RA = ModularOp(RB, KC); VM_NEXT();
+				VM_CASE(UNM):    RA = NumericOp<OpNeg>(RB, true); VM_NEXT();
+
+				// Bitwise operation instructions
+				VM_CASE(BITNOT): RA = IntegerOp<OpBitNot>(RB); VM_NEXT(); 
+				VM_CASE(BITAND): RA = IntegerOp<OpBitAnd>(RB, RC); VM_NEXT();
+				VM_CASE(BITOR):  RA = IntegerOp<OpBitOr>(RB, RC); VM_NEXT(); 
+				VM_CASE(BITXOR): RA = IntegerOp<OpBitXor>(RB, RC); VM_NEXT(); 
+				VM_CASE(SL):     RA = IntegerOp<OpShiftLeft>(RB, RC); VM_NEXT();
+				VM_CASE(SR):     RA = IntegerOp<OpShiftRight>(RB, RC); VM_NEXT();
 				
-				operand(1) = Variable(TypeFunc, newFunction);			
-				break;
-			}
-
-			// Arithmetic operation instructions
-			case Instruction::ADD: {			
-				if (operand(2).t == TypeString && operand(3).t == TypeString) {
-					String& rhs1 = static_cast<String&>(*operand(2).v.obj);
-					String& rhs2 = static_cast<String&>(*operand(3).v.obj);
-					String* result = new String(rhs1.value() + rhs2.value(), &objectManager_);
-					operand(1) = Variable(TypeString, result);
-				} else {
-					operand(1) = NumericOp<OpAdd>(operand(2), operand(3));
-				}			
-				break;
-			}
-			case Instruction::SUB:    operand(1) = NumericOp<OpSubtract>(operand(2), operand(3)); break;
-			case Instruction::MUL:    operand(1) = NumericOp<OpMultiply>(operand(2), operand(3)); break;
-			case Instruction::DIV:
-				if (operand(2).t == TypeInt && operand(3).t == TypeInt && operand(3).v.i == 0) {
-					throw Error(L"attempt to divide an integer by zero");
-				} else {
-					operand(1) = NumericOp<OpDivide>(operand(2), operand(3));
+				// Logical operation instructions
+				VM_CASE(NOT):    RA = LogicalOp<OpLogicNot>(RB); VM_NEXT();
+				VM_CASE(EQ):     RA = CompareOp<OpEqual>(RB, RC); VM_NEXT();
+				VM_CASE(NOTEQ):  RA = CompareOp<OpNotEqual>(RB, RC); VM_NEXT();
+				VM_CASE(LT):
+					VM_QUICKEN(QuickenInteger(RB, RC, Instruction::LT_II));
+					RA = NumericOp<OpLess>(RB, RC); VM_NEXT();
+				VM_CASE(LE):
+					VM_QUICKEN(QuickenInteger(RB, RC, Instruction::LE_II));
+					RA = NumericOp<OpLessEqual>(RB, RC); VM_NEXT();
+				VM_CASE(EQK):    RA = CompareOp<OpEqual>(RB, KC); VM_NEXT();
+				VM_CASE(NOTEQK): RA = CompareOp<OpNotEqual>(RB, KC); VM_NEXT();
+				VM_CASE(LTK):    RA = NumericOp<OpLess>(RB, KC); VM_NEXT();
+				VM_CASE(LEK):    RA = NumericOp<OpLessEqual>(RB, KC); VM_NEXT();
+				VM_CASE(GTK):    RA = NumericOp<OpGreater>(RB, KC); VM_NEXT();
+				VM_CASE(GEK):    RA = NumericOp<OpGreaterEqual>(RB, KC); VM_NEXT();
+				
+				// Call and Jump instructions
+				VM_CASE(JUMP): {
+					VM_LOOP_JUMP(pc->sax());
 				}
-				break;
-			case Instruction::MOD:
-				if (operand(2).t == TypeInt && operand(3).t == TypeInt && operand(3).v.i == 0) {
-					throw Error(L"attempt to divide an integer by zero");
-				} else {
-					operand(1) = IntegerOp<OpModular>(operand(2), operand(3));
+				VM_CASE(BRANCH): {
+					if (toBool(RA)) {
+						VM_LOOP_JUMP(pc->sbx());
+					}
+					VM_NEXT();
 				}
-				break;
-			case Instruction::UNM:    operand(1) = NumericOp<OpNeg>(operand(2), true);
-
-			// Bitwise operation instructions
-			case Instruction::BITNOT: operand(1) = IntegerOp<OpBitNot>(operand(2)); break; 
-			case Instruction::BITAND: operand(1) = IntegerOp<OpBitAnd>(operand(2), operand(3)); break;
-			case Instruction::BITOR:  operand(1) = IntegerOp<OpBitOr>(operand(2), operand(3)); break; 
-			case Instruction::BITXOR: operand(1) = IntegerOp<OpBitXor>(operand(2), operand(3)); break; 
-			case Instruction::SL:     operand(1) = IntegerOp<OpShiftLeft>(operand(2), operand(3)); break;
-			case Instruction::SR:     operand(1) = IntegerOp<OpShiftRight>(operand(2), operand(3)); break;
-			
-			// Logical operation instructions
-			case Instruction::NOT:    operand(1) = LogicalOp<OpLogicNot>(operand(2)); break;
-			case Instruction::EQ:     operand(1) = CompareOp<OpEqual>(operand(2), operand(3)); break;
-			case Instruction::NOTEQ:  operand(1) = CompareOp<OpNotEqual>(operand(2), operand(3)); break;
-			case Instruction::LT:     operand(1) = NumericOp<OpLess>(operand(2), operand(3)); break;
-			case Instruction::LE:     operand(1) = NumericOp<OpLessEqual>(operand(2), operand(3)); break;
-			
-			// Call and Jump instructions
-			case Instruction::JUMP:  jumpDistance = inst.operand1; break;
-			case Instruction::BRANCH: {
-				if (toBool(operand(1))) {
-					jumpDistance = inst.operand2;
+				VM_CASE(BRANCHNOT): {
+					if (!toBool(RA)) {
+						VM_LOOP_JUMP(pc->sbx());
+					}
+					VM_NEXT();
 				}
-				break;
-			}
-			 case Instruction::BRANCHNOT: {
-				if (!toBool(operand(1))) {
-					jumpDistance = inst.operand2;
+				VM_CASE(JEQ):    VM_TEST_JUMP(CompareTest<OpEqual>(RB, RC));
+				VM_CASE(JLT):
+					VM_QUICKEN(QuickenInteger(RB, RC, Instruction::JLT_II));
+					VM_TEST_JUMP(NumericTest<OpLess>(RB, RC));
+				VM_CASE(JLE):
+					VM_QUICKEN(QuickenInteger(RB, RC, Instruction::JLE_II));
+					VM_TEST_JUMP(NumericTest<OpLessEqual>(RB, RC));
+				VM_CASE(JEQK):   VM_TEST_JUMP(CompareTest<OpEqual>(RB, KC));
+				VM_CASE(JLTK):
+					VM_QUICKEN(QuickenInteger(RB, KC, Instruction::JLTK_II));
+					VM_TEST_JUMP(NumericTest<OpLess>(RB, KC));
+				VM_CASE(JLEK):
+					VM_QUICKEN(QuickenInteger(RB, KC, Instruction::JLEK_II));
+					VM_TEST_JUMP(NumericTest<OpLessEqual>(RB, KC));
+				VM_CASE(JGTK):   VM_TEST_JUMP(NumericTest<OpGreater>(RB, KC));
+				VM_CASE(JGEK):   VM_TEST_JUMP(NumericTest<OpGreaterEqual>(RB, KC));
+				VM_CASE(FORPREP):
+					if (ForTest(RA, RB, *pc) == false) { VM_JUMP(1 + pc[1].sax()); }
+					VM_JUMP(2);
+				VM_CASE(FORLOOP):
+					ForStep(RA, pc->forStep(), &objectManager_);
+					if (ForTest(RA, RB, *pc)) { VM_LOOP_JUMP(1 + pc[1].sax()); }
+					VM_JUMP(2);
+				VM_CASE(CALL): {
+					if (RA.t == TypeFunc) {
+						VM_SAVE_PC(1); // the callee returns to the next instruction
+						functionCall_(&RA, pc->b(), pc->c());
+						VM_LOAD_FRAME();
+						VM_TICK();
+						VM_SAMPLE();
+						VM_ENTER_FUNCTION();
+						VM_DISPATCH();
+					} else if (RA.t == TypeCFunc) {
+						CfunctionCall_(&RA, pc->b(), pc->c());
+						VM_LOAD_BASE(); // the C function may have called back into the script, which can move the stack
+					} else if (RA.t == TypeCoroutine) {
+						VM_SAVE_PC(1); // the resumer continues from the next instruction when the coroutine yields
+						resumeCoroutine_(&RA, pc->b(), pc->c());
+						VM_LOAD_FRAME();
+						VM_ENTER_NATIVE();
+						VM_DISPATCH();
+					} else {
+						throw Error(L"wrong attempt to call non-function value");
+					}
+					++pc;
+					VM_ENTER_NATIVE();
+					VM_DISPATCH();
 				}
-				break;
-			}
-			case Instruction::CALL: {
-				if (operand(1).t == TypeFunc) {
-					functionCall_(&operand(1), inst.operand2, inst.operand3);
-					jumpDistance = 0;
-				} else if (operand(1).t == TypeCFunc) {
-					CfunctionCall_(&operand(1), inst.operand2, inst.operand3);
-				} else {
-					throw Error(L"wrong attempt to call non-function value");
+				VM_CASE(TAILCALL): {
+					if (RA.t == TypeFunc) {
+						tailCall_(&RA, pc->b());
+						VM_LOAD_FRAME();
+						VM_TICK();
+						VM_SAMPLE();
+						VM_ENTER_FUNCTION();
+						VM_DISPATCH();
+					} else if (RA.t == TypeCFunc) {
+						CfunctionCall_(&RA, pc->b(), pc->c());
+						VM_LOAD_BASE();
+					} else if (RA.t == TypeCoroutine) {
+						VM_SAVE_PC(1); // a coroutine is resumed as it is by CALL, then RETURN follows
+						resumeCoroutine_(&RA, pc->b(), pc->c());
+						VM_LOAD_FRAME();
+						VM_ENTER_NATIVE();
+						VM_DISPATCH();
+					} else {
+						throw Error(L"wrong attempt to call non-function value");
+					}
+					VM_NEXT(); // RETURN
 				}
-				break;
-			}
-			case Instruction::RETURN: {
-				if (inst.operand2 == 0) {
-					callStack_.pop_back();
-				} else {
-					functionReturn_(&currentClosure.local(inst.operand1), inst.operand2);
+				VM_CASE(RETURN): {
+					if (pc->b() == 0) {
+						popFrame_();
+					} else {
+						functionReturn_(&RA, pc->b());
+					}
+					if (coroutine_.get() != nullptr && callStack_.size() == coroutine_->bottom_) { finishCoroutine_(); }
+					if (callStack_.size() == depth) { return true; }
+					VM_LOAD_FRAME();
+					VM_ENTER_NATIVE();
+					VM_DISPATCH();
 				}
-				if (callStack_.empty() == true) { return; }
-				break;
-			}
-			case Instruction::YIELD: {
-				throw Error(L"currently coroutine/yield is not supported");
+				VM_CASE(YIELD): {
+					if (coroutine_.get() == nullptr) {
+						throw Error(L"yield outside of a coroutine");
+					}
+					if (coroutine_->bottom_ < depth) {
+						throw Error(L"a coroutine can not yield across a C function");
+					}
+					VM_SAVE_PC(1); // the coroutine continues from the next instruction when it is resumed
+					yieldCoroutine_(&RA, pc->b());
+					VM_LOAD_FRAME();
+					VM_ENTER_NATIVE();
+					VM_DISPATCH();
+				}
+				VM_CASE(CLOSE):  closeUpValues_(&RA); VM_NEXT();
+
+				// Quickened instructions
+				VM_CASE(ADD_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { RA = OpAdd::op(RB.v.i, RC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(ADD_FF):
+					if (RB.t == TypeFloat && RC.t == TypeFloat) { RA = OpAdd::op(RB.v.f, RC.v.f); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(SUB_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { RA = OpSubtract::op(RB.v.i, RC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(SUB_FF):
+					if (RB.t == TypeFloat && RC.t == TypeFloat) { RA = OpSubtract::op(RB.v.f, RC.v.f); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(MUL_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { RA = OpMultiply::op(RB.v.i, RC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(MUL_FF):
+					if (RB.t == TypeFloat && RC.t == TypeFloat) { RA = OpMultiply::op(RB.v.f, RC.v.f); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(ADDK_II): // K(C) was an integer when quickened, and constants never change
+					if (RB.t == TypeInt) { RA = OpAdd::op(RB.v.i, KC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(SUBK_II):
+					if (RB.t == TypeInt) { RA = OpSubtract::op(RB.v.i, KC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(LT_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { RA = OpLess::op(RB.v.i, RC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(LE_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { RA = OpLessEqual::op(RB.v.i, RC.v.i); VM_NEXT(); }
+					VM_DEQUICKEN();
+				VM_CASE(JLT_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { VM_TEST_JUMP(RB.v.i < RC.v.i); }
+					VM_DEQUICKEN();
+				VM_CASE(JLE_II):
+					if (RB.t == TypeInt && RC.t == TypeInt) { VM_TEST_JUMP(RB.v.i <= RC.v.i); }
+					VM_DEQUICKEN();
+				VM_CASE(JLTK_II):
+					if (RB.t == TypeInt) { VM_TEST_JUMP(RB.v.i < KC.v.i); }
+					VM_DEQUICKEN();
+				VM_CASE(JLEK_II):
+					if (RB.t == TypeInt) { VM_TEST_JUMP(RB.v.i <= KC.v.i); }
+					VM_DEQUICKEN();
+				VM_CASE(GETTABLE_ARRAY_INT):
+					if (RB.t == TypeArray && RC.t == TypeInt) {
+						RA = static_cast<Array*>(RB.v.obj)->getValue(RC.v.i); VM_NEXT();
+					}
+					VM_DEQUICKEN();
+				VM_CASE(SETTABLE_ARRAY_INT):
+					if (RA.t == TypeArray && RC.t == TypeInt) {
+						static_cast<Array*>(RA.v.obj)->setValue(RC.v.i, RB); VM_NEXT();
+					}
+					VM_DEQUICKEN();
 			}
+#undef RA
+#undef RB
+#undef RC
+#undef KC
 		}
-#undef local
-
-		callStack_.back().programCounter += jumpDistance;
+	} catch (Error& error) {
+		VM_SAVE_PC(0);
+		recorder_.abort();
+		error.locate(prototype->line(static_cast<uint32_t>(pc - code)));
+		throw;
+	} catch (...) {
+		VM_SAVE_PC(0);
+		recorder_.abort();
+		throw;
 	}
 }
 
+#undef VM_DISPATCH
+#undef VM_SWITCH
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_TEST_JUMP
+#undef VM_LOAD_FRAME
+#undef VM_LOAD_BASE
+#undef VM_SAVE_PC
+#undef VM_QUICKEN
+#undef VM_DEQUICKEN
+#undef VM_PROFILE
+#undef VM_UNCOUNT
+#undef VM_SAMPLE
+#undef VM_TICK
+#undef VM_ENTER_NATIVE
+#undef VM_ENTER_LOOP
+#undef VM_ENTER_FUNCTION
+#undef VM_LOOP_JUMP
+#undef VM_START_RECORDING
+#undef VM_STOP_RECORDING
+#undef VM_RECORD
+
 void Context::functionCall_(Variable argValues[], uint32_t numArgs, uint32_t numRets)
 {
 	Ref<Function> callee(static_cast<Function*>(argValues[0].v.obj));
-	Ref<Closure> closure(new Closure(callee->prototype(), callee->upperClosure(), &objectManager_));
+	Prototype& prototype = *callee->prototype();
+	uint32_t base = callStack_.empty() ? 0 : callStack_.back().top;
+
+	// A function called back from a C function is placed above its arguments, which may be pushed
+	// above the frame of the caller through the window of the C function
+	if (argValues >= stack_.data() && argValues < stack_.data() + stack_.size()) {
+		base = std::max(base, static_cast<uint32_t>(argValues - stack_.data()) + numArgs + 1);
+	}
+	uint32_t top = base + prototype.localSize();
+
+	argValues = growStack_(top, argValues);
+	Variable* locals = stack_.data() + base;
 	
-	uint32_t size = std::min(numArgs, callee->prototype()->numArgs());
+	uint32_t size = std::min(numArgs, prototype.numArgs());
+
+	for (uint32_t i = 0; i < size; i++) { 
+		locals[i] = argValues[i+1];
+	}
+	for (uint32_t i = numArgs; i < prototype.numArgs(); i++) {
+		locals[i] = TypeNull;
+	}
+
+	callStack_.push_back(CallInfo_(std::move(callee), &argValues[0], numRets, base, top, 0));
+}
+
+// Replaces the running frame with the frame of the callee. The callee returns to where the running
+// function would return, so a chain of tail calls runs in a constant number of frames.
+void Context::tailCall_(Variable argValues[], uint32_t numArgs)
+{
+	Ref<Function> callee(static_cast<Function*>(argValues[0].v.obj));
+	Prototype& prototype = *callee->prototype();
+	uint32_t base = callStack_.back().base;
+	uint32_t top = base + prototype.localSize();
+
+	argValues = growStack_(top, argValues);
+	closeUpValues_(stack_.data() + base);
+
+	// The arguments are above the registers they are moved to, so they are not overwritten before being read
+	Variable* locals = stack_.data() + base;
+	uint32_t size = std::min(numArgs, prototype.numArgs());
 
 	for (uint32_t i = 0; i < size; i++) { 
-		closure->local(i) = argValues[i+1];
+		locals[i] = argValues[i+1];
 	}
-	for (uint32_t i = numArgs; i < callee->prototype()->numArgs(); i++) {
-		closure->local(i) = TypeNull;
+	for (uint32_t i = base + size; i < std::max(top, callStack_.back().top); i++) {
+		stack_[i] = TypeNull;
 	}
 
-	callStack_.push_back(CallInfo_(std::move(callee), std::move(closure), &argValues[0], numRets, 0));
+	CallInfo_ &frame = callStack_.back();
+	frame.function = std::move(callee);
+	frame.top = top;
+	frame.programCounter = 0;
 }
 
+// A C function works on its arguments in place. The communication stack is moved from buffer_ to the
+// registers right after the function, so the arguments are not copied, and the results pushed by the
+// C function are moved down by one register to where the caller expects them.
+// When the C function is called by a script which a C function called back, the window of the outer
+// C function is restored after the call. Since the stack may be moved by a callback, the windows
+// are located by the index in the stack.
 void Context::CfunctionCall_(Variable argValues[], uint32_t numArgs, uint32_t numRets)
 {
+	assert(argValues >= stack_.data() && argValues < stack_.data() + stack_.size());
+
+	bool outerInStack = (window_ != buffer_.data());
+	uint32_t outerBase = outerInStack ? static_cast<uint32_t>(window_ - stack_.data()) : 0;
+	uint32_t outerSize = bufferSize_;
+	auto restoreWindow = [this, outerInStack, outerBase, outerSize]() {
+		if (outerInStack == true) {
+			window_ = stack_.data() + outerBase;
+			windowCapacity_ = static_cast<uint32_t>(stack_.size()) - outerBase;
+			bufferSize_ = outerSize;
+		} else {
+			resetWindow_();
+		}
+	};
+
+	uint32_t windowBase = static_cast<uint32_t>(argValues - stack_.data()) + 1;
+	argValues = growStack_(windowBase + std::max(numArgs, MIN_WINDOW_SIZE), argValues);
+
+	CFunction function = argValues[0].v.func;
+	window_ = argValues + 1;
+	windowCapacity_ = static_cast<uint32_t>(stack_.size()) - windowBase;
 	bufferSize_ = numArgs;
-	for (uint32_t i = 0; i < numArgs; i++) {
-		buffer_[i] = argValues[i+1];
+
+	try {
+		function(*this);
+	} catch (...) {
+		restoreWindow();
+		throw;
 	}
-	reentrant_ = true;
-	argValues[0].v.func(*this);
-	reentrant_ = false;
 
+	argValues = stack_.data() + windowBase - 1;
 	uint32_t size = std::min(numRets, bufferSize_);
+	uint32_t used = 1 + std::max(numArgs, bufferSize_);
 	for (uint32_t i = 0; i < size; i++) {
-		argValues[i] = buffer_[i];
+		argValues[i] = std::move(argValues[i+1]);
 	}
-	for (uint32_t i = size; i < numRets; i++) {
+	for (uint32_t i = size; i < std::max(numRets, used); i++) {
 		argValues[i] = TypeNull;
 	}
+	restoreWindow();
+}
+
+// Moves the communication stack back to buffer_ for the host
+void Context::resetWindow_()
+{
+	window_ = buffer_.data();
+	windowCapacity_ = static_cast<uint32_t>(buffer_.size());
 	bufferSize_ = 0;
 }
 
@@ -432,9 +1170,347 @@ void Context::functionReturn_(Variable retValues[], uint32_t numRets)
 		returnTo[i] = TypeNull;
 	}
 
+	popFrame_();
+}
+
+void Context::popFrame_()
+{
+	assert(callStack_.empty() == false);
+
+	closeUpValues_(stack_.data() + callStack_.back().base);
+
+	// Release the registers so that objects referred only by the finished frame can be freed
+	for (uint32_t i = callStack_.back().base; i < callStack_.back().top; i++) {
+		stack_[i] = TypeNull;
+	}
+
 	callStack_.pop_back();
 }
 
+// Makes the register stack hold at least the given number of slots. Since growing the stack moves
+// every register, the return addresses of frames, the open upvalues and the given pointer are
+// rebased when they point into the stack.
+Variable* Context::growStack_(uint32_t size, Variable* pointer)
+{
+	if (size <= stack_.size()) {
+		return pointer;
+	}
+	if (size > MAX_STACK_SIZE) {
+		throw Error(L"stack overflow (too deep recursion)");
+	}
+
+	Variable* oldBegin = stack_.data();
+	Variable* oldEnd = oldBegin + stack_.size();
+
+	stack_.resize(std::min(std::max(size, static_cast<uint32_t>(stack_.size()) * 2), MAX_STACK_SIZE), TypeNull);
+
+	auto rebase = [this, oldBegin, oldEnd](Variable* ptr) -> Variable* {
+		return (ptr >= oldBegin && ptr < oldEnd) ? stack_.data() + (ptr - oldBegin) : ptr;
+	};
+
+	std::for_each(callStack_.begin(), callStack_.end(), [&rebase](CallInfo_& frame) {
+		frame.returnTo = rebase(frame.returnTo);
+	});
+	std::for_each(openUpValues_.begin(), openUpValues_.end(), [&rebase](Ref<UpValue>& upValue) {
+		upValue->relocate(rebase(upValue->slot()));
+	});
+	window_ = rebase(window_);
+
+	return rebase(pointer);
+}
+
+// Returns the open upvalue which refers to the given register, or opens a new one.
+// Functions created in the same frame share a single upvalue for the same register.
+UpValue* Context::findUpValue_(Variable* slot)
+{
+	auto position = openUpValues_.end();
+
+	while (position != openUpValues_.begin() && (*(position - 1))->slot() >= slot) {
+		--position;
+		if ((*position)->slot() == slot) {
+			return position->get();
+		}
+	}
+
+	return openUpValues_.insert(position, new UpValue(slot, &objectManager_))->get();
+}
+
+// Closes every open upvalue which refers to the given register or above
+void Context::closeUpValues_(Variable* level)
+{
+	while (openUpValues_.empty() == false && openUpValues_.back()->slot() >= level) {
+		openUpValues_.back()->close();
+		openUpValues_.pop_back();
+	}
+}
+
+// Places the frames of the coroutine above the running frame, and its first frame returns to R(A) of the resumer
+// as a callee does. The arguments are passed to the function when the coroutine starts, and are ignored after that.
+void Context::resumeCoroutine_(Variable argValues[], uint32_t numArgs, uint32_t numRets)
+{
+	Ref<Coroutine> coroutine(static_cast<Coroutine*>(argValues[0].v.obj));
+	const size_t bottom = callStack_.size();
+
+	if (coroutine->status_ != Coroutine::SUSPENDED) {
+		throw Error(L"cannot resume a %ls coroutine", Coroutine::statusName(coroutine->status_));
+	}
+
+	if (coroutine->function_.get() != nullptr) {
+		argValues[0] = Variable(TypeFunc, coroutine->function_.get());
+		coroutine->function_.reset();
+		functionCall_(argValues, numArgs, numRets);
+	} else {
+		const uint32_t base = callStack_.back().top;
+		auto& registers = coroutine->registers_;
+
+		argValues = growStack_(base + static_cast<uint32_t>(registers.size()), argValues);
+		Variable* slots = stack_.data() + base;
+		std::move(registers.begin(), registers.end(), slots);
+
+		// The open upvalues are above every open upvalue of the resumer, so the order is kept
+		std::for_each(coroutine->openUpValues_.begin(), coroutine->openUpValues_.end(), [&](Ref<UpValue>& upValue) {
+			upValue->relocate(slots + (upValue->slot() - registers.data()));
+			openUpValues_.push_back(std::move(upValue));
+		});
+
+		for (auto& frame : coroutine->frames_) {
+			const bool isFirst = (callStack_.size() == bottom);
+
+			callStack_.push_back(CallInfo_(std::move(frame.function), isFirst ? argValues : slots + frame.returnTo,
+			                               isFirst ? numRets : frame.numRets, base + frame.base, base + frame.top,
+			                               frame.programCounter));
+		}
+
+		coroutine->frames_.clear();
+		coroutine->registers_.clear();
+		coroutine->openUpValues_.clear();
+	}
+
+	if (coroutine_.get() != nullptr) {
+		coroutine_->status_ = Coroutine::NORMAL;
+	}
+	coroutine->status_ = Coroutine::RUNNING;
+	coroutine->bottom_ = bottom;
+	coroutine->resumer_ = std::move(coroutine_);
+	coroutine_ = std::move(coroutine);
+}
+
+// Returns the values to the resumer as the first frame of the running coroutine would, then moves the frames
+// and their registers into the coroutine. The open upvalues which refer to the registers are moved along.
+void Context::yieldCoroutine_(Variable retValues[], uint32_t numRets)
+{
+	Ref<Coroutine> coroutine = coroutine_; // the resumer may have dropped it, then it is freed once it is left
+	const CallInfo_& first = callStack_[coroutine->bottom_];
+	const uint32_t size = std::min(numRets, first.numRets);
+
+	for (uint32_t i = 0; i < size; i++) {
+		first.returnTo[i] = retValues[i];
+	}
+	for (uint32_t i = numRets; i < first.numRets; i++) {
+		first.returnTo[i] = TypeNull;
+	}
+
+	const uint32_t base = first.base;
+	Variable* slots = stack_.data() + base;
+	auto& registers = coroutine->registers_;
+
+	registers.assign(callStack_.back().top - base, TypeNull);
+	std::move(slots, slots + registers.size(), registers.begin());
+
+	auto upValues = std::find_if(openUpValues_.begin(), openUpValues_.end(), [slots](const Ref<UpValue>& upValue) {
+		return upValue->slot() >= slots;
+	});
+	std::for_each(upValues, openUpValues_.end(), [&](Ref<UpValue>& upValue) {
+		upValue->relocate(registers.data() + (upValue->slot() - slots));
+		coroutine->openUpValues_.push_back(std::move(upValue));
+	});
+	openUpValues_.erase(upValues, openUpValues_.end());
+
+	const auto bottom = callStack_.begin() + coroutine->bottom_;
+	for (auto frame = bottom; frame != callStack_.end(); ++frame) {
+		const uint32_t returnTo = (frame == bottom) ? 0 : static_cast<uint32_t>(frame->returnTo - slots);
+
+		coroutine->frames_.push_back(Coroutine::Frame_{ std::move(frame->function), returnTo, frame->numRets,
+		                                                frame->base - base, frame->top - base, frame->programCounter });
+	}
+	callStack_.erase(bottom, callStack_.end());
+
+	coroutine->status_ = Coroutine::SUSPENDED;
+	coroutine_ = std::move(coroutine->resumer_);
+	if (coroutine_.get() != nullptr) {
+		coroutine_->status_ = Coroutine::RUNNING;
+	}
+}
+
+// The first frame of the running coroutine has returned, or has been popped by an error
+void Context::finishCoroutine_()
+{
+	Ref<Coroutine> coroutine = std::move(coroutine_);
+
+	coroutine->status_ = Coroutine::DEAD;
+	coroutine_ = std::move(coroutine->resumer_);
+	if (coroutine_.get() != nullptr) {
+		coroutine_->status_ = Coroutine::RUNNING;
+	}
+}
+
+// An error pops the frames above the depth, so the coroutines running on them can not be resumed any more
+void Context::abandonCoroutines_(size_t depth)
+{
+	while (coroutine_.get() != nullptr && coroutine_->bottom_ >= depth) {
+		finishCoroutine_();
+	}
+}
+
+void Context::createCoroutine_(Context& context)
+{
+	context.checkStack_(0, TypeFunc, L"function");
+
+	Ref<Coroutine> coroutine = new Coroutine(static_cast<Function*>(context.window_[0].v.obj), &context.objectManager_);
+	context.clear();
+	context.window_[context.bufferSize_++] = Variable(TypeCoroutine, coroutine.get());
+}
+
+void Context::coroutineStatus_(Context& context)
+{
+	context.checkStack_(0, TypeCoroutine, L"coroutine");
+
+	const wchar_t* status = Coroutine::statusName(static_cast<Coroutine*>(context.window_[0].v.obj)->status());
+	context.clear();
+	context.pushString(status);
+}
+
+uint32_t Context::numQuickened() const
+{
+	return numQuickened_;
+}
+
+uint32_t Context::numDequickened() const
+{
+	return numDequickened_;
+}
+
+// Runs the native code of the loop whose head is at the offset, and returns the instruction the interpreter continues from.
+// A hot loop is recorded as a trace first (CMM_USE_TRACING), and the baseline JIT takes the loops which can not be traced.
+uint32_t Context::enterLoop_(Prototype& prototype, Variable* base, uint32_t head)
+{
+	if (recorder_.isRecording()) {
+		return head;
+	}
+
+#if CMM_USE_TRACING
+	Prototype::LoopTrace& loopTrace = prototype.loopTrace(head);
+	if (loopTrace.code != nullptr) {
+		return loopTrace.code->run(base, prototype.constants(), head, &ticks_);
+	}
+	if (loopTrace.failed == false) {
+		if (++loopTrace.counter >= CMM_TRACE_THRESHOLD) {
+			recorder_.start(prototype, base, head);
+		}
+		return head;
+	}
+#endif
+
+	const JitCode* jitCode = prototype.jitCode();
+	return (jitCode != nullptr) ? jitCode->run(base, prototype.constants(), head, &ticks_) : head;
+}
+
+void Context::enableJit(bool enable)
+{
+	jitEnabled_ = enable && CMM_USE_JIT;
+}
+
+bool Context::jitEnabled() const
+{
+	return jitEnabled_;
+}
+
+void Context::enableProfiler(bool enable)
+{
+	profilerEnabled_ = enable && CMM_USE_PROFILER;
+}
+
+bool Context::profilerEnabled() const
+{
+	return profilerEnabled_;
+}
+
+Profiler& Context::profiler()
+{
+	return profiler_;
+}
+
+void Context::enableSampler(uint32_t intervalMicroseconds)
+{
+	if (intervalMicroseconds != 0 && CMM_USE_PROFILER) {
+		sampler_.start(intervalMicroseconds);
+	} else {
+		sampler_.stop();
+	}
+}
+
+Sampler& Context::sampler()
+{
+	return sampler_;
+}
+
+void Context::setBudget(uint64_t numTicks, uint32_t milliseconds, bool suspend)
+{
+	budgetTicks_ = (numTicks == 0) ? UINT64_MAX : numTicks;
+	hasDeadline_ = (milliseconds != 0);
+	deadline_ = Clock_::now() + std::chrono::milliseconds(milliseconds);
+	suspendOnBudget_ = suspend;
+	refillTicks_();
+}
+
+bool Context::isSuspended() const
+{
+	return suspended_;
+}
+
+// Hands out the next slice of the budget to ticks_, unless the budget has run out. Without any limit,
+// the slice is as large as it can be, so the native code seldom leaves for the check.
+bool Context::refillTicks_()
+{
+	const bool unlimited = (budgetTicks_ == UINT64_MAX);
+
+	if (budgetTicks_ == 0 || (hasDeadline_ && Clock_::now() >= deadline_)) {
+		ticks_ = 0;
+		return false;
+	}
+
+	uint64_t slice = (unlimited && !hasDeadline_) ? INT32_MAX : std::min<uint64_t>(budgetTicks_, CMM_BUDGET_SLICE);
+	if (unlimited == false) {
+		budgetTicks_ -= slice;
+	}
+	ticks_ = static_cast<int32_t>(slice);
+	return true;
+}
+
+// Called by loop_ when ticks_ has run out. Returns false if the script is to be suspended.
+bool Context::checkBudget_(bool suspendable)
+{
+	if (refillTicks_()) {
+		--ticks_; // the tick which has run out is taken from the new slice
+		return true;
+	}
+	if (suspendOnBudget_ && suspendable) {
+		return false;
+	}
+	throw BudgetError();
+}
+
+// A frame below the running one has saved the offset after its call
+void Context::sample_(uint32_t offset)
+{
+	for (CallStack_::size_type i = 0; i + 1 < callStack_.size(); i++) {
+		const CallInfo_& frame = callStack_[i];
+		sampler_.addFrame(*frame.function->prototype(), frame.programCounter == 0 ? 0 : frame.programCounter - 1);
+	}
+	sampler_.addFrame(*callStack_.back().function->prototype(), offset);
+	sampler_.endSample();
+}
+
 uint32_t Context::stackSize()
 {
 	return bufferSize_;
@@ -444,53 +1520,61 @@ Type Context::type(uint32_t index) const
 {
 	checkStackRange_(index);
 
-	return buffer_[index].t;
+	return window_[index].t;
 }
 
 void Context::pop(uint32_t number)
 {
 	for (uint32_t i = 0; i < number; i++) {
-		buffer_[--bufferSize_] = TypeNull;
+		window_[--bufferSize_] = TypeNull;
 	}
 }
 
 void Context::clear()
 {
-	for (uint32_t i = 0; i < bufferSize_; i++) {
-		buffer_[--bufferSize_] = TypeNull;
+	while (bufferSize_ > 0) {
+		window_[--bufferSize_] = TypeNull;
 	}
 }
 
 void Context::pushNull()
 {
 	checkStackOverflow_();
-	buffer_[bufferSize_++] = TypeNull;
+	window_[bufferSize_++] = TypeNull;
+}
+
+void Context::pushValue(uint32_t index)
+{
+	checkStackRange_(index);
+	checkStackOverflow_();
+	window_[bufferSize_] = window_[index];
+	bufferSize_++;
 }
 
 void Context::pushInt(int32_t value)
 {
 	checkStackOverflow_();
-	buffer_[bufferSize_++] = value;
+	window_[bufferSize_++] = value;
 }
 
 uint32_t Context::getInt(uint32_t index) const
 {
 	checkStack_(index, TypeInt, L"integer");
 
-	return buffer_[index].v.i;
+	return window_[index].v.i;
 }
 
 void Context::pushFloat(float value)
 {
 	checkStackOverflow_();
-	buffer_[bufferSize_++] = value;
+	window_[bufferSize_++] = value;
 }
 
 float Context::getFloat(uint32_t index) const
 {
 	checkStack_(index, TypeFloat, L"float");
 	
-	return buffer_[index].v.f;
+	return window_[index].v.f;
 }
 
 void Context::pushString(const wchar_t value[])
@@ -498,40 +1582,48 @@ void Context::pushString(const wchar_t value[])
 	checkStackOverflow_();
 	String* newString = new String(value, &objectManager_);
 
-	buffer_[bufferSize_++] = Variable(TypeString, newString);
+	window_[bufferSize_++] = Variable(TypeString, newString);
 }
 
 const wchar_t* Context::getString(uint32_t index) const
 {
 	checkStack_(index, TypeString, L"string");
 
-	String &str = static_cast<String&>(*buffer_[index].v.obj);
+	String &str = static_cast<String&>(*window_[index].v.obj);
 	return str.value().c_str();
 }
 
+Ref<Prototype> Context::getPrototype(uint32_t index) const
+{
+	checkStack_(index, TypeFunc, L"function");
+
+	return static_cast<Function&>(*window_[index].v.obj).prototype();
+}
+
 void Context::pushNewTable()
 {
 	checkStackOverflow_();
 	Table* newTable = new Table(&objectManager_);
 
-	buffer_[bufferSize_++] = Variable(TypeTable, newTable);
+	window_[bufferSize_++] = Variable(TypeTable, newTable);
 }
 
 void Context::pushTableValue(uint32_t tablePos)
 {
 	checkStack_(tablePos, TypeTable, L"table");
 
-	Table &table = static_cast<Table&>(*buffer_[tablePos].v.obj);
-	buffer_.back() = table.getValue(buffer_.back());
+	Table &table = static_cast<Table&>(*window_[tablePos].v.obj);
+	checkStackRange_(bufferSize_ - 1);
+	window_[bufferSize_ - 1] = table.getValue(window_[bufferSize_ - 1]);
 }
 
 void Context::setTableValue(uint32_t tablePos)
 {
 	checkStack_(tablePos, TypeTable, L"table");
 
-	Table &table = static_cast<Table&>(*buffer_[tablePos].v.obj);
-	Variable &value = buffer_[--bufferSize_];
-	Variable &key = buffer_[--bufferSize_];
+	Table &table = static_cast<Table&>(*window_[tablePos].v.obj);
+	Variable &value = window_[--bufferSize_];
+	Variable &key = window_[--bufferSize_];
 
 	table.setValue(key, value);
 }
@@ -540,7 +1632,7 @@ uint32_t Context::tableSize(uint32_t tablePos) const
 {
 	checkStack_(tablePos, TypeTable, L"table");
 
-	Table &table = static_cast<Table&>(*buffer_[tablePos].v.obj);
+	Table &table = static_cast<Table&>(*window_[tablePos].v.obj);
 	return table.size();
 }
 
@@ -549,30 +1641,30 @@ void Context::pushNewArray()
 	checkStackOverflow_();
 	Array* newArray = new Array(&objectManager_);
 
-	buffer_[bufferSize_++] = Variable(TypeTable, newArray);
+	window_[bufferSize_++] = Variable(TypeTable, newArray);
 }
 
 void Context::pushArrayValue(uint32_t arrayPos, uint32_t arrayIndex)
 {
 	checkStack_(arrayPos, TypeArray, L"array");
 
-	Array &array = static_cast<Array&>(*buffer_[arrayPos].v.obj);
-	buffer_[bufferSize_++] = array.getValue(arrayIndex);
+	Array &array = static_cast<Array&>(*window_[arrayPos].v.obj);
+	window_[bufferSize_++] = array.getValue(arrayIndex);
 }
 
 void Context::setArrayValue(uint32_t arrayPos, uint32_t arrayIndex)
 {
 	checkStack_(arrayPos, TypeArray, L"array");
 
-	Array &array = static_cast<Array&>(*buffer_[arrayPos].v.obj);
-	array.setValue(arrayIndex, buffer_[--bufferSize_]);
+	Array &array = static_cast<Array&>(*window_[arrayPos].v.obj);
+	array.setValue(arrayIndex, window_[--bufferSize_]);
 }
 
 uint32_t Context::arraySize(uint32_t arrayPos) const
 {
 	checkStack_(arrayPos, TypeArray, L"array");
 
-	Array &array = static_cast<Array&>(*buffer_[arrayPos].v.obj);
+	Array &array = static_cast<Array&>(*window_[arrayPos].v.obj);
 	return array.size();
 }
 
@@ -581,20 +1673,20 @@ void Context::setGlobal(uint32_t index, const wchar_t globalName[])
 	checkStackRange_(index);
 
 	String *newString = new String(globalName, &objectManager_);
-	global_->setValue(Variable(TypeString, newString), buffer_[index]);
+	global_->setValue(Variable(TypeString, newString), window_[index]);
 }
 
 void Context::getGlobal(const wchar_t globalName[])
 {
 	String *newString = new String(globalName, &objectManager_);
-	buffer_[bufferSize_++] = global_->getValue(Variable(TypeString, newString));
+	window_[bufferSize_++] = global_->getValue(Variable(TypeString, newString));
 }
 
 void Context::checkStack_(uint32_t index, Type type, const wchar_t typeName[]) const
 {
 	checkStackRange_(index);
 
-	if (buffer_[index].t != type) {
+	if (window_[index].t != type) {
 		throw Error(L"Communication stack index [%d] does not contains %s value.", index, typeName);
 	}
 }
@@ -608,8 +1700,7 @@ void Context::checkStackRange_(uint32_t index) const
 
 void Context::checkStackOverflow_() const
 {
-	if (bufferSize_ > 99) {
-		// TODO: this is temporary implementatation - maximum stack size should be dynamically changable in near future
+	if (bufferSize_ >= windowCapacity_) {
 		throw Error(L"Communication stack overflow.");
 	}
 }
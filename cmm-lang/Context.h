@@ -2,27 +2,51 @@
 #define VIRTUAL_MACHINE_H
 
 #include <cstdint>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "Memory.h"
 #include "Object.h"
 #include "DataType.h"
+#include "Trace.h"
+#include "Profiler.h"
 
 namespace cmm
 {
 
+namespace Binding { struct Access; }
+struct Module;
+class Script;
+
 class Context
 {
+	friend struct Binding::Access;
+
 public:
 	explicit        Context();
 	                ~Context();
 
-	void            load(const wchar_t code[]);
+	void            load(const wchar_t code[], bool linkGlobals = true);
+
+	// Loads a script compiled once for many contexts (Script.h) without compiling it again.
+	// The context keeps the script until it is destroyed, so the script may be shared with other threads.
+	void            load(std::shared_ptr<const Script> script, bool linkGlobals = true);
+
+	// A module compiled ahead of time (Module.h) is registered by the function its C++ source defines,
+	// then loaded by the name like load() does, without compiling the script
+	void            registerModule(const Module& module);
+	void            loadModule(const wchar_t name[], bool linkGlobals = true);
 	void            run(uint32_t numArgs, uint32_t numRets);
 	
 	void            registerCfunction(const wchar_t name[], CFunction func);
 
+	// Registers a C++ function with its argument and return types deduced, which is defined in Binding.h
+	template <typename Signature, Signature function>
+	void            bind(const wchar_t name[]);
+
 	void            garbageCollect();
 
 	uint32_t        stackSize();
@@ -33,6 +57,7 @@ public:
 	void            clear();
 
 	void            pushNull();
+	void            pushValue(uint32_t index); // pushes a copy of the value at the index
 
 	void            pushInt(int32_t value);
 	uint32_t        getInt(uint32_t index) const;
@@ -43,6 +68,9 @@ public:
 	void            pushString(const wchar_t value[]);
 	const wchar_t*  getString(uint32_t index) const;
 
+	// The prototype of the function at the index, such as the script load() leaves, e.g. to print its code (CodePrinter.h)
+	Ref<Prototype>  getPrototype(uint32_t index) const;
+
 	void            pushNewTable();
 	void            pushTableValue(uint32_t tablePos);
 	void            setTableValue(uint32_t tablePos);
@@ -55,40 +83,129 @@ public:
                    
 	void            setGlobal(uint32_t index, const wchar_t globalName[]);
 	void            getGlobal(const wchar_t globalName[]);
+
+	// The number of instructions rewritten to a quickened form and back to the generic form so far
+	uint32_t        numQuickened() const;
+	uint32_t        numDequickened() const;
+
+	// Lets hot functions and loops run as native code (Jit.h). It is off by default,
+	// and has no effect when the JIT is not built for the platform (CMM_USE_JIT).
+	void            enableJit(bool enable);
+	bool            jitEnabled() const;
+
+	// Counts the instructions the interpreter executes (Profiler.h) from the next run() on. It is off by default,
+	// and has no effect when the profiler is not built (CMM_USE_PROFILER).
+	void            enableProfiler(bool enable);
+	bool            profilerEnabled() const;
+	Profiler&       profiler();
+
+	// Samples the call stack every interval (Sampler in Profiler.h) until it is called with 0.
+	// It has no effect when the profiler is not built (CMM_USE_PROFILER).
+	void            enableSampler(uint32_t intervalMicroseconds);
+	Sampler&        sampler();
+
+	// Limits the work of the scripts from now on to a number of ticks, which are the backward jumps and the calls
+	// in the interpreter and in the native code alike, and to a time in milliseconds. 0 leaves either limit off,
+	// which is the default. When the budget runs out, run() and resume() throw BudgetError (Error.h),
+	// or suspend the script if suspend is true. A script called back from a C function is never suspended.
+	void            setBudget(uint64_t numTicks, uint32_t milliseconds = 0, bool suspend = false);
+
+	// A suspended script keeps its frames until resume() continues it with the budget set by then,
+	// and leaves the results on the communication stack as run() would. The communication stack should
+	// be left as it is, and no other script can be run until the suspended one is finished.
+	bool            isSuspended() const;
+	void            resume();
                    
 private:           
-	void            loop_();
+	typedef std::chrono::steady_clock Clock_;
+
+	bool            loop_(size_t depth, bool suspendable);
+	void            execute_(size_t depth, uint32_t position, uint32_t numRets);
+	bool            refillTicks_();
+	bool            checkBudget_(bool suspendable);
+	uint32_t        enterLoop_(Prototype& prototype, Variable* base, uint32_t head);
+	void            sample_(uint32_t offset);
+
+	void            loadPrototype_(Ref<Prototype> prototype, bool linkGlobals);
+	void            linkGlobals_(Prototype& prototype);
                    
 	void            functionCall_(Variable argValues[], uint32_t numArgs, uint32_t numRets);
+	void            tailCall_(Variable argValues[], uint32_t numArgs);
 	void            CfunctionCall_(Variable argValues[], uint32_t numArgs, uint32_t numRets);
+	void            resetWindow_();
 	void            functionReturn_(Variable retValues[], uint32_t numRets);
+	void            popFrame_();
+	Variable*       growStack_(uint32_t size, Variable* pointer);
+
+	UpValue*        findUpValue_(Variable* slot);
+	void            closeUpValues_(Variable* level);
                    
+	// A coroutine (DataType.h) is created by coroutine(f) and resumed by calling it, and its status is
+	// one of "suspended", "running", "normal" and "dead" by status(co). They are registered as globals.
+	void            resumeCoroutine_(Variable argValues[], uint32_t numArgs, uint32_t numRets);
+	void            yieldCoroutine_(Variable retValues[], uint32_t numRets);
+	void            finishCoroutine_();
+	void            abandonCoroutines_(size_t depth);
+	static void     createCoroutine_(Context& context);
+	static void     coroutineStatus_(Context& context);
+
 	void            checkStack_(uint32_t index, Type type, const wchar_t typeName[]) const;
 	void            checkStackRange_(uint32_t index) const;
 	void            checkStackOverflow_() const;
 
+	// A frame keeps its registers in stack_[base, top)
 	struct CallInfo_
 	{
-		CallInfo_(Ref<Function> func, Ref<Closure> cl, Variable* retTo, uint32_t numRets, uint32_t pc)
-		: function(func), closure(cl), returnTo(retTo), numRets(numRets), programCounter(pc) {}
+		CallInfo_(Ref<Function> func, Variable* retTo, uint32_t numRets, uint32_t base, uint32_t top, uint32_t pc)
+		: function(func), returnTo(retTo), numRets(numRets), base(base), top(top), programCounter(pc) {}
 
 		Ref<Function>  function;
-		Ref<Closure>   closure;
 		Variable*      returnTo;
 		uint32_t       numRets;
+		uint32_t       base;
+		uint32_t       top;
 		uint32_t       programCounter;
 	};
 
 	typedef std::vector<CallInfo_> CallStack_;
 	typedef std::vector<Variable> VariableVector_;
+	typedef std::vector<Ref<UpValue>> UpValueVector_;
+	typedef std::vector<Variable*> GlobalSlotVector_;
+	typedef std::unordered_map<Variable*, uint32_t> GlobalSlotIndex_;
+	typedef std::unordered_map<std::wstring, const Module*> ModuleMap_;
+	typedef std::vector<std::shared_ptr<const Script>> ScriptVector_;
 	
+	ScriptVector_     scripts_;         // loaded, which outlive every object of the context referring to them
 	ObjectManager     objectManager_;
 	Ref<Table>        global_;
+	GlobalSlotVector_ globalSlots_;     // values of the linked globals, which stay in global_
+	GlobalSlotIndex_  globalSlotIndex_; // the slot number of each value in global_
 	VariableVector_   buffer_;
 	uint32_t          bufferSize_;
+	Variable*         window_;          // the communication stack, which is buffer_ or the arguments of a C function
+	uint32_t          windowCapacity_;
 	CallStack_        callStack_;
-
-	bool              reentrant_;	
+	VariableVector_   stack_;
+	UpValueVector_    openUpValues_; // sorted by the address of the slot
+	Ref<Coroutine>    coroutine_;    // the running coroutine, null while the main script is running
+	ModuleMap_        modules_;
+	uint32_t          numQuickened_;
+	uint32_t          numDequickened_;
+	bool              jitEnabled_;
+	TraceRecorder     recorder_;
+	Profiler          profiler_;
+	bool              profilerEnabled_;
+	Sampler           sampler_;
+
+	int32_t           ticks_;           // counted down by every tick, checkBudget_ is called once it goes below 0
+	uint64_t          budgetTicks_;     // the ticks left besides ticks_, UINT64_MAX if they are not limited
+	Clock_::time_point deadline_;
+	bool              hasDeadline_;
+	bool              suspendOnBudget_;
+	bool              suspended_;
+	size_t            suspendedDepth_;  // the state of run() while the script is suspended
+	uint32_t          suspendedPosition_;
+	uint32_t          suspendedNumRets_;
 };
 
 } // The end of the namespace "cmm"
@@ -0,0 +1,58 @@
+#include "StdAfx.h"
+#include "DataType.h"
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+
+#include "Memory.h"
+#include "Object.h"
+
+namespace cmm
+{
+
+Coroutine::Coroutine(Ref<Function> function, ObjectManager* manager)
+: Object(manager), function_(function), status_(SUSPENDED), bottom_(0)
+{
+	assert(function.get() != nullptr);
+}
+
+// The closures created by the suspended frames outlive the registers they refer to, so the upvalues are closed
+Coroutine::~Coroutine()
+{
+	std::for_each(openUpValues_.begin(), openUpValues_.end(), [](Ref<UpValue>& upValue) {
+		upValue->close();
+	});
+}
+
+const wchar_t* Coroutine::statusName(Status status)
+{
+	switch (status) {
+	case SUSPENDED: return L"suspended";
+	case RUNNING:   return L"running";
+	case NORMAL:    return L"normal";
+	default:        return L"dead";
+	}
+}
+
+
+void Coroutine::forEachObject_(const std::function<void(const Object&)>& func)
+{
+	if (function_.get() != nullptr) { func(*function_); }
+	if (resumer_.get() != nullptr) { func(*resumer_); }
+
+	std::for_each(frames_.begin(), frames_.end(), [&func](const Frame_& frame) {
+		func(*frame.function);
+	});
+	std::for_each(registers_.begin(), registers_.end(), [&func](const Variable& value) {
+		if (value.isObject()) {
+			func(*value.v.obj);
+		}
+	});
+	std::for_each(openUpValues_.begin(), openUpValues_.end(), [&func](const Ref<UpValue>& upValue) {
+		func(*upValue);
+	});
+}
+
+} // namespace "cmm"
\ No newline at end of file
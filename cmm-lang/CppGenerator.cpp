@@ -0,0 +1,478 @@
+#include "StdAfx.h"
+#include "CppGenerator.h"
+
+#include <cstdarg>
+#include <cassert>
+#include <cstdint>
+#include <cmath>
+#include <string>
+
+#include "Prototype.h"
+#include "Instruction.h"
+#include "Memory.h"
+#include "DataType.h"
+#include "Error.h"
+
+namespace cmm
+{
+
+namespace
+{
+
+// The offset a jump instruction goes to, the fused compare-and-jump instructions take it from the next JUMP
+uint32_t JumpTarget(const Prototype& prototype, uint32_t offset)
+{
+	const Instruction& inst = prototype.instruction(offset);
+
+	switch (inst.opcode()) {
+	case Instruction::JUMP:      return offset + inst.sax();
+	case Instruction::BRANCH:
+	case Instruction::BRANCHNOT: return offset + inst.sbx();
+	default:                     return offset + 1 + prototype.instruction(offset + 1).sax();
+	}
+}
+
+bool IsJump(uint32_t opcode)
+{
+	return opcode >= Instruction::JUMP && opcode <= Instruction::FORLOOP;
+}
+
+const wchar_t* OperatorOf(uint32_t opcode)
+{
+	switch (opcode) {
+	case Instruction::ADD:   case Instruction::ADDK:   return L"OpAdd";
+	case Instruction::SUB:   case Instruction::SUBK:   return L"OpSubtract";
+	case Instruction::MUL:   case Instruction::MULK:   return L"OpMultiply";
+	case Instruction::BITAND:                          return L"OpBitAnd";
+	case Instruction::BITOR:                           return L"OpBitOr";
+	case Instruction::BITXOR:                          return L"OpBitXor";
+	case Instruction::SL:                              return L"OpShiftLeft";
+	case Instruction::SR:                              return L"OpShiftRight";
+	case Instruction::EQ:    case Instruction::EQK:    case Instruction::JEQ: case Instruction::JEQK: return L"OpEqual";
+	case Instruction::NOTEQ: case Instruction::NOTEQK: return L"OpNotEqual";
+	case Instruction::LT:    case Instruction::LTK:    case Instruction::JLT: case Instruction::JLTK: return L"OpLess";
+	case Instruction::LE:    case Instruction::LEK:    case Instruction::JLE: case Instruction::JLEK: return L"OpLessEqual";
+	case Instruction::GTK:   case Instruction::JGTK:   return L"OpGreater";
+	case Instruction::GEK:   case Instruction::JGEK:   return L"OpGreaterEqual";
+	default:                 assert(false); return L"";
+	}
+}
+
+} // The end of anomymous namespace
+
+
+CppGenerator::CppGenerator()
+: numFunction_(0)
+{
+}
+
+CppGenerator::~CppGenerator()
+{
+}
+
+std::wstring& CppGenerator::generate(const Prototype& prototype, const std::wstring& moduleName)
+{
+	append_(L"// The module \"%ls\" generated by CppGenerator from a C-- script\n\n", moduleName.c_str());
+	append_(L"#include <limits>\n\n");
+	append_(L"#include \"Module.h\"\n");
+	append_(L"#include \"Context.h\"\n\n");
+	append_(L"namespace\n{\n\nusing namespace cmm;\n\n");
+
+	uint32_t mainNum = appendFunction_(prototype);
+
+	append_(L"const Module module = { L\"%ls\", &function%d };\n\n", moduleName.c_str(), mainNum);
+	append_(L"} // The end of anomymous namespace\n\n");
+	append_(L"void RegisterModule_%ls(cmm::Context& context)\n{\n", moduleName.c_str());
+	append_(L"\tcontext.registerModule(module);\n}\n");
+
+	return output_;
+}
+
+// The local prototypes are appended before the prototype, which refers to them. Returns the number of the prototype.
+uint32_t CppGenerator::appendFunction_(const Prototype& prototype)
+{
+	std::vector<uint32_t> localNums;
+
+	for (uint32_t i = 0; i < prototype.numPrototype(); i++) {
+		localNums.push_back(appendFunction_(*prototype.localPrototype(i)));
+	}
+
+	uint32_t functionNum = numFunction_++;
+
+	appendNativeCode_(prototype, functionNum);
+	appendData_(prototype, functionNum, localNums);
+	return functionNum;
+}
+
+// Every translated instruction is an entry point, so the interpreter can come back to the native code
+// wherever it continues the function
+void CppGenerator::appendNativeCode_(const Prototype& prototype, uint32_t functionNum)
+{
+	std::vector<bool> targets(prototype.numInstruction(), false);
+	bool translated = false, fused = false;
+
+	for (uint32_t offset = 0; offset < prototype.numInstruction(); offset++) {
+		const Instruction inst = generic_(prototype.instruction(offset));
+
+		if (translated_(inst.opcode()) == false) {
+			continue;
+		}
+		translated = true;
+		if (IsJump(inst.opcode())) {
+			targets[JumpTarget(prototype, offset)] = true;
+		}
+		if (inst.opcode() >= Instruction::JEQ && inst.opcode() <= Instruction::FORLOOP) {
+			targets[offset + 2] = true; // the instruction after the JUMP
+			fused = true;
+		}
+	}
+
+	if (translated == false) {
+		return;
+	}
+
+	append_(L"uint32_t NativeCode%d(Variable* base, const Variable* constants, uint32_t offset, int32_t* ticks)\n{\n", functionNum);
+	if (fused == true) {
+		append_(L"\tbool test;\n\n");
+	}
+
+	append_(L"\tswitch (offset) {\n");
+	for (uint32_t offset = 0; offset < prototype.numInstruction(); offset++) {
+		if (translated_(generic_(prototype.instruction(offset)).opcode())) {
+			append_(L"\tcase %d: goto L%d;\n", offset, offset);
+		}
+	}
+	append_(L"\tdefault: return offset;\n\t}\n\n");
+
+	for (uint32_t offset = 0; offset < prototype.numInstruction(); offset++) {
+		appendInstruction_(prototype, offset, targets);
+	}
+
+	append_(L"}\n\n");
+}
+
+void CppGenerator::appendInstruction_(const Prototype& prototype, uint32_t offset, const std::vector<bool>& targets)
+{
+	const Instruction inst = generic_(prototype.instruction(offset));
+	const uint32_t opcode = inst.opcode();
+	const uint32_t a = inst.a(), b = inst.b(), c = inst.c();
+
+	if (translated_(opcode) == false) {
+		if (targets[offset] == true) {
+			append_(L"L%d:\n", offset);
+		}
+		append_(L"\treturn %d; // %ls\n", offset, Instruction::name[opcode].c_str());
+		return;
+	}
+
+	append_(L"L%d: // %ls\n", offset, Instruction::name[opcode].c_str());
+
+	// RK(C) is a constant for the K-variant opcodes
+	wchar_t operandC[32];
+	bool isConstant = (opcode == Instruction::GETTABLEK || opcode == Instruction::SETTABLEK ||
+	                   (opcode >= Instruction::ADDK && opcode <= Instruction::MODK) ||
+	                   (opcode >= Instruction::EQK && opcode <= Instruction::GEK) ||
+	                   (opcode >= Instruction::JEQK && opcode <= Instruction::JGEK));
+	swprintf(operandC, 32, isConstant ? L"constants[%d]" : L"base[%d]", c);
+
+	switch (opcode) {
+	case Instruction::ASSIGN:
+		append_(L"\tbase[%d] = base[%d];\n", a, b);
+		break;
+	case Instruction::GETCONST:
+		append_(L"\tbase[%d] = constants[%d];\n", a, inst.bx());
+		break;
+	case Instruction::GETTABLE:
+	case Instruction::GETTABLEK:
+		append_(L"\tif (!Native::getIndex(base[%d], base[%d], %ls)) { return %d; }\n", a, b, operandC, offset);
+		break;
+	case Instruction::SETTABLE:
+	case Instruction::SETTABLEK:
+		append_(L"\tif (!Native::setIndex(base[%d], %ls, base[%d])) { return %d; }\n", a, operandC, b, offset);
+		break;
+
+	case Instruction::ADD: case Instruction::SUB: case Instruction::MUL:
+	case Instruction::ADDK: case Instruction::SUBK: case Instruction::MULK:
+	case Instruction::LT: case Instruction::LE:
+	case Instruction::LTK: case Instruction::LEK: case Instruction::GTK: case Instruction::GEK:
+		append_(L"\tif (!Native::numeric<%ls>(base[%d], base[%d], %ls)) { return %d; }\n",
+		        OperatorOf(opcode), a, b, operandC, offset);
+		break;
+	case Instruction::DIV:
+	case Instruction::DIVK:
+		append_(L"\tif (!Native::divide(base[%d], base[%d], %ls)) { return %d; }\n", a, b, operandC, offset);
+		break;
+	case Instruction::MOD:
+	case Instruction::MODK:
+		append_(L"\tif (!Native::modulo(base[%d], base[%d], %ls)) { return %d; }\n", a, b, operandC, offset);
+		break;
+	case Instruction::UNM:
+		append_(L"\tif (!Native::negate(base[%d], base[%d])) { return %d; }\n", a, b, offset);
+		break;
+	case Instruction::BITNOT:
+		append_(L"\tif (!Native::bitNot(base[%d], base[%d])) { return %d; }\n", a, b, offset);
+		break;
+	case Instruction::BITAND: case Instruction::BITOR: case Instruction::BITXOR:
+	case Instruction::SL: case Instruction::SR:
+		append_(L"\tif (!Native::integer<%ls>(base[%d], base[%d], %ls)) { return %d; }\n",
+		        OperatorOf(opcode), a, b, operandC, offset);
+		break;
+	case Instruction::NOT:
+		append_(L"\tbase[%d] = !Native::toBool(base[%d]);\n", a, b);
+		break;
+	case Instruction::EQ: case Instruction::NOTEQ:
+	case Instruction::EQK: case Instruction::NOTEQK:
+		append_(L"\tif (!Native::compare<%ls>(base[%d], base[%d], %ls)) { return %d; }\n",
+		        OperatorOf(opcode), a, b, operandC, offset);
+		break;
+
+	case Instruction::JUMP:
+		appendJump_(offset, offset + inst.sax(), L"");
+		break;
+	case Instruction::BRANCH:
+		appendJump_(offset, offset + inst.sbx(), L"Native::toBool(base[" + std::to_wstring(a) + L"])");
+		break;
+	case Instruction::BRANCHNOT:
+		appendJump_(offset, offset + inst.sbx(), L"!Native::toBool(base[" + std::to_wstring(a) + L"])");
+		break;
+	case Instruction::FORPREP:
+	case Instruction::FORLOOP: {
+		const Instruction& nextJump = prototype.instruction(offset + 1);
+		const wchar_t* op = inst.forInclusive() ? L"OpLessEqual" : L"OpLess";
+		if (opcode == Instruction::FORLOOP) {
+			append_(L"\tif (!Native::forLoop<%ls>(test, base[%d], base[%d], %d, %ls)) { return %d; }\n",
+			        op, a, b, inst.forStep(), inst.forInverted() ? L"true" : L"false", offset);
+		} else {
+			append_(L"\tif (!Native::test<%ls>(test, base[%d], base[%d])) { return %d; }\n",
+			        op, inst.forInverted() ? b : a, inst.forInverted() ? a : b, offset);
+		}
+		appendJump_(offset, offset + 1 + nextJump.sax(), (opcode == Instruction::FORLOOP) ? L"test" : L"!test");
+		appendJump_(offset, offset + 2, L"");
+		break;
+	}
+	default: { // the fused compare-and-jump instructions, which are followed by a JUMP
+		const Instruction& nextJump = prototype.instruction(offset + 1);
+		append_(L"\tif (!Native::test<%ls>(test, base[%d], %ls)) { return %d; }\n",
+		        OperatorOf(opcode), b, operandC, offset);
+		appendJump_(offset, offset + 1 + nextJump.sax(), (a != 0) ? L"test" : L"!test");
+		appendJump_(offset, offset + 2, L"");
+		break;
+	}
+	}
+}
+
+// A backward jump counts a tick down, and returns to the interpreter at the target once the ticks run out
+// (Context::setBudget). The jump is taken if the condition is empty.
+void CppGenerator::appendJump_(uint32_t offset, uint32_t target, const std::wstring& condition)
+{
+	std::wstring jump = L"goto L" + std::to_wstring(target) + L";";
+
+	if (target <= offset) {
+		jump = L"if (--*ticks < 0) { return " + std::to_wstring(target) + L"; } " + jump;
+	}
+	if (condition.empty()) {
+		output_ += L"\t" + jump + L"\n";
+	} else {
+		output_ += L"\tif (" + condition + L") { " + jump + L" }\n";
+	}
+}
+
+void CppGenerator::appendData_(const Prototype& prototype, uint32_t functionNum, const std::vector<uint32_t>& localNums)
+{
+	if (prototype.numConstant() != 0) {
+		append_(L"const Module::Constant constants%d[] = {\n", functionNum);
+		for (uint32_t i = 0; i < prototype.numConstant(); i++) {
+			append_(L"\t");
+			appendConstant_(prototype.constant(i));
+			append_(L",\n");
+		}
+		append_(L"};\n");
+	}
+
+	append_(L"const uint32_t code%d[] = {\n", functionNum);
+	for (uint32_t i = 0; i < prototype.numInstruction(); i++) {
+		const Instruction inst = generic_(prototype.instruction(i));
+		if (inst.opcode() == Instruction::GETGLOBALSLOT || inst.opcode() == Instruction::SETGLOBALSLOT) {
+			throw Error(L"a prototype linked to the globals of a context can not be generated to C++");
+		}
+		append_(L"\t0x%08x, // %ls\n", inst.code, Instruction::name[inst.opcode()].c_str());
+	}
+	append_(L"};\n");
+
+	bool hasLines = false;
+	for (uint32_t i = 0; i < prototype.numInstruction(); i++) {
+		hasLines = hasLines || prototype.line(i) != 0;
+	}
+	if (hasLines) {
+		append_(L"const uint32_t lines%d[] = {", functionNum);
+		for (uint32_t i = 0; i < prototype.numInstruction(); i++) {
+			append_((i % 16 == 0) ? L"\n\t%u," : L" %u,", prototype.line(i));
+		}
+		append_(L"\n};\n");
+	}
+
+	if (prototype.numUpValue() != 0) {
+		append_(L"const Module::UpValue upValues%d[] = {\n", functionNum);
+		for (uint32_t i = 0; i < prototype.numUpValue(); i++) {
+			const Prototype::UpValueInfo& info = prototype.upValueInfo(i);
+			append_(L"\t{ %ls, %d },\n", info.isLocal ? L"true" : L"false", info.index);
+		}
+		append_(L"};\n");
+	}
+
+	if (localNums.empty() == false) {
+		append_(L"const Module::Function* const functions%d[] = {\n", functionNum);
+		for (auto i = localNums.begin(); i != localNums.end(); ++i) {
+			append_(L"\t&function%d,\n", *i);
+		}
+		append_(L"};\n");
+	}
+
+	append_(L"const Module::Function function%d = {\n", functionNum);
+	append_(L"\t%d, %d, %d, %d,\n", prototype.functionLevel(), prototype.numArgs(), prototype.localSize(),
+	        prototype.lineDefined());
+
+	if (prototype.numConstant() != 0) {
+		append_(L"\tconstants%d, %d,\n", functionNum, prototype.numConstant());
+	} else {
+		append_(L"\tnullptr, 0,\n");
+	}
+	append_(L"\tcode%d, %d,\n", functionNum, prototype.numInstruction());
+	if (hasLines) {
+		append_(L"\tlines%d,\n", functionNum);
+	} else {
+		append_(L"\tnullptr,\n");
+	}
+	if (prototype.numUpValue() != 0) {
+		append_(L"\tupValues%d, %d,\n", functionNum, prototype.numUpValue());
+	} else {
+		append_(L"\tnullptr, 0,\n");
+	}
+	if (localNums.empty() == false) {
+		append_(L"\tfunctions%d, %d,\n", functionNum, static_cast<uint32_t>(localNums.size()));
+	} else {
+		append_(L"\tnullptr, 0,\n");
+	}
+
+	bool translated = false;
+	for (uint32_t i = 0; i < prototype.numInstruction(); i++) {
+		translated = translated || translated_(generic_(prototype.instruction(i)).opcode());
+	}
+	if (translated == true) {
+		append_(L"\tNativeCode%d\n};\n\n", functionNum);
+	} else {
+		append_(L"\tnullptr\n};\n\n");
+	}
+}
+
+void CppGenerator::appendConstant_(const Variable& constant)
+{
+	switch (constant.t) {
+	case TypeNull:
+		append_(L"{ TypeNull, 0, 0.0f, nullptr }");
+		break;
+	case TypeInt:
+		if (constant.v.i == INT32_MIN) {
+			append_(L"{ TypeInt, INT32_MIN, 0.0f, nullptr }"); // -2147483648 is not an int literal
+		} else {
+			append_(L"{ TypeInt, %d, 0.0f, nullptr }", constant.v.i);
+		}
+		break;
+	case TypeFloat:
+		if (std::isnan(constant.v.f)) {
+			append_(L"{ TypeFloat, 0, std::numeric_limits<float>::quiet_NaN(), nullptr }");
+		} else if (std::isinf(constant.v.f)) {
+			append_(L"{ TypeFloat, 0, %lsstd::numeric_limits<float>::infinity(), nullptr }", (constant.v.f < 0) ? L"-" : L"");
+		} else {
+			wchar_t number[32];
+			swprintf(number, 32, L"%.9g", constant.v.f); // 9 digits bring back the same float
+			std::wstring literal(number);
+			if (literal.find_first_of(L".e") == std::wstring::npos) {
+				literal.append(L".0");
+			}
+			append_(L"{ TypeFloat, 0, %lsf, nullptr }", literal.c_str());
+		}
+		break;
+	case TypeString:
+		append_(L"{ TypeString, 0, 0.0f, ");
+		appendString_(static_cast<String*>(constant.v.obj)->value());
+		append_(L" }");
+		break;
+	default:
+		assert(false); // there is no other constant type
+	}
+}
+
+// Appends a wide string literal in ASCII, any other character is written as an escape sequence
+void CppGenerator::appendString_(const std::wstring& string)
+{
+	output_.append(L"L\"");
+
+	for (auto i = string.begin(); i != string.end(); ++i) {
+		const uint32_t ch = static_cast<uint32_t>(*i);
+
+		if (ch == L'\\' || ch == L'"') {
+			output_.push_back(L'\\');
+			output_.push_back(*i);
+		} else if (ch >= 0x20 && ch < 0x7F) {
+			output_.push_back(*i);
+		} else if (ch < 0xA0) {
+			append_(L"\\%03o", ch); // a universal character name can not be a control character
+		} else if (ch <= 0xFFFF) {
+			append_(L"\\u%04x", ch);
+		} else {
+			append_(L"\\U%08x", ch);
+		}
+	}
+
+	output_.append(L"\"");
+}
+
+void CppGenerator::append_(const wchar_t format[], ...)
+{
+	va_list args;
+	va_start(args, format);
+	wchar_t buffer[256];
+
+	vswprintf(buffer, 256, format, args);
+	va_end(args);
+
+	output_.append(buffer);
+}
+
+bool CppGenerator::translated_(uint32_t opcode)
+{
+	switch (opcode) {
+	case Instruction::ASSIGN:    case Instruction::GETCONST:
+	case Instruction::GETTABLE:  case Instruction::GETTABLEK:
+	case Instruction::SETTABLE:  case Instruction::SETTABLEK:
+	case Instruction::ADD:       case Instruction::SUB:       case Instruction::MUL:
+	case Instruction::DIV:       case Instruction::MOD:       case Instruction::UNM:
+	case Instruction::ADDK:      case Instruction::SUBK:      case Instruction::MULK:
+	case Instruction::DIVK:      case Instruction::MODK:
+	case Instruction::BITNOT:    case Instruction::BITAND:    case Instruction::BITOR:
+	case Instruction::BITXOR:    case Instruction::SL:        case Instruction::SR:
+	case Instruction::NOT:       case Instruction::EQ:        case Instruction::NOTEQ:
+	case Instruction::LT:        case Instruction::LE:
+	case Instruction::EQK:       case Instruction::NOTEQK:    case Instruction::LTK:
+	case Instruction::LEK:       case Instruction::GTK:       case Instruction::GEK:
+	case Instruction::JUMP:      case Instruction::BRANCH:    case Instruction::BRANCHNOT:
+	case Instruction::JEQ:       case Instruction::JLT:       case Instruction::JLE:
+	case Instruction::JEQK:      case Instruction::JLTK:      case Instruction::JLEK:
+	case Instruction::JGTK:      case Instruction::JGEK:
+	case Instruction::FORPREP:   case Instruction::FORLOOP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// The module is generated from the generic form of a quickened instruction
+Instruction CppGenerator::generic_(const Instruction& inst)
+{
+	Instruction result = inst;
+	result.setOpcode(Instruction::generic[inst.opcode()]);
+	return result;
+}
+
+} // namespace "cmm"
@@ -0,0 +1,56 @@
+#ifndef CPP_GENERATOR_H
+#define CPP_GENERATOR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Instruction.h"
+
+namespace cmm
+{
+
+class Prototype;
+struct Variable;
+
+// Translates a prototype tree to the C++ source of a module (Module.h), which is compiled and linked
+// with the runtime instead of compiling the script at startup.
+//
+// Every prototype becomes constant data, which Module::instantiate turns back into the prototype,
+// and a C++ function with a label for each instruction. Moves, arithmetic, comparisons, jumps and
+// array/table indexing are translated with the same type checks the interpreter does. The function returns
+// the offset of any other instruction (calls, upvalues, globals, object creation ...) and of an instruction
+// whose operands are not of the types it handles, so that the interpreter executes it.
+// A backward jump counts down the ticks of the context like the JIT does (Context::setBudget).
+class CppGenerator
+{
+public:
+	explicit            CppGenerator();
+	                    ~CppGenerator();
+                        CppGenerator(const CppGenerator&) = delete;
+    const CppGenerator& operator=(const CppGenerator&) = delete;
+
+	// The module defines "void RegisterModule_<name>(cmm::Context&)", so the name should be a C++ identifier.
+	// The prototype should be compiled without linking the globals (Context::load), since slots differ by context.
+	std::wstring&       generate(const Prototype& prototype, const std::wstring& moduleName);
+
+private:
+	uint32_t            appendFunction_(const Prototype& prototype);
+	void                appendNativeCode_(const Prototype& prototype, uint32_t functionNum);
+	void                appendInstruction_(const Prototype& prototype, uint32_t offset, const std::vector<bool>& targets);
+	void                appendJump_(uint32_t offset, uint32_t target, const std::wstring& condition);
+	void                appendData_(const Prototype& prototype, uint32_t functionNum, const std::vector<uint32_t>& localNums);
+	void                appendConstant_(const Variable& constant);
+	void                appendString_(const std::wstring& string);
+	void                append_(const wchar_t format[], ...);
+
+	static bool         translated_(uint32_t opcode);
+	static Instruction  generic_(const Instruction& inst);
+
+	std::wstring        output_;
+	uint32_t            numFunction_;
+};
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
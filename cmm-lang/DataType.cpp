@@ -112,9 +112,9 @@ void Array::forEachObject_(const std::function<void(const Object&)>& func)
 
 
 Table::Table(ObjectManager* manager)
-: Object(manager)
+: Object(manager), version_(0)
 {
-	table_.bucket_size(17); // TODO: This number is subject to change
+	table_.reserve(17); // TODO: This number is subject to change
 }
 
 Table::~Table()
@@ -143,10 +143,34 @@ void Table::setValue(const Variable& key, const Variable& value)
 			iter->second = value;
 		} else {
 			table_.erase(iter);
+			version_++;
 		}
 	} else {
 		table_.insert(std::make_pair(key, value));
+		version_++;
+	}
+}
+
+Variable* Table::findValue(const Variable& key)
+{
+	auto iter = table_.find(key);
+
+	return (iter != table_.end()) ? &iter->second : nullptr;
+}
+
+Variable* Table::findOrInsertValue(const Variable& key)
+{
+	auto result = table_.insert(std::make_pair(key, Variable(TypeNull)));
+
+	if (result.second == true) {
+		version_++;
 	}
+	return &result.first->second;
+}
+
+uint32_t Table::version() const
+{
+	return version_;
 }
 
 uint32_t Table::size()
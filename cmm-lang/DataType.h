@@ -92,6 +92,12 @@ public:
 	void             setValue(const Variable& key, const Variable& value);
 	uint32_t         size();
 
+	// Returns the slot which holds the value of the key, or nullptr if there is no such key.
+	// The slot stays valid as long as version() is not changed, which happens when a key is inserted or erased.
+	Variable*        findValue(const Variable& key);
+	Variable*        findOrInsertValue(const Variable& key); // inserts null if there is no such key
+	uint32_t         version() const;
+
 private:
 	virtual          ~Table() override;
 	virtual void     forEachObject_(const std::function<void(const Object&)>& func) override;
@@ -99,75 +105,150 @@ private:
 	typedef std::unordered_map<Variable, Variable, Variable::Hash, Variable::StrictEqual>  VarTable_;	
 
 	VarTable_        table_;
+	uint32_t         version_;
 };
 
 
 class Prototype;
 
-class Closure : public Object
+// An upvalue is a variable of an enclosing function which is referred by a nested function.
+// While the enclosing function is running, the upvalue is "open" and refers to the register of the
+// function directly. When the function returns, the upvalue is "closed" - the value is copied into
+// the upvalue itself, so that the nested functions still share the variable.
+class UpValue : public Object
 {
 public:
-	explicit               Closure(Ref<Prototype> prototype, Ref<Closure> upperClosure, ObjectManager* objectManager = nullptr);    	
-	                       Closure(const Closure&) = delete;
-	const Closure&         operator=(const Closure&) = delete;
-
-    Ref<Closure>           upperClosure();
+	explicit               UpValue(Variable* slot, ObjectManager* manager = nullptr);
+	                       UpValue(const UpValue&) = delete;
+	const UpValue&         operator=(const UpValue&) = delete;
 
-	Variable&              upValue(uint32_t functionLevel, uint32_t offset);
+	Variable&              value();
 
-	Variable&              local(uint32_t offset);
-	const Variable&        local(uint32_t offset) const;
+	bool                   isOpen() const;
+	Variable*              slot() const;
+	void                   relocate(Variable* slot);
+	void                   close();
 
 private:
-    virtual                ~Closure() override;
+	virtual                ~UpValue() override;
 	virtual void           forEachObject_(const std::function<void(const Object&)>& func) override;
 
-	const Ref<Prototype>   prototype_;
-	Ref<Closure>           upperClosure_;
-
-	std::vector<Variable>  local_;
+	Variable*              value_;
+	Variable               closed_;
 };
 
-inline Ref<Closure> Closure::upperClosure()
+inline Variable& UpValue::value()
 {
-	return upperClosure_.get();
+	return *value_;
 }
 
-inline Variable& Closure::local(uint32_t offset)
+inline bool UpValue::isOpen() const
 {
-	assert(offset >= 0 && offset < local_.size());
-	return local_[offset];
+	return value_ != &closed_;
 }
 
-inline const Variable& Closure::local(uint32_t offset) const
+inline Variable* UpValue::slot() const
 {
-	assert(offset >= 0 && offset < local_.size());
-	return local_[offset];
+	assert(isOpen());
+	return value_;
+}
+
+inline void UpValue::relocate(Variable* slot)
+{
+	assert(isOpen());
+	value_ = slot;
+}
+
+inline void UpValue::close()
+{
+	assert(isOpen());
+	closed_ = *value_;
+	value_ = &closed_;
 }
 
 
 class Function : public Object
 {
 public:
-	explicit              Function(Ref<Prototype> prototype, Ref<Closure> upper, ObjectManager* manager = nullptr);
+	explicit              Function(Ref<Prototype> prototype, ObjectManager* manager = nullptr);
                           Function(const Function&) = delete;
 	const Function&       operator=(const Function&) = delete;
 
-	const Ref<Prototype>  prototype() const;
+	const Ref<Prototype>& prototype() const;
 
-	Ref<Closure>          upperClosure();
+	Ref<UpValue>&         upValue(uint32_t index);
 
 private:
 	virtual               ~Function() override;
 	virtual void          forEachObject_(const std::function<void(const Object&)>& func) override;
 
+	typedef std::vector<Ref<UpValue>> UpValueVector_;
+
 	const Ref<Prototype>  prototype_;
-	Ref<Closure>          upperClosure_;
+	UpValueVector_        upValues_;
+};
+
+inline Ref<UpValue>& Function::upValue(uint32_t index)
+{
+	assert(index < upValues_.size());
+	return upValues_[index];
+}
+
+
+// A coroutine runs a function on frames of its own, which can be left by yield and continued later.
+// While it is running, its frames are placed on the call stack of the context above the frame which resumed it.
+// When it yields, Context moves the frames and their registers into the coroutine, and the open upvalues
+// which refer to the registers are relocated with them, so the coroutine costs nothing while it is suspended.
+class Coroutine : public Object
+{
+	friend class Context;
+
+public:
+	enum Status {
+		SUSPENDED, // created, or yielded
+		RUNNING,
+		NORMAL,    // has resumed another coroutine which is running
+		DEAD       // has returned, or stopped by an error
+	};
+
+	explicit              Coroutine(Ref<Function> function, ObjectManager* manager = nullptr);
+	                      Coroutine(const Coroutine&) = delete;
+	const Coroutine&      operator=(const Coroutine&) = delete;
+
+	Status                status() const;
+	static const wchar_t* statusName(Status status);
+
+private:
+	virtual               ~Coroutine() override;
+	virtual void          forEachObject_(const std::function<void(const Object&)>& func) override;
+
+	// A frame of the suspended coroutine, whose registers are located by the index in registers_
+	struct Frame_
+	{
+		Ref<Function>  function;
+		uint32_t       returnTo; // not used by the first frame, which returns to the resumer
+		uint32_t       numRets;
+		uint32_t       base;
+		uint32_t       top;
+		uint32_t       programCounter;
+	};
+
+	typedef std::vector<Frame_> FrameVector_;
+	typedef std::vector<Variable> VariableVector_;
+	typedef std::vector<Ref<UpValue>> UpValueVector_;
+
+	Ref<Function>         function_;     // the function to start, null once it is started
+	Status                status_;
+	FrameVector_          frames_;
+	VariableVector_       registers_;
+	UpValueVector_        openUpValues_; // refer to registers_ while suspended
+	Ref<Coroutine>        resumer_;      // the coroutine which has resumed it, null for the main script
+	size_t                bottom_;       // the index of its first frame in the call stack while it is running
 };
 
-inline Ref<Closure> Function::upperClosure()
+inline Coroutine::Status Coroutine::status() const
 {
-	return upperClosure_;
+	return status_;
 }
 
 
@@ -8,6 +8,7 @@ namespace cmm
 {
 
 Error::Error(const wchar_t errorMsg[], ...)
+: located_(false)
 {
 	va_list args;
 	va_start( args, errorMsg );
@@ -27,4 +28,23 @@ const std::wstring& Error::errorStr() const
 	return errorMsg_;
 }
 
+void Error::locate(uint32_t line)
+{
+	if (located_ || line == 0) {
+		return;
+	}
+
+	errorMsg_ = std::to_wstring(line) + L": " + errorMsg_;
+	located_ = true;
+}
+
+BudgetError::BudgetError()
+: Error(L"the script has run out of its budget")
+{
+}
+
+BudgetError::~BudgetError()
+{
+}
+
 } // namespace "cmm"
\ No newline at end of file
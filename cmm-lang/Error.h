@@ -1,6 +1,7 @@
 #ifndef ERROR_H
 #define ERROR_H
 
+#include <cstdint>
 #include <string>
 
 namespace cmm
@@ -15,9 +16,23 @@ public:
 
 	const std::wstring&   errorStr() const;
 
+	// Prefixes the message with the source line the error comes from, as the compiler does ("12: ..."),
+	// unless it has been located already. 0 means the line is not known, and leaves the message as it is.
+	void                  locate(uint32_t line);
+
 private:
 	std::wstring	      errorMsg_;
+	bool                  located_;
+
+};
 
+// Thrown by Context::run and Context::resume when the script has used up its budget (Context::setBudget),
+// and it is not to be suspended. The frames of the script are unwound as for any other error.
+class BudgetError : public Error
+{
+public:
+	explicit              BudgetError();
+	virtual               ~BudgetError();
 };
 
 } // namespace "cmm"
@@ -14,8 +14,8 @@
 namespace cmm
 {
 
-Function::Function(Ref<Prototype> prototype, Ref<Closure> upper, ObjectManager* manager)
-: Object(manager), prototype_(prototype), upperClosure_(upper)
+Function::Function(Ref<Prototype> prototype, ObjectManager* manager)
+: Object(manager), prototype_(prototype), upValues_(prototype->numUpValue())
 {
 	assert(prototype.get() != nullptr);
 }
@@ -24,7 +24,7 @@ Function::~Function()
 {
 }
 
-const Ref<Prototype> Function::prototype() const
+const Ref<Prototype>& Function::prototype() const
 {
 	return prototype_;
 }
@@ -33,47 +33,31 @@ const Ref<Prototype> Function::prototype() const
 void Function::forEachObject_(const std::function<void(const Object&)>& func)
 {
 	if (prototype_.get() != nullptr) { func(*prototype_); }
-	if (upperClosure_.get() != nullptr) { func(*upperClosure_); }
-}
-
 
-Closure::Closure(const Ref<Prototype> prototype, Ref<Closure> upperClosure, ObjectManager* objectManager)
-: prototype_(prototype), Object(objectManager), upperClosure_(upperClosure), local_(prototype->localSize(), TypeNull)
-{
-	assert(prototype.get());
+	std::for_each(upValues_.begin(), upValues_.end(),
+		[&func](decltype(*upValues_.begin()) i) {
+			if (i.get() != nullptr) {
+				func(*i);
+			}
+		}
+	);
 }
 
-Closure::~Closure()
+
+UpValue::UpValue(Variable* slot, ObjectManager* manager)
+: Object(manager), value_(slot), closed_(TypeNull)
 {
+	assert(slot != nullptr);
 }
 
-
-
-Variable& Closure::upValue(uint32_t functionLevel, uint32_t offset)
+UpValue::~UpValue()
 {
-	Ref<Closure> targetClosure = this;
-
-	// TODO : change this closure routine to more efficient version
-	for (uint32_t i = prototype_->functionLevel(); i != functionLevel; i--) {
-		assert(targetClosure.get() != nullptr);
-		targetClosure = targetClosure->upperClosure();
-	}
-
-	return targetClosure->local(offset);
 }
 
-void Closure::forEachObject_(const std::function<void(const Object&)>& func)
+void UpValue::forEachObject_(const std::function<void(const Object&)>& func)
 {
-	std::for_each(local_.begin(), local_.end(),
-		[&func](decltype(*local_.begin()) i) {
-			if (i.isObject()) {
-				func(*i.v.obj);
-			}
-		}
-	);
-
-	if (upperClosure_.get() != nullptr) {
-		func(*upperClosure_.get());
+	if (value_->isObject()) {
+		func(*value_->v.obj);
 	}
 }
 
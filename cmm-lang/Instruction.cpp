@@ -10,11 +10,15 @@ const std::wstring Instruction::name[] = {
 	L"ASSIGN",
 	L"GETCONST",
 	L"GETGLOBAL",
+	L"GETGLOBALSLOT",
 	L"GETUPVAL",
 	L"GETTABLE",
+	L"GETTABLEK",
 	L"SETGLOBAL",
+	L"SETGLOBALSLOT",
 	L"SETUPVAL",
 	L"SETTABLE",
+	L"SETTABLEK",
 	L"NEWTABLE",
 	L"NEWARRAY",
 	L"NEWFUNC",
@@ -24,6 +28,11 @@ const std::wstring Instruction::name[] = {
 	L"DIV",
 	L"MOD",
 	L"UNM",
+	L"ADDK",
+	L"SUBK",
+	L"MULK",
+	L"DIVK",
+	L"MODK",
 	L"BITNOT",
 	L"BITAND",
 	L"BITOR",
@@ -35,32 +44,75 @@ const std::wstring Instruction::name[] = {
 	L"NOTEQ",
 	L"LT",
 	L"LE",
+	L"EQK",
+	L"NOTEQK",
+	L"LTK",
+	L"LEK",
+	L"GTK",
+	L"GEK",
 	L"JUMP",
 	L"BRANCH",
 	L"BRANCHNOT",
+	L"JEQ",
+	L"JLT",
+	L"JLE",
+	L"JEQK",
+	L"JLTK",
+	L"JLEK",
+	L"JGTK",
+	L"JGEK",
+	L"FORPREP",
+	L"FORLOOP",
 	L"CALL",
+	L"TAILCALL",
 	L"RETURN",
-	L"YIELD"
+	L"YIELD",
+	L"CLOSE",
+	L"ADD_II",
+	L"ADD_FF",
+	L"SUB_II",
+	L"SUB_FF",
+	L"MUL_II",
+	L"MUL_FF",
+	L"ADDK_II",
+	L"SUBK_II",
+	L"LT_II",
+	L"LE_II",
+	L"JLT_II",
+	L"JLE_II",
+	L"JLTK_II",
+	L"JLEK_II",
+	L"GETTABLE_ARRAY_INT",
+	L"SETTABLE_ARRAY_INT"
 };
 
 const Instruction::Type Instruction::type[] = {
 	TWO_OP,     // ASSIGN
-	TWO_OP,     // GETCONST
-	TWO_OP,     // GETGLOBAL
-	THREE_OP,   // GETUPVAL
+	WIDE_OP,    // GETCONST
+	WIDE_OP,    // GETGLOBAL
+	WIDE_OP,    // GETGLOBALSLOT
+	TWO_OP,     // GETUPVAL
 	THREE_OP,   // GETTABLE
-	TWO_OP,     // SETGLOBAL
-	THREE_OP,   // SETUPVAL
+	THREE_OP,   // GETTABLEK
+	WIDE_OP,    // SETGLOBAL
+	WIDE_OP,    // SETGLOBALSLOT
+	TWO_OP,     // SETUPVAL
 	THREE_OP,   // SETTABLE
+	THREE_OP,   // SETTABLEK
 	ONE_OP,     // NEWTABLE
 	ONE_OP,     // NEWARRAY
-	TWO_OP,     // NEWFUNC
+	WIDE_OP,    // NEWFUNC
 	THREE_OP,   // ADD
 	THREE_OP,   // SUB
 	THREE_OP,   // MUL
 	THREE_OP,   // DIV
 	THREE_OP,   // MOD
 	TWO_OP,     // UNM
+	THREE_OP,   // ADDK
+	THREE_OP,   // SUBK
+	THREE_OP,   // MULK
+	THREE_OP,   // DIVK
+	THREE_OP,   // MODK
 	TWO_OP,     // BITNOT
 	THREE_OP,   // BITAND
 	THREE_OP,   // BITOR
@@ -72,12 +124,126 @@ const Instruction::Type Instruction::type[] = {
 	THREE_OP,   // NOTEQ
 	THREE_OP,   // LT
 	THREE_OP,   // LE
-	ONE_OP,     // JUMP
-	TWO_OP,     // BRANCH
-	TWO_OP,     // BRANCHNOT
+	THREE_OP,   // EQK
+	THREE_OP,   // NOTEQK
+	THREE_OP,   // LTK
+	THREE_OP,   // LEK
+	THREE_OP,   // GTK
+	THREE_OP,   // GEK
+	JUMP_OP,    // JUMP
+	BRANCH_OP,  // BRANCH
+	BRANCH_OP,  // BRANCHNOT
+	THREE_OP,   // JEQ
+	THREE_OP,   // JLT
+	THREE_OP,   // JLE
+	THREE_OP,   // JEQK
+	THREE_OP,   // JLTK
+	THREE_OP,   // JLEK
+	THREE_OP,   // JGTK
+	THREE_OP,   // JGEK
+	THREE_OP,   // FORPREP
+	THREE_OP,   // FORLOOP
 	THREE_OP,   // CALL
+	THREE_OP,   // TAILCALL
 	TWO_OP,     // RETURN
 	TWO_OP,     // YIELD
+	ONE_OP,     // CLOSE
+	THREE_OP,   // ADD_II
+	THREE_OP,   // ADD_FF
+	THREE_OP,   // SUB_II
+	THREE_OP,   // SUB_FF
+	THREE_OP,   // MUL_II
+	THREE_OP,   // MUL_FF
+	THREE_OP,   // ADDK_II
+	THREE_OP,   // SUBK_II
+	THREE_OP,   // LT_II
+	THREE_OP,   // LE_II
+	THREE_OP,   // JLT_II
+	THREE_OP,   // JLE_II
+	THREE_OP,   // JLTK_II
+	THREE_OP,   // JLEK_II
+	THREE_OP,   // GETTABLE_ARRAY_INT
+	THREE_OP,   // SETTABLE_ARRAY_INT
+};
+
+const Instruction::Opcode Instruction::generic[] = {
+	ASSIGN,
+	GETCONST,
+	GETGLOBAL,
+	GETGLOBALSLOT,
+	GETUPVAL,
+	GETTABLE,
+	GETTABLEK,
+	SETGLOBAL,
+	SETGLOBALSLOT,
+	SETUPVAL,
+	SETTABLE,
+	SETTABLEK,
+	NEWTABLE,
+	NEWARRAY,
+	NEWFUNC,
+	ADD,
+	SUB,
+	MUL,
+	DIV,
+	MOD,
+	UNM,
+	ADDK,
+	SUBK,
+	MULK,
+	DIVK,
+	MODK,
+	BITNOT,
+	BITAND,
+	BITOR,
+	BITXOR,
+	SL,
+	SR,
+	NOT,
+	EQ,
+	NOTEQ,
+	LT,
+	LE,
+	EQK,
+	NOTEQK,
+	LTK,
+	LEK,
+	GTK,
+	GEK,
+	JUMP,
+	BRANCH,
+	BRANCHNOT,
+	JEQ,
+	JLT,
+	JLE,
+	JEQK,
+	JLTK,
+	JLEK,
+	JGTK,
+	JGEK,
+	FORPREP,
+	FORLOOP,
+	CALL,
+	TAILCALL,
+	RETURN,
+	YIELD,
+	CLOSE,
+	ADD,        // ADD_II
+	ADD,        // ADD_FF
+	SUB,        // SUB_II
+	SUB,        // SUB_FF
+	MUL,        // MUL_II
+	MUL,        // MUL_FF
+	ADDK,       // ADDK_II
+	SUBK,       // SUBK_II
+	LT,         // LT_II
+	LE,         // LE_II
+	JLT,        // JLT_II
+	JLE,        // JLE_II
+	JLTK,       // JLTK_II
+	JLEK,       // JLEK_II
+	GETTABLE,   // GETTABLE_ARRAY_INT
+	SETTABLE,   // SETTABLE_ARRAY_INT
 };
 
 } // namespace "cmm"
\ No newline at end of file
@@ -1,32 +1,66 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
+#include <cassert>
 #include <cstdint>
 #include <string>
 
 namespace cmm
 {
 
+// Instructions are packed into a single 32-bit word. Every opcode uses one of below layouts.
+//
+//   bit    31         24 23         16 15          8 7           0
+//   ABC   [     C      |      B      |      A      |   opcode    ]
+//   ABx   [            Bx            |      A      |   opcode    ]
+//   AsBx  [           sBx            |      A      |   opcode    ]
+//   sAx   [                   sAx                  |   opcode    ]
+//
+// A, B and C are unsigned 8-bit operands (registers, argument counts, upvalue indices),
+// Bx is an unsigned 16-bit operand (constant and prototype indices),
+// sBx and sAx are signed jump distances stored in excess-K form.
+// The K-variant opcodes (ADDK, LTK, GETTABLEK ...) read their operand C straight from the
+// constant table as K(C) instead of loading it to a register with GETCONST.
+// The fused compare-and-jump opcodes (JEQ, JLT ...) are always followed by a JUMP, which holds the
+// jump distance and is executed by the compare instruction itself. A is the expected result of the
+// comparison (0 or 1), so "!=" is JEQ with A = 0.
+// FORPREP and FORLOOP run a counting for loop, "for (...; i < n; i++)", where the counter R(A) and
+// the limit R(B) are local registers. Operand C packs the step of the counter and the comparison
+// (forStep, forInclusive and forInverted), which is one of R(A) < R(B), R(A) <= R(B), R(B) < R(A)
+// and R(B) <= R(A). FORPREP enters the loop and FORLOOP closes it, with a JUMP after each of them.
+// The quickened opcodes (ADD_II, LT_II ...) are never emitted by the code generator. The virtual machine
+// rewrites a generic instruction in place to one of them after observing the types of its operands,
+// and rewrites it back to generic[opcode] when the type guard of the quickened form fails.
+
 struct Instruction
 {
 	enum Opcode {
 		ASSIGN,     // A B      R(A) = R(B)
-		GETCONST,   // A B      R(A) = C(B)
-		GETGLOBAL,  // A B      R(A) = G(C(B))
-		GETUPVAL,   // A B C    R(A) = UP(C)(B)
+		GETCONST,   // A Bx     R(A) = C(Bx)
+		GETGLOBAL,  // A Bx     R(A) = G(C(Bx))
+		GETGLOBALSLOT, // A Bx  R(A) = GS(Bx), the global linked to the slot Bx by Context::load
+		GETUPVAL,   // A B      R(A) = U(B)
 		GETTABLE,   // A B C    R(A) = R(B)[R(C)]
-		SETGLOBAL,  // A B      G(C(A)) = R(B)
-		SETUPVAL,   // A B C    UP(C)(A) = R(B)
+		GETTABLEK,  // A B C    R(A) = R(B)[K(C)]
+		SETGLOBAL,  // A Bx     G(C(Bx)) = R(A)
+		SETGLOBALSLOT, // A Bx  GS(Bx) = R(A)
+		SETUPVAL,   // A B      U(A) = R(B)
 		SETTABLE,   // A B C    R(A)[R(C)] = R(B)
+		SETTABLEK,  // A B C    R(A)[K(C)] = R(B)
 		NEWTABLE,   // A        R(A) = new table
 		NEWARRAY,   // A        R(A) = new array
-		NEWFUNC,    // A B      R(A) = new func with prototype (B)
+		NEWFUNC,    // A Bx     R(A) = new func with prototype (Bx), upvalues are given as the prototype describes
 		ADD,        // A B C    R(A) = R(B) + R(C), String concatenation if both R(B) and R(C) are string
 		SUB,        // A B C    R(A) = R(B) - R(C)
 		MUL,        // A B C    R(A) = R(B) * R(C)
 		DIV,        // A B C    R(A) = R(B) / R(C)
 		MOD,        // A B C    R(A) = R(B) % R(C)
 		UNM,        // A B      R(A) = -R(B)
+		ADDK,       // A B C    R(A) = R(B) + K(C), String concatenation if both R(B) and K(C) are string
+		SUBK,       // A B C    R(A) = R(B) - K(C)
+		MULK,       // A B C    R(A) = R(B) * K(C)
+		DIVK,       // A B C    R(A) = R(B) / K(C)
+		MODK,       // A B C    R(A) = R(B) % K(C)
 		BITNOT,     // A B      R(A) = ~R(B)
 		BITAND,     // A B C    R(A) = R(B) & R(C)
 		BITOR,      // A B C    R(A) = R(B) | R(C)
@@ -38,38 +72,144 @@ struct Instruction
 		NOTEQ,      // A B C    R(A) = R(B) != R(C)
 		LT,         // A B C    R(A) = R(B) <  R(C)
 		LE,         // A B C    R(A) = R(B) <= R(C)
-		JUMP,       // A        PC += A
-		BRANCH,     // A B      if (R(A)) PC += B
-		BRANCHNOT,  // A B      if (!R(A)) PC += B
+		EQK,        // A B C    R(A) = R(B) == K(C)
+		NOTEQK,     // A B C    R(A) = R(B) != K(C)
+		LTK,        // A B C    R(A) = R(B) <  K(C)
+		LEK,        // A B C    R(A) = R(B) <= K(C)
+		GTK,        // A B C    R(A) = R(B) >  K(C)
+		GEK,        // A B C    R(A) = R(B) >= K(C)
+		JUMP,       // sAx      PC += sAx
+		BRANCH,     // A sBx    if (R(A)) PC += sBx
+		BRANCHNOT,  // A sBx    if (!R(A)) PC += sBx
+		JEQ,        // A B C    if ((R(B) == R(C)) == A) PC += sAx of the next JUMP else skip it
+		JLT,        // A B C    if ((R(B) <  R(C)) == A) PC += sAx of the next JUMP else skip it
+		JLE,        // A B C    if ((R(B) <= R(C)) == A) PC += sAx of the next JUMP else skip it
+		JEQK,       // A B C    if ((R(B) == K(C)) == A) PC += sAx of the next JUMP else skip it
+		JLTK,       // A B C    if ((R(B) <  K(C)) == A) PC += sAx of the next JUMP else skip it
+		JLEK,       // A B C    if ((R(B) <= K(C)) == A) PC += sAx of the next JUMP else skip it
+		JGTK,       // A B C    if ((R(B) >  K(C)) == A) PC += sAx of the next JUMP else skip it
+		JGEK,       // A B C    if ((R(B) >= K(C)) == A) PC += sAx of the next JUMP else skip it
+		FORPREP,    // A B C    if (!(R(A) < R(B))) PC += sAx of the next JUMP else skip it, C is the step and the comparison
+		FORLOOP,    // A B C    R(A) += step; if (R(A) < R(B)) PC += sAx of the next JUMP else skip it
 		CALL,       // A B C    R(A), R(A+1) ... R(A+C-1) = R(A)(R(A+1), R(A+2) ... R(A+B)
+		TAILCALL,   // A B C    return R(A)(R(A+1), R(A+2) ... R(A+B)), the callee reuses the frame (CALL for a C function)
 		RETURN,     // A B      return R(A), R(A+1), ... R(A+B-1)
-		YIELD       // A B      yield R(A), R(A+1), ... R(A+B-1)
+		YIELD,      // A B      yield R(A), R(A+1), ... R(A+B-1)
+		CLOSE,      // A        close the upvalues of R(A) and the registers above, where the captured locals of a block end
+		ADD_II,             // A B C    ADD when R(B) and R(C) are integers
+		ADD_FF,             // A B C    ADD when R(B) and R(C) are floats
+		SUB_II,             // A B C    SUB when R(B) and R(C) are integers
+		SUB_FF,             // A B C    SUB when R(B) and R(C) are floats
+		MUL_II,             // A B C    MUL when R(B) and R(C) are integers
+		MUL_FF,             // A B C    MUL when R(B) and R(C) are floats
+		ADDK_II,            // A B C    ADDK when R(B) and K(C) are integers
+		SUBK_II,            // A B C    SUBK when R(B) and K(C) are integers
+		LT_II,              // A B C    LT when R(B) and R(C) are integers
+		LE_II,              // A B C    LE when R(B) and R(C) are integers
+		JLT_II,             // A B C    JLT when R(B) and R(C) are integers
+		JLE_II,             // A B C    JLE when R(B) and R(C) are integers
+		JLTK_II,            // A B C    JLTK when R(B) and K(C) are integers
+		JLEK_II,            // A B C    JLEK when R(B) and K(C) are integers
+		GETTABLE_ARRAY_INT, // A B C    GETTABLE when R(B) is an array and R(C) is an integer
+		SETTABLE_ARRAY_INT, // A B C    SETTABLE when R(A) is an array and R(C) is an integer
+		OPCODE_END  // the number of opcodes, not an actual instruction
 	};
 
 	enum Type {
-		ONE_OP,
-		TWO_OP,
-		THREE_OP
+		ONE_OP,     // A
+		TWO_OP,     // A B
+		THREE_OP,   // A B C
+		WIDE_OP,    // A Bx
+		BRANCH_OP,  // A sBx
+		JUMP_OP     // sAx
 	};
 
+	static constexpr uint32_t MAX_A   = 0xFF;
+	static constexpr uint32_t MAX_B   = 0xFF;
+	static constexpr uint32_t MAX_C   = 0xFF;
+	static constexpr uint32_t MAX_BX  = 0xFFFF;
+	static constexpr int32_t  MAX_SBX = 0x7FFF;
+	static constexpr int32_t  MAX_SAX = 0x7FFFFF;
+
+	static constexpr int32_t  MIN_FOR_STEP = -32;
+	static constexpr int32_t  MAX_FOR_STEP = 31;
+	static constexpr uint32_t FOR_INVERTED = 0x40;  // the operands are compared as R(B) < R(A)
+	static constexpr uint32_t FOR_INCLUSIVE = 0x80; // the comparison is <= instead of <
+
 	Instruction() {}
-	Instruction(const Instruction& inst)
-		: opcode(inst.opcode), operand1(inst.operand1), operand2(inst.operand2), operand3(inst.operand3) {}
+	Instruction(uint32_t opcode, int32_t op1, int32_t op2, int32_t op3);
+
+	uint32_t  opcode() const { return code & 0xFF; }
+	uint32_t  a() const      { return (code >> 8) & 0xFF; }
+	uint32_t  b() const      { return (code >> 16) & 0xFF; }
+	uint32_t  c() const      { return code >> 24; }
+	uint32_t  bx() const     { return code >> 16; }
+	int32_t   sbx() const    { return static_cast<int32_t>(code >> 16) - MAX_SBX; }
+	int32_t   sax() const    { return static_cast<int32_t>(code >> 8) - MAX_SAX; }
+
+	// Operand C of FORPREP and FORLOOP
+	int32_t   forStep() const      { return static_cast<int32_t>(c() & 0x3F) + MIN_FOR_STEP; }
+	bool      forInverted() const  { return (c() & FOR_INVERTED) != 0; }
+	bool      forInclusive() const { return (c() & FOR_INCLUSIVE) != 0; }
+
+	static uint32_t  forOperand(int32_t step, bool inverted, bool inclusive)
+	{
+		assert(step >= MIN_FOR_STEP && step <= MAX_FOR_STEP && step != 0);
+		return (step - MIN_FOR_STEP) | (inverted ? FOR_INVERTED : 0) | (inclusive ? FOR_INCLUSIVE : 0);
+	}
 
-	Instruction(int32_t opcode, int32_t op1, int32_t op2, int32_t op3)
-	: opcode(opcode), operand1(op1), operand2(op2), operand3(op3) {}
+	// Replaces the opcode only, the operands are kept as they are
+	void      setOpcode(uint32_t opcode) { code = (code & ~0xFFu) | opcode; }
 
-	int32_t   opcode;
-	int32_t   operand1;
-	int32_t   operand2;
-	int32_t   operand3;
+	// Checks whether the operands fit in the layout of the opcode
+	static bool  fits(uint32_t opcode, int32_t op1, int32_t op2, int32_t op3);
 
+	uint32_t  code;
 
 	static const std::wstring   name[];
 	static const Type           type[];
+	static const Opcode         generic[]; // the opcode a quickened opcode falls back to, itself for the others
 };
 
+static_assert(sizeof(Instruction) == sizeof(uint32_t), "an instruction should be packed into 32 bits");
+
+inline Instruction::Instruction(uint32_t opcode, int32_t op1, int32_t op2, int32_t op3)
+{
+	assert(opcode < OPCODE_END && fits(opcode, op1, op2, op3));
+
+	switch (type[opcode]) {
+	case ONE_OP:
+	case TWO_OP:
+	case THREE_OP:
+		code = opcode | (op1 << 8) | (op2 << 16) | (static_cast<uint32_t>(op3) << 24);
+		break;
+	case WIDE_OP:
+		code = opcode | (op1 << 8) | (static_cast<uint32_t>(op2) << 16);
+		break;
+	case BRANCH_OP:
+		code = opcode | (op1 << 8) | (static_cast<uint32_t>(op2 + MAX_SBX) << 16);
+		break;
+	case JUMP_OP:
+		code = opcode | (static_cast<uint32_t>(op1 + MAX_SAX) << 8);
+		break;
+	}
+}
+
+inline bool Instruction::fits(uint32_t opcode, int32_t op1, int32_t op2, int32_t op3)
+{
+	auto inRange = [](int32_t value, int32_t min, int32_t max) { return value >= min && value <= max; };
+
+	switch (type[opcode]) {
+	case ONE_OP:
+	case TWO_OP:
+	case THREE_OP:  return inRange(op1, 0, MAX_A) && inRange(op2, 0, MAX_B) && inRange(op3, 0, MAX_C);
+	case WIDE_OP:   return inRange(op1, 0, MAX_A) && inRange(op2, 0, MAX_BX);
+	case BRANCH_OP: return inRange(op1, 0, MAX_A) && inRange(op2, -MAX_SBX, MAX_SBX);
+	case JUMP_OP:   return inRange(op1, -MAX_SAX, MAX_SAX);
+	}
 
+	return false;
+}
 
 } // namespace "cmm"
 
@@ -0,0 +1,1024 @@
+#include "StdAfx.h"
+#include "Jit.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "Config.h"
+#include "Prototype.h"
+#include "Instruction.h"
+#include "DataType.h"
+#include "Trace.h"
+
+#if CMM_USE_JIT
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace cmm
+{
+
+#if CMM_USE_JIT
+
+namespace // Anonymous namespace for the code generation of the JIT
+{
+
+static_assert(sizeof(Variable) == 16 && offsetof(Variable, t) == 0 && offsetof(Variable, v) == 8,
+              "the JIT assumes the layout of Variable on x86-64");
+
+enum Register_
+{
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8  = 8, R9  = 9, R12 = 12, R13 = 13,
+	XMM0 = 0 // in the operations on floats
+
+};
+
+enum Condition_
+{
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+	CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+inline Condition_ invert(Condition_ cc)
+{
+	return static_cast<Condition_>(cc ^ 1);
+}
+
+// The registers of the running frame, the constants and the ticks of the context are kept in callee-saved registers
+const Register_ BASE = RBX;
+const Register_ CONSTANTS = R12;
+const Register_ TICKS = R13;
+
+#if defined(_WIN32)
+const Register_ ARG0 = RCX, ARG1 = RDX, ARG2 = R8, ARG3 = R9;  // Microsoft x64 calling convention
+#else
+const Register_ ARG0 = RDI, ARG1 = RSI, ARG2 = RDX, ARG3 = RCX; // System V AMD64 calling convention
+#endif
+
+inline int32_t typeOf(uint32_t index)  { return index * sizeof(Variable) + offsetof(Variable, t); }
+inline int32_t valueOf(uint32_t index) { return index * sizeof(Variable) + offsetof(Variable, v); }
+
+// Runtime helpers called by the native code. They never throw, and return false without any side effect
+// when the operands are not supported, so that the interpreter repeats the instruction and reports the error.
+bool GetIndexHelper(Variable* dest, const Variable* container, const Variable* key)
+{
+	if (container->t == TypeArray && key->t == TypeInt) {
+		*dest = static_cast<Array*>(container->v.obj)->getValue(key->v.i);
+		return true;
+	} else if (container->t == TypeTable) {
+		*dest = static_cast<Table*>(container->v.obj)->getValue(*key);
+		return true;
+	}
+	return false;
+}
+
+void AssignHelper(Variable* dest, const Variable* src)
+{
+	*dest = *src;
+}
+
+bool SetIndexHelper(const Variable* container, const Variable* key, const Variable* value)
+{
+	if (container->t == TypeArray && key->t == TypeInt) {
+		static_cast<Array*>(container->v.obj)->setValue(key->v.i, *value);
+		return true;
+	} else if (container->t == TypeTable) {
+		static_cast<Table*>(container->v.obj)->setValue(*key, *value);
+		return true;
+	}
+	return false;
+}
+
+
+// Encodes the subset of x86-64 instructions used by the translator
+class Assembler_
+{
+public:
+	typedef std::vector<uint8_t> Code;
+
+	const Code&  code() const { return code_; }
+	uint32_t     offset() const { return static_cast<uint32_t>(code_.size()); }
+
+	void  byte(uint8_t value) { code_.push_back(value); }
+	void  dword(uint32_t value) { for (int i = 0; i < 4; i++) { byte(static_cast<uint8_t>(value >> (i * 8))); } }
+	void  qword(uint64_t value) { for (int i = 0; i < 8; i++) { byte(static_cast<uint8_t>(value >> (i * 8))); } }
+
+	// op reg, [base + disp32]
+	void  memory(uint8_t opcode, bool wide, int reg, int base, int32_t disp)
+	{
+		rex_(wide, reg, base);
+		byte(opcode);
+		modrmMemory_(reg, base, disp);
+	}
+
+	void  load32(int reg, int base, int32_t disp)   { memory(0x8B, false, reg, base, disp); }
+	void  store32(int base, int32_t disp, int reg)  { memory(0x89, false, reg, base, disp); }
+	void  load64(int reg, int base, int32_t disp)   { memory(0x8B, true, reg, base, disp); }
+	void  store64(int base, int32_t disp, int reg)  { memory(0x89, true, reg, base, disp); }
+	void  lea(int reg, int base, int32_t disp)      { memory(0x8D, true, reg, base, disp); }
+	void  cmpLoad32(int reg, int base, int32_t disp) { memory(0x3B, false, reg, base, disp); }
+
+	void  cmpMemory32(int base, int32_t disp, int8_t imm)
+	{
+		memory(0x83, false, 7, base, disp);
+		byte(static_cast<uint8_t>(imm));
+	}
+
+	void  subMemory32(int base, int32_t disp, int8_t imm)
+	{
+		memory(0x83, false, 5, base, disp);
+		byte(static_cast<uint8_t>(imm));
+	}
+
+	void  storeImm32(int base, int32_t disp, int32_t imm)
+	{
+		memory(0xC7, false, 0, base, disp);
+		dword(static_cast<uint32_t>(imm));
+	}
+
+	void  movImm32(int reg, uint32_t imm)
+	{
+		if (reg & 8) { byte(0x41); }
+		byte(static_cast<uint8_t>(0xB8 + (reg & 7)));
+		dword(imm);
+	}
+
+	void  movImm64(int reg, uint64_t imm)
+	{
+		byte(static_cast<uint8_t>(0x48 | ((reg & 8) ? 1 : 0)));
+		byte(static_cast<uint8_t>(0xB8 + (reg & 7)));
+		qword(imm);
+	}
+
+	void  mov64(int dest, int src)
+	{
+		rex_(true, src, dest);
+		byte(0x89);
+		byte(static_cast<uint8_t>(0xC0 | ((src & 7) << 3) | (dest & 7)));
+	}
+
+	// 32-bit arithmetic between rax, rcx and rdx
+	void  add32(int dest, int src)  { byte(0x01); modrm_(src, dest); }
+	void  sub32(int dest, int src)  { byte(0x29); modrm_(src, dest); }
+	void  cmp32(int dest, int src)  { byte(0x39); modrm_(src, dest); }
+	void  test32(int dest, int src) { byte(0x85); modrm_(src, dest); }
+	void  imul32(int dest, int src) { byte(0x0F); byte(0xAF); modrm_(dest, src); }
+	void  neg32(int reg)            { byte(0xF7); modrm_(3, reg); }
+	void  idiv32(int reg)           { byte(0xF7); modrm_(7, reg); }
+	void  cdq()                     { byte(0x99); }
+	void  cmpImm32(int reg, int32_t imm) { byte(0x81); modrm_(7, reg); dword(static_cast<uint32_t>(imm)); }
+	void  xorImm32(int reg, uint32_t imm) { byte(0x81); modrm_(6, reg); dword(imm); }
+
+	// Single precision floating point operations between an xmm register and [base + disp32]
+	void  sse(uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t disp)
+	{
+		if (prefix != 0) { byte(prefix); }
+		rex_(false, xmm, base);
+		byte(0x0F);
+		byte(opcode);
+		modrmMemory_(xmm, base, disp);
+	}
+
+	void  loadFloat(int xmm, int base, int32_t disp)    { sse(0xF3, 0x10, xmm, base, disp); } // movss
+	void  storeFloat(int base, int32_t disp, int xmm)   { sse(0xF3, 0x11, xmm, base, disp); } // movss
+	void  addFloat(int xmm, int base, int32_t disp)     { sse(0xF3, 0x58, xmm, base, disp); } // addss
+	void  mulFloat(int xmm, int base, int32_t disp)     { sse(0xF3, 0x59, xmm, base, disp); } // mulss
+	void  subFloat(int xmm, int base, int32_t disp)     { sse(0xF3, 0x5C, xmm, base, disp); } // subss
+	void  divFloat(int xmm, int base, int32_t disp)     { sse(0xF3, 0x5E, xmm, base, disp); } // divss
+	void  compareFloat(int xmm, int base, int32_t disp) { sse(0x00, 0x2E, xmm, base, disp); } // ucomiss
+
+	// eax = condition ? 1 : 0
+	void  setcc(Condition_ cc)
+	{
+		byte(0x0F); byte(static_cast<uint8_t>(0x90 + cc)); byte(0xC0); // setcc al
+		byte(0x0F); byte(0xB6); byte(0xC0);                           // movzx eax, al
+	}
+
+	// Jumps return the position of the 32-bit displacement, which is patched later
+	uint32_t  jmp()             { byte(0xE9); dword(0); return offset() - 4; }
+	uint32_t  jcc(Condition_ cc) { byte(0x0F); byte(static_cast<uint8_t>(0x80 + cc)); dword(0); return offset() - 4; }
+
+	void  patch(uint32_t position, uint32_t target)
+	{
+		uint32_t distance = target - (position + 4);
+		std::memcpy(&code_[position], &distance, sizeof(distance));
+	}
+
+	void  jmpRegister(int reg)
+	{
+		if (reg & 8) { byte(0x41); }
+		byte(0xFF); modrm_(4, reg);
+	}
+
+	void  call(const void* function)
+	{
+		movImm64(RAX, reinterpret_cast<uint64_t>(function));
+		byte(0xFF); modrm_(2, RAX); // call rax
+	}
+
+	void  push(int reg) { if (reg & 8) { byte(0x41); } byte(static_cast<uint8_t>(0x50 + (reg & 7))); }
+	void  pop(int reg)  { if (reg & 8) { byte(0x41); } byte(static_cast<uint8_t>(0x58 + (reg & 7))); }
+	void  addRsp(int8_t imm) { byte(0x48); byte(0x83); byte(0xC4); byte(static_cast<uint8_t>(imm)); }
+	void  subRsp(int8_t imm) { byte(0x48); byte(0x83); byte(0xEC); byte(static_cast<uint8_t>(imm)); }
+	void  ret() { byte(0xC3); }
+
+private:
+	void  rex_(bool wide, int reg, int base)
+	{
+		uint8_t rex = static_cast<uint8_t>(0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+		if (rex != 0x40) { byte(rex); }
+	}
+
+	void  modrm_(int reg, int rm) { byte(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7))); }
+
+	void  modrmMemory_(int reg, int base, int32_t disp)
+	{
+		byte(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+		if ((base & 7) == RSP) { byte(0x24); } // rsp and r12 as a base need a SIB byte
+		dword(static_cast<uint32_t>(disp));
+	}
+
+	Code  code_;
+};
+
+
+// Frames native code with the prologue, the exit stubs and the epilogue, and emits the operations
+// shared by the translation of a prototype and of a trace
+class Emitter_
+{
+public:
+	explicit  Emitter_();
+
+	const Assembler_::Code&  code() const { return asm_.code(); }
+
+protected:
+	void      prologue_();
+	void      finish_();
+
+	void      exitIf_(Condition_ cc);
+	void      exit_();
+	void      tick_(uint32_t target);
+
+	void      guardType_(uint32_t reg, Type type);
+	void      guardNotObject_(uint32_t reg);
+	void      storeInt_(uint32_t reg, bool storeType = true);
+	void      assign_(uint32_t dest, Register_ srcBase, int32_t srcOffset);
+	void      index_(bool isStore, uint32_t a, uint32_t b, uint32_t c, bool isConstant);
+	void      divide_(bool isModulo);
+
+	struct Fixup_
+	{
+		Fixup_(uint32_t position, uint32_t target) : position(position), target(target) {}
+		uint32_t  position;
+		uint32_t  target;
+	};
+
+	Assembler_             asm_;
+	uint32_t               exitTo_;   // the instruction the interpreter continues from when a guard fails
+	std::vector<Fixup_>    exits_;    // to the exit stub of an instruction
+};
+
+Emitter_::Emitter_()
+: exitTo_(0)
+{
+}
+
+/*
+ * Layout of the native code
+ *
+ *          push rbx / push r12 / push r13 / sub rsp, 32 ; the stack stays 16-byte aligned for the helpers
+ *          mov rbx, base / mov r12, constants / mov r13, ticks
+ *          jmp entry                             ; the native code of the instruction to start from
+ * code:    ...
+ * exit[i]: mov eax, i / jmp epilogue            ; continues at the instruction i in the interpreter
+ * epilogue: add rsp, 32 / pop r13 / pop r12 / pop rbx / ret
+ */
+void Emitter_::prologue_()
+{
+	asm_.push(RBX);
+	asm_.push(R12);
+	asm_.push(R13);
+	asm_.subRsp(32);
+	asm_.mov64(BASE, ARG0);
+	asm_.mov64(CONSTANTS, ARG1);
+	asm_.mov64(TICKS, ARG3);
+	asm_.jmpRegister(ARG2);
+}
+
+void Emitter_::finish_()
+{
+	std::vector<uint32_t> epilogueJumps;
+	std::unordered_map<uint32_t, uint32_t> stubs;
+
+	for (auto exit = exits_.begin(); exit != exits_.end(); exit++) {
+		auto stub = stubs.find(exit->target);
+		if (stub == stubs.end()) {
+			stub = stubs.insert(std::make_pair(exit->target, asm_.offset())).first;
+			asm_.movImm32(RAX, exit->target);
+			epilogueJumps.push_back(asm_.jmp());
+		}
+		asm_.patch(exit->position, stub->second);
+	}
+
+	uint32_t epilogue = asm_.offset();
+	asm_.addRsp(32);
+	asm_.pop(R13);
+	asm_.pop(R12);
+	asm_.pop(RBX);
+	asm_.ret();
+
+	for (auto jump = epilogueJumps.begin(); jump != epilogueJumps.end(); jump++) {
+		asm_.patch(*jump, epilogue);
+	}
+}
+
+void Emitter_::exitIf_(Condition_ cc)
+{
+	exits_.push_back(Fixup_(asm_.jcc(cc), exitTo_));
+}
+
+void Emitter_::exit_()
+{
+	exits_.push_back(Fixup_(asm_.jmp(), exitTo_));
+}
+
+// A backward jump to the target counts a tick down, and leaves to the target in the interpreter
+// once the ticks run out, which checks the budget there
+void Emitter_::tick_(uint32_t target)
+{
+	asm_.subMemory32(TICKS, 0, 1);
+	exits_.push_back(Fixup_(asm_.jcc(CC_L), target));
+}
+
+void Emitter_::guardType_(uint32_t reg, Type type)
+{
+	asm_.cmpMemory32(BASE, typeOf(reg), static_cast<int8_t>(type));
+	exitIf_(CC_NE);
+}
+
+// A register which holds an object can not be overwritten without releasing the object
+void Emitter_::guardNotObject_(uint32_t reg)
+{
+	asm_.cmpMemory32(BASE, typeOf(reg), static_cast<int8_t>(TypeCFunc));
+	exitIf_(CC_A);
+}
+
+void Emitter_::storeInt_(uint32_t reg, bool storeType)
+{
+	if (storeType) {
+		asm_.storeImm32(BASE, typeOf(reg), TypeInt);
+	}
+	asm_.store32(BASE, valueOf(reg), RAX);
+}
+
+// Copies a register or a constant to R(A).
+// Numbers are copied inline, and the helper takes care of the reference counting of objects.
+void Emitter_::assign_(uint32_t dest, Register_ srcBase, int32_t srcOffset)
+{
+	asm_.cmpMemory32(srcBase, srcOffset, static_cast<int8_t>(TypeCFunc));
+	const uint32_t srcObject = asm_.jcc(CC_A);
+	asm_.cmpMemory32(BASE, typeOf(dest), static_cast<int8_t>(TypeCFunc));
+	const uint32_t destObject = asm_.jcc(CC_A);
+
+	asm_.load64(RAX, srcBase, srcOffset);
+	asm_.load64(RCX, srcBase, srcOffset + 8);
+	asm_.store64(BASE, typeOf(dest), RAX);
+	asm_.store64(BASE, valueOf(dest), RCX);
+	const uint32_t done = asm_.jmp();
+
+	asm_.patch(srcObject, asm_.offset());
+	asm_.patch(destObject, asm_.offset());
+	asm_.lea(ARG0, BASE, typeOf(dest));
+	asm_.lea(ARG1, srcBase, srcOffset);
+	asm_.call(reinterpret_cast<const void*>(&AssignHelper));
+	asm_.patch(done, asm_.offset());
+}
+
+// GETTABLE A B C : R(A) = R(B)[R(C)],  SETTABLE A B C : R(A)[R(C)] = R(B)
+void Emitter_::index_(bool isStore, uint32_t a, uint32_t b, uint32_t c, bool isConstant)
+{
+	if (isStore) {
+		asm_.lea(ARG0, BASE, typeOf(a));
+		asm_.lea(ARG1, isConstant ? CONSTANTS : BASE, typeOf(c));
+		asm_.lea(ARG2, BASE, typeOf(b));
+		asm_.call(reinterpret_cast<const void*>(&SetIndexHelper));
+	} else {
+		asm_.lea(ARG0, BASE, typeOf(a));
+		asm_.lea(ARG1, BASE, typeOf(b));
+		asm_.lea(ARG2, isConstant ? CONSTANTS : BASE, typeOf(c));
+		asm_.call(reinterpret_cast<const void*>(&GetIndexHelper));
+	}
+	asm_.byte(0x84); asm_.byte(0xC0); // test al, al
+	exitIf_(CC_E);
+}
+
+// eax = eax / ecx or eax % ecx
+void Emitter_::divide_(bool isModulo)
+{
+	// The interpreter throws on the division by zero, and idiv faults on INT_MIN / -1
+	asm_.test32(RCX, RCX);
+	exitIf_(CC_E);
+	asm_.cmpImm32(RCX, -1);
+	exitIf_(CC_E);
+	asm_.cdq();
+	asm_.idiv32(RCX);
+	if (isModulo) {
+		asm_.mov64(RAX, RDX);
+	}
+}
+
+
+// Translates the instructions of a prototype one by one
+class Translator_ : public Emitter_
+{
+public:
+	explicit  Translator_(const Prototype& prototype);
+
+	void      translate();
+
+	std::vector<uint32_t>&   entries()    { return entries_; }
+
+private:
+	void      translate_(uint32_t offset, const Instruction& inst);
+
+	bool      loadOperands_(const Instruction& inst, bool isConstant);
+
+	void      arithmetic_(uint32_t opcode, const Instruction& inst, bool isConstant);
+	void      compare_(const Instruction& inst, bool isConstant, Condition_ cc);
+	void      compareJump_(uint32_t offset, const Instruction& inst, bool isConstant, Condition_ cc);
+	void      forLoop_(uint32_t offset, const Instruction& inst);
+
+	void      leave_();
+	void      jumpTo_(uint32_t target);
+	void      jumpTo_(Condition_ cc, uint32_t target);
+
+	const Prototype&       prototype_;
+	uint32_t               offset_;   // the instruction being translated
+	std::vector<uint32_t>  entries_;
+
+	std::vector<Fixup_>    jumps_;    // to the native code of an instruction
+	std::vector<Fixup_>    loops_;    // backward jumps, from the jump to the head of the loop
+	std::vector<bool>      leaves_;   // whether an instruction always leaves to the interpreter
+};
+
+Translator_::Translator_(const Prototype& prototype)
+: prototype_(prototype), offset_(0), entries_(prototype.numInstruction(), 0), leaves_(prototype.numInstruction(), false)
+{
+}
+
+void Translator_::translate()
+{
+	prologue_();
+
+	for (offset_ = 0; offset_ < prototype_.numInstruction(); offset_++) {
+		entries_[offset_] = asm_.offset();
+		exitTo_ = offset_;
+		translate_(offset_, prototype_.instruction(offset_));
+	}
+
+	for (auto jump = jumps_.begin(); jump != jumps_.end(); jump++) {
+		asm_.patch(jump->position, entries_[jump->target]);
+	}
+
+	// The native code is entered only at the head of a loop that it runs entirely, and at the start of
+	// a function with such a loop. Anywhere else it would leave right away, which costs more than it saves.
+	std::vector<bool> enterable(entries_.size(), false);
+	for (auto loop = loops_.begin(); loop != loops_.end(); loop++) {
+		auto begin = leaves_.begin() + loop->target, end = leaves_.begin() + loop->position + 1;
+		if (std::find(begin, end, true) == end) {
+			enterable[loop->target] = true;
+			enterable[0] = true;
+		}
+	}
+	for (size_t i = 0; i < entries_.size(); i++) {
+		if (enterable[i] == false) {
+			entries_[i] = 0;
+		}
+	}
+
+	finish_();
+}
+
+void Translator_::translate_(uint32_t offset, const Instruction& inst)
+{
+	const uint32_t opcode = Instruction::generic[inst.opcode()];
+
+	switch (opcode) {
+	case Instruction::ASSIGN:
+		assign_(inst.a(), BASE, typeOf(inst.b()));
+		break;
+
+	case Instruction::GETCONST:
+		assign_(inst.a(), CONSTANTS, typeOf(inst.bx()));
+		break;
+
+	case Instruction::GETTABLE:  index_(false, inst.a(), inst.b(), inst.c(), false); break;
+	case Instruction::GETTABLEK: index_(false, inst.a(), inst.b(), inst.c(), true); break;
+	case Instruction::SETTABLE:  index_(true, inst.a(), inst.b(), inst.c(), false); break;
+	case Instruction::SETTABLEK: index_(true, inst.a(), inst.b(), inst.c(), true); break;
+
+	case Instruction::ADD:  case Instruction::SUB:  case Instruction::MUL:  case Instruction::DIV:  case Instruction::MOD:
+		arithmetic_(opcode, inst, false);
+		break;
+	case Instruction::ADDK: case Instruction::SUBK: case Instruction::MULK: case Instruction::DIVK: case Instruction::MODK:
+		arithmetic_(opcode, inst, true);
+		break;
+
+	case Instruction::UNM:
+		guardType_(inst.b(), TypeInt);
+		guardNotObject_(inst.a());
+		asm_.load32(RAX, BASE, valueOf(inst.b()));
+		asm_.neg32(RAX);
+		storeInt_(inst.a());
+		break;
+
+	case Instruction::EQ:     compare_(inst, false, CC_E); break;
+	case Instruction::NOTEQ:  compare_(inst, false, CC_NE); break;
+	case Instruction::LT:     compare_(inst, false, CC_L); break;
+	case Instruction::LE:     compare_(inst, false, CC_LE); break;
+	case Instruction::EQK:    compare_(inst, true, CC_E); break;
+	case Instruction::NOTEQK: compare_(inst, true, CC_NE); break;
+	case Instruction::LTK:    compare_(inst, true, CC_L); break;
+	case Instruction::LEK:    compare_(inst, true, CC_LE); break;
+	case Instruction::GTK:    compare_(inst, true, CC_G); break;
+	case Instruction::GEK:    compare_(inst, true, CC_GE); break;
+
+	case Instruction::JUMP:
+		jumpTo_(offset + inst.sax());
+		break;
+
+	case Instruction::BRANCH:
+	case Instruction::BRANCHNOT:
+		guardType_(inst.a(), TypeInt);
+		asm_.cmpMemory32(BASE, valueOf(inst.a()), 0);
+		jumpTo_((opcode == Instruction::BRANCH) ? CC_NE : CC_E, offset + inst.sbx());
+		break;
+
+	case Instruction::JEQ:  compareJump_(offset, inst, false, CC_E); break;
+	case Instruction::JLT:  compareJump_(offset, inst, false, CC_L); break;
+	case Instruction::JLE:  compareJump_(offset, inst, false, CC_LE); break;
+	case Instruction::JEQK: compareJump_(offset, inst, true, CC_E); break;
+	case Instruction::JLTK: compareJump_(offset, inst, true, CC_L); break;
+	case Instruction::JLEK: compareJump_(offset, inst, true, CC_LE); break;
+	case Instruction::JGTK: compareJump_(offset, inst, true, CC_G); break;
+	case Instruction::JGEK: compareJump_(offset, inst, true, CC_GE); break;
+
+	case Instruction::FORPREP:
+	case Instruction::FORLOOP:
+		forLoop_(offset, inst);
+		break;
+
+	default:
+		leave_(); // left to the interpreter
+		break;
+	}
+}
+
+// Checks operand B and C to be integers, and loads them to eax and ecx
+bool Translator_::loadOperands_(const Instruction& inst, bool isConstant)
+{
+	if (isConstant) {
+		const Variable& constant = prototype_.constant(inst.c());
+		if (constant.t != TypeInt) {
+			return false;
+		}
+		guardType_(inst.b(), TypeInt);
+		asm_.load32(RAX, BASE, valueOf(inst.b()));
+		asm_.movImm32(RCX, static_cast<uint32_t>(constant.v.i));
+	} else {
+		guardType_(inst.b(), TypeInt);
+		guardType_(inst.c(), TypeInt);
+		asm_.load32(RAX, BASE, valueOf(inst.b()));
+		asm_.load32(RCX, BASE, valueOf(inst.c()));
+	}
+	return true;
+}
+
+void Translator_::arithmetic_(uint32_t opcode, const Instruction& inst, bool isConstant)
+{
+	if (loadOperands_(inst, isConstant) == false) {
+		leave_();
+		return;
+	}
+	guardNotObject_(inst.a());
+
+	switch (opcode) {
+	case Instruction::ADD: case Instruction::ADDK: asm_.add32(RAX, RCX); break;
+	case Instruction::SUB: case Instruction::SUBK: asm_.sub32(RAX, RCX); break;
+	case Instruction::MUL: case Instruction::MULK: asm_.imul32(RAX, RCX); break;
+	default:
+		divide_(opcode == Instruction::MOD || opcode == Instruction::MODK);
+		break;
+	}
+	storeInt_(inst.a());
+}
+
+void Translator_::compare_(const Instruction& inst, bool isConstant, Condition_ cc)
+{
+	if (loadOperands_(inst, isConstant) == false) {
+		leave_();
+		return;
+	}
+	guardNotObject_(inst.a());
+	asm_.cmp32(RAX, RCX);
+	asm_.setcc(cc);
+	storeInt_(inst.a());
+}
+
+// A fused compare-and-jump takes the following JUMP when the result is same as A, and skips it otherwise
+void Translator_::compareJump_(uint32_t offset, const Instruction& inst, bool isConstant, Condition_ cc)
+{
+	assert(offset + 1 < prototype_.numInstruction());
+	const Instruction& jump = prototype_.instruction(offset + 1);
+	assert(jump.opcode() == Instruction::JUMP);
+
+	if (loadOperands_(inst, isConstant) == false) {
+		leave_();
+		return;
+	}
+	asm_.cmp32(RAX, RCX);
+	jumpTo_((inst.a() != 0) ? cc : invert(cc), offset + 1 + jump.sax());
+	jumpTo_(offset + 2);
+}
+
+// FORLOOP steps the counter R(A), and jumps while the comparison with the limit R(B) holds.
+// FORPREP only compares them, and jumps over the loop when the comparison does not hold.
+void Translator_::forLoop_(uint32_t offset, const Instruction& inst)
+{
+	assert(offset + 1 < prototype_.numInstruction());
+	const Instruction& jump = prototype_.instruction(offset + 1);
+	assert(jump.opcode() == Instruction::JUMP);
+
+	guardType_(inst.a(), TypeInt);
+	guardType_(inst.b(), TypeInt);
+	asm_.load32(RAX, BASE, valueOf(inst.a()));
+	if (inst.opcode() == Instruction::FORLOOP) {
+		asm_.movImm32(RCX, static_cast<uint32_t>(inst.forStep()));
+		asm_.add32(RAX, RCX);
+		storeInt_(inst.a(), false);
+	}
+	asm_.cmpLoad32(RAX, BASE, valueOf(inst.b()));
+
+	// R(B) < R(A) is compared as R(A) > R(B)
+	Condition_ cc = inst.forInverted() ? (inst.forInclusive() ? CC_GE : CC_G) : (inst.forInclusive() ? CC_LE : CC_L);
+	jumpTo_((inst.opcode() == Instruction::FORLOOP) ? cc : invert(cc), offset + 1 + jump.sax());
+	jumpTo_(offset + 2);
+}
+
+void Translator_::leave_()
+{
+	exit_();
+	leaves_[offset_] = true;
+}
+
+void Translator_::jumpTo_(uint32_t target)
+{
+	assert(target < prototype_.numInstruction());
+	if (target <= offset_) {
+		tick_(target);
+		loops_.push_back(Fixup_(offset_, target));
+	}
+	jumps_.push_back(Fixup_(asm_.jmp(), target));
+}
+
+// A backward conditional jump skips the tick when it is not taken
+void Translator_::jumpTo_(Condition_ cc, uint32_t target)
+{
+	assert(target < prototype_.numInstruction());
+	if (target <= offset_) {
+		uint32_t skip = asm_.jcc(invert(cc));
+		jumpTo_(target);
+		asm_.patch(skip, asm_.offset());
+		return;
+	}
+	jumps_.push_back(Fixup_(asm_.jcc(cc), target));
+}
+
+
+// Translates the nodes of a trace, in which the types of the operands are already known
+class TraceTranslator_ : public Emitter_
+{
+public:
+	explicit  TraceTranslator_(const Trace& trace);
+
+	void      translate();
+	uint32_t  entry() const { return entry_; }
+
+private:
+	void      translate_(const Trace::Node& node);
+
+	void      loadFloatCompare_(const Trace::Node& node, Condition_& cc);
+	int32_t   operandC_(const Trace::Node& node, Register_& base) const;
+
+	const Trace&  trace_;
+	uint32_t      entry_;
+};
+
+TraceTranslator_::TraceTranslator_(const Trace& trace)
+: trace_(trace), entry_(0)
+{
+}
+
+void TraceTranslator_::translate()
+{
+	prologue_();
+
+	entry_ = asm_.offset();
+	uint32_t loopStart = entry_;
+
+	for (uint32_t i = 0; i < trace_.nodes.size(); i++) {
+		const Trace::Node& node = trace_.nodes[i];
+		if (i == trace_.loopStart) {
+			loopStart = asm_.offset();
+		}
+		if (node.opcode == Trace::LOOP) {
+			tick_(node.exit);
+			asm_.patch(asm_.jmp(), loopStart);
+		} else {
+			exitTo_ = node.exit;
+			translate_(node);
+		}
+	}
+
+	finish_();
+}
+
+// Where RK(C) is
+int32_t TraceTranslator_::operandC_(const Trace::Node& node, Register_& base) const
+{
+	base = node.constant ? CONSTANTS : BASE;
+	return valueOf(node.c);
+}
+
+void TraceTranslator_::translate_(const Trace::Node& node)
+{
+	Register_ baseC;
+	const int32_t offsetC = operandC_(node, baseC);
+
+	switch (node.opcode) {
+	case Trace::GUARD_TYPE:
+		guardType_(node.a, static_cast<Type>(node.b));
+		break;
+
+	case Trace::GUARD_NOTOBJECT:
+		guardNotObject_(node.a);
+		break;
+
+	case Trace::MOVE:
+		if (node.storeType) {
+			asm_.load32(RAX, BASE, typeOf(node.b));
+			asm_.store32(BASE, typeOf(node.a), RAX);
+		}
+		asm_.load64(RCX, BASE, valueOf(node.b));
+		asm_.store64(BASE, valueOf(node.a), RCX);
+		break;
+
+	case Trace::LOADK:
+		if (node.storeType) {
+			asm_.load32(RAX, CONSTANTS, typeOf(node.b));
+			asm_.store32(BASE, typeOf(node.a), RAX);
+		}
+		asm_.load64(RCX, CONSTANTS, valueOf(node.b));
+		asm_.store64(BASE, valueOf(node.a), RCX);
+		break;
+
+	case Trace::MOVE_OBJECT:
+	case Trace::LOADK_OBJECT:
+		asm_.lea(ARG0, BASE, typeOf(node.a));
+		asm_.lea(ARG1, (node.opcode == Trace::MOVE_OBJECT) ? BASE : CONSTANTS, typeOf(node.b));
+		asm_.call(reinterpret_cast<const void*>(&AssignHelper));
+		break;
+
+	case Trace::ARITH_INT:
+		asm_.load32(RAX, BASE, valueOf(node.b));
+		asm_.load32(RCX, baseC, offsetC);
+		switch (node.op) {
+		case Trace::ADD: asm_.add32(RAX, RCX); break;
+		case Trace::SUB: asm_.sub32(RAX, RCX); break;
+		case Trace::MUL: asm_.imul32(RAX, RCX); break;
+		default:         divide_(node.op == Trace::MOD); break;
+		}
+		storeInt_(node.a, node.storeType);
+		break;
+
+	case Trace::ARITH_FLOAT:
+		asm_.loadFloat(XMM0, BASE, valueOf(node.b));
+		switch (node.op) {
+		case Trace::ADD: asm_.addFloat(XMM0, baseC, offsetC); break;
+		case Trace::SUB: asm_.subFloat(XMM0, baseC, offsetC); break;
+		case Trace::MUL: asm_.mulFloat(XMM0, baseC, offsetC); break;
+		default:         asm_.divFloat(XMM0, baseC, offsetC); break;
+		}
+		if (node.storeType) {
+			asm_.storeImm32(BASE, typeOf(node.a), TypeFloat);
+		}
+		asm_.storeFloat(BASE, valueOf(node.a), XMM0);
+		break;
+
+	case Trace::NEG_INT:
+	case Trace::NEG_FLOAT:
+		asm_.load32(RAX, BASE, valueOf(node.b));
+		if (node.opcode == Trace::NEG_INT) {
+			asm_.neg32(RAX);
+		} else {
+			asm_.xorImm32(RAX, 0x80000000); // flips the sign bit
+		}
+		if (node.storeType) {
+			asm_.storeImm32(BASE, typeOf(node.a), (node.opcode == Trace::NEG_INT) ? TypeInt : TypeFloat);
+		}
+		asm_.store32(BASE, valueOf(node.a), RAX);
+		break;
+
+	case Trace::STEP_INT:
+		asm_.load32(RAX, BASE, valueOf(node.a));
+		asm_.movImm32(RCX, node.c);
+		asm_.add32(RAX, RCX);
+		storeInt_(node.a, node.storeType);
+		break;
+
+	case Trace::COMPARE_INT:
+	case Trace::COMPARE_FLOAT:
+	case Trace::TEST_INT:
+	case Trace::TEST_FLOAT: {
+		Condition_ cc;
+		if (node.opcode == Trace::COMPARE_INT || node.opcode == Trace::TEST_INT) {
+			static const Condition_ conditions[] = { CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE };
+			cc = conditions[node.op - Trace::EQ];
+			asm_.load32(RAX, BASE, valueOf(node.b));
+			asm_.cmpLoad32(RAX, baseC, offsetC);
+		} else {
+			loadFloatCompare_(node, cc);
+		}
+
+		if (node.opcode == Trace::COMPARE_INT || node.opcode == Trace::COMPARE_FLOAT) {
+			asm_.setcc(cc);
+			storeInt_(node.a, node.storeType);
+		} else {
+			exitIf_(node.expect ? invert(cc) : cc);
+		}
+		break;
+	}
+
+	case Trace::TEST_TRUTH:
+		asm_.cmpMemory32(BASE, valueOf(node.a), 0);
+		exitIf_(node.expect ? CC_E : CC_NE);
+		break;
+
+	case Trace::GETINDEX:
+		index_(false, node.a, node.b, node.c, node.constant);
+		break;
+
+	case Trace::SETINDEX:
+		index_(true, node.a, node.b, node.c, node.constant);
+		break;
+
+	default:
+		assert(false);
+		break;
+	}
+}
+
+// Compares R(B) and RK(C) as floats with ucomiss, which sets the flags as an unsigned comparison.
+// The operands are ordered so that the condition is "above" or "above or equal",
+// which is false when either operand is NaN, same as the comparison in C++.
+void TraceTranslator_::loadFloatCompare_(const Trace::Node& node, Condition_& cc)
+{
+	Register_ baseC;
+	const int32_t offsetC = operandC_(node, baseC);
+
+	switch (node.op) {
+	case Trace::LT: // C > B
+	case Trace::LE: // C >= B
+		asm_.loadFloat(XMM0, baseC, offsetC);
+		asm_.compareFloat(XMM0, BASE, valueOf(node.b));
+		cc = (node.op == Trace::LT) ? CC_A : CC_AE;
+		break;
+	default:        // B > C, B >= C
+		asm_.loadFloat(XMM0, BASE, valueOf(node.b));
+		asm_.compareFloat(XMM0, baseC, offsetC);
+		cc = (node.op == Trace::GT) ? CC_A : CC_AE;
+		break;
+	}
+}
+
+} // The end of anomymous namespace
+
+
+JitCode* JitCode::compile(const Prototype& prototype)
+{
+	Translator_ translator(prototype);
+	translator.translate();
+
+	uint8_t* memory = load_(translator.code());
+	if (memory == nullptr) {
+		return nullptr;
+	}
+	return new JitCode(memory, translator.code().size(), std::move(translator.entries()));
+}
+
+JitCode* JitCode::compile(const Prototype& prototype, const Trace& trace)
+{
+	TraceTranslator_ translator(trace);
+	translator.translate();
+
+	uint8_t* memory = load_(translator.code());
+	if (memory == nullptr) {
+		return nullptr;
+	}
+
+	std::vector<uint32_t> entries(prototype.numInstruction(), 0);
+	entries[trace.head] = translator.entry();
+	return new JitCode(memory, translator.code().size(), std::move(entries));
+}
+
+JitCode::JitCode(uint8_t* memory, size_t size, std::vector<uint32_t>&& entries)
+: memory_(memory), size_(size), entries_(std::move(entries))
+{
+}
+
+// Copies the code into memory of its own, which is written while it is writable and then turned executable.
+// Returns nullptr if the memory can not be allocated or made executable, as under a policy which forbids
+// executable memory written at runtime (W^X), so that the interpreter keeps running the prototype.
+uint8_t* JitCode::load_(const std::vector<uint8_t>& code)
+{
+	const size_t size = code.size();
+
+#if defined(_WIN32)
+	uint8_t* memory = static_cast<uint8_t*>(VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if (memory == nullptr) {
+		return nullptr;
+	}
+	std::memcpy(memory, code.data(), size);
+	DWORD oldProtect;
+	if (VirtualProtect(memory, size, PAGE_EXECUTE_READ, &oldProtect) == FALSE) {
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return nullptr;
+	}
+	FlushInstructionCache(GetCurrentProcess(), memory, size);
+	return memory;
+#else
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		return nullptr;
+	}
+	std::memcpy(memory, code.data(), size);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+		return nullptr;
+	}
+	return static_cast<uint8_t*>(memory);
+#endif
+}
+
+JitCode::~JitCode()
+{
+#if defined(_WIN32)
+	VirtualFree(memory_, 0, MEM_RELEASE);
+#else
+	munmap(memory_, size_);
+#endif
+}
+
+uint32_t JitCode::run(Variable* base, const Variable* constants, uint32_t offset, int32_t* ticks) const
+{
+	assert(offset < entries_.size());
+	if (entries_[offset] == 0) {
+		return offset; // not an entry point
+	}
+	return reinterpret_cast<Entry_>(memory_)(base, constants, memory_ + entries_[offset], ticks);
+}
+
+#else // CMM_USE_JIT
+
+JitCode* JitCode::compile(const Prototype&)
+{
+	return nullptr;
+}
+
+JitCode* JitCode::compile(const Prototype&, const Trace&)
+{
+	return nullptr;
+}
+
+JitCode::~JitCode()
+{
+}
+
+uint32_t JitCode::run(Variable*, const Variable*, uint32_t offset, int32_t*) const
+{
+	return offset;
+}
+
+#endif // CMM_USE_JIT
+
+} // namespace "cmm"
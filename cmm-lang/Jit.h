@@ -0,0 +1,58 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Memory.h"
+
+namespace cmm
+{
+
+class Prototype;
+struct Trace;
+
+// Native code of a prototype translated by the baseline JIT.
+//
+// The code is entered at the start of the prototype and at the heads of its loops, from wherever the interpreter is,
+// and run() returns the offset of the instruction the interpreter continues from.
+// Integer arithmetic, comparisons, jumps, register moves and array/table indexing are translated.
+// The code leaves to the interpreter at any other instruction (calls, upvalues, globals ...) and whenever
+// the operands are not of the types it expects, before the instruction has any side effect.
+// Every backward jump counts down the ticks of the context (Context::setBudget), and leaves to the interpreter
+// at the head of the loop when they run out.
+//
+// CALL, TAILCALL and RETURN are not translated, as the frames are made by the interpreter alone. So the JIT speeds up
+// the loops of integer code, where the time goes to the dispatch and the type checks it removes, and not the code
+// whose time goes to the calls, such as a recursive function. A short script is mostly loading and calling main(),
+// which the JIT leaves as they are.
+class JitCode
+{
+public:
+	// Returns nullptr if the JIT is not built for this platform, or the code can not be made executable
+	static JitCode*  compile(const Prototype& prototype);
+
+	// Translates a trace of a loop in the prototype, which is entered only at the head of the loop
+	static JitCode*  compile(const Prototype& prototype, const Trace& trace);
+
+	                 ~JitCode();
+	                 JitCode(const JitCode&) = delete;
+	const JitCode&   operator=(const JitCode&) = delete;
+
+	uint32_t         run(Variable* base, const Variable* constants, uint32_t offset, int32_t* ticks) const;
+
+private:
+	typedef uint32_t (*Entry_)(Variable* base, const Variable* constants, const void* entry, int32_t* ticks);
+
+	explicit         JitCode(uint8_t* memory, size_t size, std::vector<uint32_t>&& entries);
+
+	static uint8_t*  load_(const std::vector<uint8_t>& code);
+
+	uint8_t*               memory_;
+	size_t                 size_;
+	std::vector<uint32_t>  entries_; // the offset of the native code of each instruction, 0 if it is not an entry point
+};
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
@@ -25,6 +25,7 @@ enum Type
 	TypeArray,
 	TypeTable,
 	TypeFunc,
+	TypeCoroutine,
 	TypeEnd
 };
 
@@ -75,7 +76,7 @@ struct Variable
 	Variable(CFunction func)         : t(TypeCFunc), v(func) {}
 
 	Variable(const Variable& rhs)    : t(rhs.t), v(rhs.v) { objectAddRef(); }
-	Variable(Variable&& rhs)         : t(rhs.t), v(rhs.v) { rhs.t = TypeNull; }
+	Variable(Variable&& rhs) noexcept: t(rhs.t), v(rhs.v) { rhs.t = TypeNull; }
 
 	~Variable() { objectRelease(); }
 
@@ -100,8 +101,11 @@ inline const Variable& Variable::operator=(const Variable& rhs) {
 }
 
 inline const Variable& Variable::operator=(Variable&& rhs) {
-	t = rhs.t; v = rhs.v;
-	rhs.t = TypeNull;
+	if (this != &rhs) {
+		objectRelease();
+		t = rhs.t; v = rhs.v;
+		rhs.t = TypeNull;
+	}
 	
 	return *this;
 }
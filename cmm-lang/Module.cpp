@@ -0,0 +1,67 @@
+#include "StdAfx.h"
+#include "Module.h"
+
+#include "Prototype.h"
+#include "DataType.h"
+#include "Error.h"
+
+namespace cmm
+{
+
+namespace
+{
+
+Variable CreateConstant(const Module::Constant& constant, ObjectManager& objectManager)
+{
+	switch (constant.type) {
+	case TypeNull:   return Variable(TypeNull);
+	case TypeInt:    return Variable(constant.integer);
+	case TypeFloat:  return Variable(constant.real);
+	case TypeString: return Variable(TypeString, new String(constant.string, &objectManager));
+	default:         throw Error(L"wrong type of constant in a module");
+	}
+}
+
+} // The end of anomymous namespace
+
+
+Ref<Prototype> Module::instantiate(ObjectManager& objectManager) const
+{
+	return instantiate_(*main, objectManager);
+}
+
+Ref<Prototype> Module::instantiate_(const Function& function, ObjectManager& objectManager)
+{
+	Ref<Prototype> prototype = Ref<Prototype>(new Prototype(&objectManager));
+
+	for (uint32_t i = 0; i < function.numConstant; i++) {
+		prototype->constants_.push_back(CreateConstant(function.constants[i], objectManager));
+	}
+	for (uint32_t i = 0; i < function.numInstruction; i++) {
+		Instruction instruction;
+		instruction.code = function.code[i];
+		prototype->code_.push_back(instruction);
+	}
+	prototype->lineDefined_ = function.lineDefined;
+	for (uint32_t i = 0; function.lines != nullptr && i < function.numInstruction; i++) {
+		prototype->addLine_(function.lines[i]);
+	}
+	for (uint32_t i = 0; i < function.numUpValue; i++) {
+		Prototype::UpValueInfo info;
+		info.isLocal = function.upValues[i].isLocal;
+		info.index = function.upValues[i].index;
+		prototype->upValues_.push_back(info);
+	}
+	for (uint32_t i = 0; i < function.numFunction; i++) {
+		prototype->localPrototypes_.push_back(instantiate_(*function.functions[i], objectManager));
+	}
+
+	prototype->globalCaches_.resize(prototype->constants_.size());
+	prototype->localSize_ = function.localSize;
+	prototype->functionLevel_ = function.functionLevel;
+	prototype->numArgs_ = function.numArgs;
+	prototype->nativeCode_ = function.nativeCode;
+	return prototype;
+}
+
+} // namespace "cmm"
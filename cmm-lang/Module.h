@@ -0,0 +1,212 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <cstdint>
+
+#include "Memory.h"
+#include "Object.h"
+#include "DataType.h"
+#include "Prototype.h"
+#include "Utility.h"
+
+namespace cmm
+{
+
+class ObjectManager;
+
+// A script compiled ahead of time to C++ by CppGenerator. The generated source defines the prototypes of
+// the script as constant data and a Module which refers to them, so loading it does not run the compiler.
+// Each prototype comes with its native code (Prototype::NativeCode), which is the instructions translated
+// to C++ and is entered by the interpreter wherever the baseline JIT would enter.
+// The generated source also defines a function which registers the module in a Context (Context::registerModule).
+struct Module
+{
+	struct Constant
+	{
+		Type            type;
+		int32_t         integer;
+		float           real;
+		const wchar_t*  string;
+	};
+
+	struct UpValue
+	{
+		bool      isLocal;
+		uint32_t  index;
+	};
+
+	struct Function
+	{
+		uint32_t                functionLevel;
+		uint32_t                numArgs;
+		uint32_t                localSize;
+		uint32_t                lineDefined;
+		const Constant*         constants;
+		uint32_t                numConstant;
+		const uint32_t*         code;
+		uint32_t                numInstruction;
+		const uint32_t*         lines;     // the source line of each instruction, nullptr if they are not known
+		const UpValue*          upValues;
+		uint32_t                numUpValue;
+		const Function* const*  functions; // the local prototypes
+		uint32_t                numFunction;
+		Prototype::NativeCode   nativeCode;
+	};
+
+	// Creates the prototype of the main function, and its local prototypes
+	Ref<cmm::Prototype>  instantiate(ObjectManager& objectManager) const;
+
+	const wchar_t*   name;
+	const Function*  main;
+
+private:
+	static Ref<cmm::Prototype>  instantiate_(const Function& function, ObjectManager& objectManager);
+};
+
+
+// Below are the operations the native code is made of. They give up by returning false where the interpreter
+// would throw an error or create an object, and the native code returns to let the interpreter execute it.
+namespace Native
+{
+
+inline bool toBool(const Variable& var)
+{
+	switch (var.t) {
+		case TypeNull:    return false;
+		case TypeInt:     return var.v.i != 0;
+		case TypeFloat:   return var.v.f != 0;
+		default:          return true;
+	}
+}
+
+// Arithmetic and comparison of numbers, the result of a comparison is an integer (0, 1)
+template <typename BinaryOp>
+inline bool numeric(Variable& dest, const Variable& lhs, const Variable& rhs)
+{
+	if (lhs.t == TypeInt && rhs.t == TypeInt) {
+		dest = BinaryOp::op(lhs.v.i, rhs.v.i);
+	} else if (lhs.t == TypeFloat && rhs.t == TypeFloat) {
+		dest = BinaryOp::op(lhs.v.f, rhs.v.f);
+	} else if (lhs.t == TypeInt && rhs.t == TypeFloat) {
+		dest = BinaryOp::op(lhs.v.i, rhs.v.f);
+	} else if (lhs.t == TypeFloat && rhs.t == TypeInt) {
+		dest = BinaryOp::op(lhs.v.f, rhs.v.i);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+template <typename CompOp>
+inline bool test(bool& result, const Variable& lhs, const Variable& rhs)
+{
+	if (lhs.t == TypeInt && rhs.t == TypeInt) {
+		result = CompOp::op(lhs.v.i, rhs.v.i);
+	} else if (lhs.t == TypeFloat && rhs.t == TypeFloat) {
+		result = CompOp::op(lhs.v.f, rhs.v.f);
+	} else if (lhs.t == TypeInt && rhs.t == TypeFloat) {
+		result = CompOp::op(lhs.v.i, rhs.v.f);
+	} else if (lhs.t == TypeFloat && rhs.t == TypeInt) {
+		result = CompOp::op(lhs.v.f, rhs.v.i);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// FORLOOP steps the counter and compares it with the limit. It gives up before stepping,
+// so the interpreter does not step the counter twice.
+template <typename CompOp>
+inline bool forLoop(bool& result, Variable& counter, const Variable& limit, int32_t step, bool inverted)
+{
+	if (!counter.isNumber() || !limit.isNumber()) {
+		return false;
+	}
+	if (counter.t == TypeInt) {
+		counter.v.i += step;
+	} else {
+		counter.v.f += step;
+	}
+	return inverted ? test<CompOp>(result, limit, counter) : test<CompOp>(result, counter, limit);
+}
+
+inline bool divide(Variable& dest, const Variable& lhs, const Variable& rhs)
+{
+	if (lhs.t == TypeInt && rhs.t == TypeInt && rhs.v.i == 0) {
+		return false;
+	}
+	return numeric<OpDivide>(dest, lhs, rhs);
+}
+
+template <typename BinaryOp>
+inline bool integer(Variable& dest, const Variable& lhs, const Variable& rhs)
+{
+	if (lhs.t != TypeInt || rhs.t != TypeInt) {
+		return false;
+	}
+	dest = BinaryOp::op(lhs.v.i, rhs.v.i);
+	return true;
+}
+
+inline bool modulo(Variable& dest, const Variable& lhs, const Variable& rhs)
+{
+	if (rhs.t == TypeInt && rhs.v.i == 0) {
+		return false;
+	}
+	return integer<OpModular>(dest, lhs, rhs);
+}
+
+inline bool negate(Variable& dest, const Variable& rhs)
+{
+	switch (rhs.t) {
+		case TypeInt:   dest = -rhs.v.i; return true;
+		case TypeFloat: dest = -rhs.v.f; return true;
+		default:        return false;
+	}
+}
+
+inline bool bitNot(Variable& dest, const Variable& rhs)
+{
+	if (rhs.t != TypeInt) {
+		return false;
+	}
+	dest = ~rhs.v.i;
+	return true;
+}
+
+// Only numbers are compared, since the comparison of objects depends on their types
+template <typename CompOp>
+inline bool compare(Variable& dest, const Variable& lhs, const Variable& rhs)
+{
+	return numeric<CompOp>(dest, lhs, rhs);
+}
+
+inline bool getIndex(Variable& dest, const Variable& container, const Variable& key)
+{
+	if (container.t == TypeArray && key.t == TypeInt) {
+		dest = static_cast<Array*>(container.v.obj)->getValue(key.v.i);
+	} else if (container.t == TypeTable) {
+		dest = static_cast<Table*>(container.v.obj)->getValue(key);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+inline bool setIndex(const Variable& container, const Variable& key, const Variable& value)
+{
+	if (container.t == TypeArray && key.t == TypeInt) {
+		static_cast<Array*>(container.v.obj)->setValue(key.v.i, value);
+	} else if (container.t == TypeTable) {
+		static_cast<Table*>(container.v.obj)->setValue(key, value);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+} // namespace "Native"
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
@@ -27,8 +27,12 @@ Object::~Object()
 {
 }
 
+// A frozen object may be shared by threads, so its count is left as it is
 void Object::release() const
 {
+	if (GCFlag_ & GCFLAG_FROZEN) {
+		return;
+	}
 	assert(refCount_ > 0);
 
 	refCount_--;
@@ -44,6 +48,9 @@ void Object::release() const
 
 void Object::addRef() const
 {
+	if (GCFlag_ & GCFLAG_FROZEN) {
+		return;
+	}
 	assert(refCount_ >= 0);
 
 	refCount_++;
@@ -77,7 +84,7 @@ void ObjectManager::clearObjects_()
 	while (head_.next != &head_) {
 		Object& obj = *objectPtr_(head_.next);
 		
-		obj.GCFlag_ |= GCFLAG_INVALID;
+		obj.GCFlag_ = (obj.GCFlag_ & ~GCFLAG_FROZEN) | GCFLAG_INVALID;
 		obj.refCount_ = 1; // if the reference count is not 1, then the object will not be freed properly
 		obj.release();
 	}
@@ -85,7 +92,7 @@ void ObjectManager::clearObjects_()
 	head_.listHeadInit();
 }
 
-void ObjectManager::garbageCollect(Object& rootSet)
+void ObjectManager::garbageCollect(Object& rootSet, const std::vector<const Object*>& otherRoots)
 {
 	unmarkAllObjects_();
 
@@ -95,8 +102,9 @@ void ObjectManager::garbageCollect(Object& rootSet)
 	workingSet.listHeadInit();
 	markedSet.listHeadInit();
 
+	// A frozen object belongs to another manager, and refers to frozen objects only
 	std::function<void(const Object&)> marking = [&workingSet](const Object& object) {
-		if (!(object.GCFlag_ & GCFLAG_MARKED)) {
+		if (!(object.GCFlag_ & (GCFLAG_MARKED | GCFLAG_FROZEN))) {
 			object.GCFlag_ = GCFLAG_MARKED;
 			object.node_.pickOut();
 			workingSet.insertFront(&object.node_);
@@ -105,6 +113,7 @@ void ObjectManager::garbageCollect(Object& rootSet)
 	
 	rootSet.node_.pickOut();
 	workingSet.insertBack(&rootSet.node_);
+	std::for_each(otherRoots.begin(), otherRoots.end(), [&marking](const Object* root) { marking(*root); });
 
 	while (workingSet.next != &workingSet) {
 		Node* node = workingSet.next;
@@ -124,6 +133,13 @@ void ObjectManager::garbageCollect(Object& rootSet)
 }
 
 
+void ObjectManager::freeze()
+{
+	for (Node* iter = head_.next; iter != &head_; iter = iter->next) {
+		objectPtr_(iter)->GCFlag_ |= GCFLAG_FROZEN;
+	}
+}
+
 void ObjectManager::unmarkAllObjects_()
 {
 	Node *iter = head_.next;
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cassert>
 #include <unordered_set>
+#include <vector>
 #include <algorithm>
 #include <functional>
 
@@ -16,6 +17,7 @@ namespace cmm
 constexpr uint8_t GCFLAG_UNMARKED = 0x00;
 constexpr uint8_t GCFLAG_MARKED = 0x01;
 constexpr uint8_t GCFLAG_INVALID = 0x02;
+constexpr uint8_t GCFLAG_FROZEN = 0x04; // neither counted nor collected (ObjectManager::freeze)
 
 struct Variable;
 
@@ -26,6 +28,8 @@ struct Variable;
 
 // Note : reference count begins from 0.
 
+class ObjectManager;
+
 class Object
 {
 	friend class ObjectManager;
@@ -58,7 +62,12 @@ public:
 	                     ~ObjectManager();
 
 	void                 registerObject(Object* object);
-	void                 garbageCollect(Object& rootSet);
+	void                 garbageCollect(Object& rootSet, const std::vector<const Object*>& otherRoots = std::vector<const Object*>());
+
+	// Makes every object registered so far read only, so they can be shared by contexts on other threads.
+	// A frozen object is not reference counted nor marked by the collector of any other manager, and lives
+	// until this manager is destroyed, which is never collected again.
+	void                 freeze();
 
 private:
 		                 ObjectManager(const ObjectManager&);
@@ -179,26 +179,36 @@ FunctionDefPtr Parser::parseProgram_()
  */
 StatementPtr Parser::parseStatement_()
 {
+	const Position position = currentToken_.pos(); // a statement is located at its first token
+	StatementPtr statement;
+
 	switch(currentToken_.type()) {
-	case Token::LEFTBRACE:        return parseCompoundStatement_();
-	case Token::KEYWORD_IF:       return parseIfStatement_();
-	case Token::KEYWORD_WHILE:    return parseWhileStatement_();
-	case Token::KEYWORD_DO:       return parseDoWhileStatement_();
-	case Token::KEYWORD_FOR:      return parseForStatement_();
-	case Token::KEYWORD_FUNCTION: return parseFunctionStatement_();
-	case Token::KEYWORD_LOCAL:    return parseVariableStatement_();
+	case Token::LEFTBRACE:        statement = parseCompoundStatement_(); break;
+	case Token::KEYWORD_IF:       statement = parseIfStatement_(); break;
+	case Token::KEYWORD_WHILE:    statement = parseWhileStatement_(); break;
+	case Token::KEYWORD_DO:       statement = parseDoWhileStatement_(); break;
+	case Token::KEYWORD_FOR:      statement = parseForStatement_(); break;
+	case Token::KEYWORD_FUNCTION: statement = parseFunctionStatement_(); break;
+	case Token::KEYWORD_LOCAL:    statement = parseVariableStatement_(); break;
 	case Token::KEYWORD_RETURN:   
-	case Token::KEYWORD_YIELD:    return parseReturnStatement_();
+	case Token::KEYWORD_YIELD:    statement = parseReturnStatement_(); break;
 	case Token::KEYWORD_BREAK:
 		processCurrentToken_();
 		processCurrentToken_(Token::SEMICOLON);
-		return JumpStmtPtr(new AST::JumpStmt(AST::JumpStmt::BREAK));
+		statement = JumpStmtPtr(new AST::JumpStmt(AST::JumpStmt::BREAK));
+		break;
 	case Token::KEYWORD_CONTINUE:
 		processCurrentToken_();
 		processCurrentToken_(Token::SEMICOLON);
-		return JumpStmtPtr(new AST::JumpStmt(AST::JumpStmt::CONTINUE));
-	default:		              return parseExpressionStatement_();
+		statement = JumpStmtPtr(new AST::JumpStmt(AST::JumpStmt::CONTINUE));
+		break;
+	default:		              statement = parseExpressionStatement_(); break;
+	}
+
+	if (statement != nullptr) {
+		statement->position = position;
 	}
+	return statement;
 }
 
 
@@ -281,7 +291,9 @@ StatementPtr Parser::parseDoWhileStatement_()
 	StatementPtr contents(parseStatement_());
 	processCurrentToken_(Token::KEYWORD_WHILE);
 	processCurrentToken_(Token::LEFTPAREN);
+	const Position position = currentToken_.pos(); // the condition is evaluated after the contents
 	ExpressionPtr condition(parseExpression_());
+	condition->position = position;
 	processCurrentToken_(Token::RIGHTPAREN);
 	processCurrentToken_(Token::SEMICOLON);
 
@@ -312,12 +324,17 @@ StatementPtr Parser::parseForStatement_()
 	}
 
 	if (currentToken_.type() != Token::SEMICOLON) {
+		const Position position = currentToken_.pos();
 		condition = parseExpression_();
+		condition->position = position;
 	}
 	processCurrentToken_(Token::SEMICOLON);
 	
+	// The iteration is evaluated after the contents, so it keeps its own position
 	if (currentToken_.type() != Token::SEMICOLON) {
+		const Position position = currentToken_.pos();
 		iteration = ExpressionStmtPtr(new AST::ExpressionStmt(parseExpression_()));
+		iteration->position = position;
 	}
 
 	processCurrentToken_(Token::RIGHTPAREN);
@@ -336,11 +353,6 @@ StatementPtr Parser::parseReturnStatement_()
 {
 	assert(currentToken_.type() == Token::KEYWORD_RETURN ||
 	       currentToken_.type() == Token::KEYWORD_YIELD);
-	
-	// TODO: implement coroutine/yield
-	if (currentToken_.type() == Token::KEYWORD_YIELD) {
-		throw Error(L"currently coroutine/yield is not supported");
-	}
 
 	AST::ReturnStmt::Type type =
 		(currentToken_.type() == Token::KEYWORD_RETURN) ? AST::ReturnStmt::RETURN : AST::ReturnStmt::YIELD;
@@ -409,6 +421,7 @@ FunctionDefPtr Parser::parseFunctionDef_()
 {
 	assert(currentToken_.type() == Token::LEFTPAREN);
 
+	const Position position = currentToken_.pos();
 	StmtSequencePtr argumentList(new AST::StmtSequence);	
 
 	processCurrentToken_(Token::LEFTPAREN);
@@ -428,7 +441,9 @@ FunctionDefPtr Parser::parseFunctionDef_()
 	processCurrentToken_(Token::LEFTBRACE);
 	StmtSequencePtr contents(parseStmtSequence_(Token::RIGHTBRACE));
 
-	return FunctionDefPtr(new AST::FunctionDefinition(std::move(argumentList), std::move(contents)));
+	FunctionDefPtr functionDef(new AST::FunctionDefinition(std::move(argumentList), std::move(contents)));
+	functionDef->position = position;
+	return functionDef;
 }
 
 
@@ -854,10 +869,10 @@ ExpressionPtr Parser::parsePrimaryExpr_()
 
 ExpressionPtr Parser::newIntegerTerminal_(uint32_t integer)
 {
-	wchar_t buffer[10];
+	wchar_t buffer[12];
 #pragma warning (push)
 #pragma warning (disable:4996)
-	swprintf(buffer, L"%d", integer);
+	swprintf(buffer, 12, L"%d", integer);
 #pragma warning (pop)
 	return ExpressionPtr(new AST::TerminalExpr(AST::TerminalExpr::INTEGER, buffer));
 }
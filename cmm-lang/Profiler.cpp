@@ -0,0 +1,406 @@
+#include "StdAfx.h"
+#include "Profiler.h"
+
+#include <cstdarg>
+#include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "Prototype.h"
+#include "Instruction.h"
+
+namespace cmm
+{
+
+namespace
+{
+
+void Append(std::wstring& output, const wchar_t format[], ...)
+{
+	va_list args;
+	va_start(args, format);
+	wchar_t buffer[256];
+
+	vswprintf(buffer, 256, format, args);
+	va_end(args);
+
+	output.append(buffer);
+}
+
+// The names are appended without the format, since %s takes a wide string only on MSVC
+void AppendPadded(std::wstring& output, const std::wstring& string, size_t width)
+{
+	output.append(string);
+	if (string.size() < width) {
+		output.append(width - string.size(), L' ');
+	}
+}
+
+double Percent(uint64_t part, uint64_t whole)
+{
+	return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+// An instruction of a function in the report
+struct Hit
+{
+	uint32_t  function;
+	uint32_t  offset;
+	uint64_t  count;
+};
+
+} // The end of anomymous namespace
+
+
+Profiler::Profiler()
+: lastPrototype_(nullptr), lastFunction_(0), lastOffset_(0), lastOpcode_(0), running_(false)
+{
+	reset();
+}
+
+Profiler::~Profiler()
+{
+}
+
+void Profiler::reset()
+{
+	std::fill(std::begin(counts_), std::end(counts_), 0);
+	std::fill(std::begin(times_), std::end(times_), 0);
+	functions_.clear();
+	functionIndex_.clear();
+	lastPrototype_ = nullptr;
+	running_ = false;
+}
+
+void Profiler::detachPrototypes()
+{
+	functionIndex_.clear();
+	lastPrototype_ = nullptr;
+}
+
+uint32_t Profiler::index_(const Prototype& prototype)
+{
+	FunctionIndex_::const_iterator found = functionIndex_.find(&prototype);
+	if (found != functionIndex_.end()) {
+		return found->second;
+	}
+
+	Function_ function;
+	function.code.assign(prototype.code(), prototype.code() + prototype.numInstruction());
+	function.counts.resize(prototype.numInstruction(), 0);
+	for (uint32_t offset = 0; offset < prototype.numInstruction(); offset++) {
+		function.lines.push_back(prototype.line(offset));
+	}
+	functions_.push_back(std::move(function));
+
+	const uint32_t index = static_cast<uint32_t>(functions_.size() - 1);
+	functionIndex_[&prototype] = index;
+	return index;
+}
+
+uint64_t Profiler::numExecuted() const
+{
+	uint64_t total = 0;
+	for (uint32_t opcode = 0; opcode < Instruction::OPCODE_END; opcode++) {
+		total += counts_[opcode];
+	}
+	return total;
+}
+
+uint64_t Profiler::numExecuted(uint32_t opcode) const
+{
+	assert(opcode < Instruction::OPCODE_END);
+	return counts_[opcode];
+}
+
+uint64_t Profiler::numExecuted(const Prototype& prototype, uint32_t offset) const
+{
+	FunctionIndex_::const_iterator found = functionIndex_.find(&prototype);
+	if (found == functionIndex_.end() || offset >= functions_[found->second].counts.size()) {
+		return 0;
+	}
+	return functions_[found->second].counts[offset];
+}
+
+uint64_t Profiler::numExecuted(OpcodeClass opcodeClass) const
+{
+	uint64_t total = 0;
+	for (uint32_t opcode = 0; opcode < Instruction::OPCODE_END; opcode++) {
+		if (Profiler::opcodeClass(opcode) == opcodeClass) {
+			total += counts_[opcode];
+		}
+	}
+	return total;
+}
+
+uint64_t Profiler::time(OpcodeClass opcodeClass) const
+{
+	uint64_t total = 0;
+	for (uint32_t opcode = 0; opcode < Instruction::OPCODE_END; opcode++) {
+		if (Profiler::opcodeClass(opcode) == opcodeClass) {
+			total += times_[opcode];
+		}
+	}
+	return total;
+}
+
+Profiler::OpcodeClass Profiler::opcodeClass(uint32_t opcode)
+{
+	switch (Instruction::generic[opcode]) {
+	case Instruction::GETTABLE:  case Instruction::GETTABLEK: case Instruction::SETTABLE:
+	case Instruction::SETTABLEK: case Instruction::NEWTABLE:  case Instruction::NEWARRAY:
+		return TABLE;
+	case Instruction::ADD:    case Instruction::SUB:    case Instruction::MUL:   case Instruction::DIV:
+	case Instruction::MOD:    case Instruction::UNM:    case Instruction::ADDK:  case Instruction::SUBK:
+	case Instruction::MULK:   case Instruction::DIVK:   case Instruction::MODK:  case Instruction::BITNOT:
+	case Instruction::BITAND: case Instruction::BITOR:  case Instruction::BITXOR:
+	case Instruction::SL:     case Instruction::SR:
+		return ARITHMETIC;
+	case Instruction::NOT:  case Instruction::EQ:     case Instruction::NOTEQ: case Instruction::LT:
+	case Instruction::LE:   case Instruction::EQK:    case Instruction::NOTEQK:
+	case Instruction::LTK:  case Instruction::LEK:    case Instruction::GTK:   case Instruction::GEK:
+		return COMPARE;
+	case Instruction::JUMP: case Instruction::BRANCH: case Instruction::BRANCHNOT:
+	case Instruction::JEQ:  case Instruction::JLT:    case Instruction::JLE:   case Instruction::JEQK:
+	case Instruction::JLTK: case Instruction::JLEK:   case Instruction::JGTK:  case Instruction::JGEK:
+	case Instruction::FORPREP: case Instruction::FORLOOP:
+		return JUMP;
+	case Instruction::NEWFUNC: case Instruction::CALL: case Instruction::TAILCALL:
+	case Instruction::RETURN:  case Instruction::YIELD:
+		return CALL;
+	default:
+		return MOVE;
+	}
+}
+
+const wchar_t* Profiler::className(OpcodeClass opcodeClass)
+{
+	static const wchar_t* const names[] = {
+		L"move", L"table", L"arithmetic", L"compare", L"jump", L"call"
+	};
+	static_assert(sizeof(names) / sizeof(names[0]) == CLASS_END, "every opcode class needs a name");
+
+	assert(opcodeClass < CLASS_END);
+	return names[opcodeClass];
+}
+
+/*
+ * ; 1234567 instructions executed
+ * ; opcode            count        %
+ *   FORLOOP          100000    8.10%
+ * ; class             count        %    time (ms)      %
+ *   jump             200000   16.20%       1.234   20.00%
+ * ; hottest instructions
+ *   function[01] code[05] line 12     FORLOOP     100000    8.10%
+ */
+std::wstring Profiler::report(uint32_t numHottest) const
+{
+	const uint64_t total = numExecuted();
+	std::wstring output;
+
+	Append(output, L"; %llu instructions executed\n", static_cast<unsigned long long>(total));
+
+	std::vector<uint32_t> opcodes;
+	for (uint32_t opcode = 0; opcode < Instruction::OPCODE_END; opcode++) {
+		if (counts_[opcode] != 0) {
+			opcodes.push_back(opcode);
+		}
+	}
+	std::stable_sort(opcodes.begin(), opcodes.end(),
+	                 [this](uint32_t lhs, uint32_t rhs) { return counts_[lhs] > counts_[rhs]; });
+
+	output.append(L"; opcode                count        %\n");
+	for (uint32_t opcode : opcodes) {
+		output.append(L"  ");
+		AppendPadded(output, Instruction::name[opcode], 18);
+		Append(output, L"%12llu %7.2f%%\n", static_cast<unsigned long long>(counts_[opcode]),
+		       Percent(counts_[opcode], total));
+	}
+
+	uint64_t totalTime = 0;
+	for (uint32_t i = 0; i < CLASS_END; i++) {
+		totalTime += time(static_cast<OpcodeClass>(i));
+	}
+
+	output.append(L"; class                 count        %    time (ms)       %\n");
+	for (uint32_t i = 0; i < CLASS_END; i++) {
+		const OpcodeClass opcodeClass = static_cast<OpcodeClass>(i);
+		const uint64_t count = numExecuted(opcodeClass);
+		const uint64_t nanoseconds = time(opcodeClass);
+
+		output.append(L"  ");
+		AppendPadded(output, className(opcodeClass), 18);
+		Append(output, L"%12llu %7.2f%% %12.3f %7.2f%%\n", static_cast<unsigned long long>(count),
+		       Percent(count, total), nanoseconds / 1000000.0, Percent(nanoseconds, totalTime));
+	}
+
+	std::vector<Hit> hits;
+	for (uint32_t i = 0; i < functions_.size(); i++) {
+		for (uint32_t offset = 0; offset < functions_[i].counts.size(); offset++) {
+			if (functions_[i].counts[offset] != 0) {
+				hits.push_back(Hit{ i, offset, functions_[i].counts[offset] });
+			}
+		}
+	}
+	std::stable_sort(hits.begin(), hits.end(), [](const Hit& lhs, const Hit& rhs) { return lhs.count > rhs.count; });
+	if (hits.size() > numHottest) {
+		hits.resize(numHottest);
+	}
+
+	output.append(L"; hottest instructions\n");
+	for (const Hit& hit : hits) {
+		Append(output, L"  function[%02u] code[%02u] line %-6u ", hit.function, hit.offset,
+		       functions_[hit.function].lines[hit.offset]);
+		AppendPadded(output, Instruction::name[Instruction::generic[functions_[hit.function].code[hit.offset].opcode()]], 18);
+		Append(output, L"%12llu %7.2f%%\n", static_cast<unsigned long long>(hit.count), Percent(hit.count, total));
+	}
+
+	return output;
+}
+
+/*
+ * { "total": 1234567,
+ *   "opcodes": { "FORLOOP": 100000, ... },
+ *   "classes": { "jump": { "count": 200000, "time_ns": 1234000 }, ... },
+ *   "functions": [ { "id": 0, "instructions": [ { "offset": 5, "line": 12, "opcode": "FORLOOP", "count": 100000 }, ... ] }, ... ] }
+ */
+std::wstring Profiler::reportJson() const
+{
+	std::wstring output;
+
+	Append(output, L"{\"total\":%llu", static_cast<unsigned long long>(numExecuted()));
+
+	output.append(L",\"opcodes\":{");
+	bool first = true;
+	for (uint32_t opcode = 0; opcode < Instruction::OPCODE_END; opcode++) {
+		if (counts_[opcode] != 0) {
+			output.append(first ? L"\"" : L",\"");
+			output.append(Instruction::name[opcode]);
+			Append(output, L"\":%llu", static_cast<unsigned long long>(counts_[opcode]));
+			first = false;
+		}
+	}
+
+	output.append(L"},\"classes\":{");
+	for (uint32_t i = 0; i < CLASS_END; i++) {
+		const OpcodeClass opcodeClass = static_cast<OpcodeClass>(i);
+
+		output.append(i == 0 ? L"\"" : L",\"");
+		output.append(className(opcodeClass));
+		Append(output, L"\":{\"count\":%llu,\"time_ns\":%llu}",
+		       static_cast<unsigned long long>(numExecuted(opcodeClass)),
+		       static_cast<unsigned long long>(time(opcodeClass)));
+	}
+
+	output.append(L"},\"functions\":[");
+	for (uint32_t i = 0; i < functions_.size(); i++) {
+		const Function_& function = functions_[i];
+
+		Append(output, i == 0 ? L"{\"id\":%u,\"instructions\":[" : L",{\"id\":%u,\"instructions\":[", i);
+		first = true;
+		for (uint32_t offset = 0; offset < function.counts.size(); offset++) {
+			if (function.counts[offset] != 0) {
+				Append(output, first ? L"{\"offset\":%u,\"line\":%u,\"opcode\":\"" : L",{\"offset\":%u,\"line\":%u,\"opcode\":\"",
+				       offset, function.lines[offset]);
+				output.append(Instruction::name[Instruction::generic[function.code[offset].opcode()]]);
+				Append(output, L"\",\"count\":%llu}", static_cast<unsigned long long>(function.counts[offset]));
+				first = false;
+			}
+		}
+		output.append(L"]}");
+	}
+	output.append(L"]}\n");
+
+	return output;
+}
+
+
+
+Sampler::Sampler()
+: numSamples_(0), due_(false), stopping_(false)
+{
+}
+
+Sampler::~Sampler()
+{
+	stop();
+}
+
+void Sampler::start(uint32_t intervalMicroseconds)
+{
+	stop();
+	stopping_ = false;
+
+	thread_ = std::thread([this, intervalMicroseconds]() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		const std::chrono::microseconds interval(intervalMicroseconds);
+
+		while (wakeUp_.wait_for(lock, interval, [this]() { return stopping_; }) == false) {
+			due_.store(true, std::memory_order_relaxed);
+		}
+	});
+}
+
+void Sampler::stop()
+{
+	if (thread_.joinable() == false) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wakeUp_.notify_one();
+	thread_.join();
+	due_.store(false, std::memory_order_relaxed);
+}
+
+void Sampler::reset()
+{
+	stacks_.clear();
+	stack_.clear();
+	numSamples_ = 0;
+}
+
+void Sampler::addFrame(const Prototype& prototype, uint32_t offset)
+{
+	if (stack_.empty() == false) {
+		stack_.append(L";");
+	}
+	if (prototype.lineDefined() == 0) {
+		Append(stack_, L"chunk:%u", prototype.line(offset));
+	} else {
+		Append(stack_, L"function@%u:%u", prototype.lineDefined(), prototype.line(offset));
+	}
+}
+
+void Sampler::endSample()
+{
+	stacks_[stack_]++;
+	stack_.clear();
+	numSamples_++;
+	due_.store(false, std::memory_order_relaxed);
+}
+
+uint64_t Sampler::numSamples() const
+{
+	return numSamples_;
+}
+
+std::wstring Sampler::foldedStacks() const
+{
+	std::wstring output;
+
+	for (auto stack = stacks_.begin(); stack != stacks_.end(); ++stack) {
+		output.append(stack->first);
+		Append(output, L" %llu\n", static_cast<unsigned long long>(stack->second));
+	}
+	return output;
+}
+
+} // namespace "cmm"
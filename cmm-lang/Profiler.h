@@ -0,0 +1,184 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+#include "Instruction.h"
+
+namespace cmm
+{
+
+class Prototype;
+
+// Counts the instructions executed by the interpreter, per opcode and per instruction of each prototype,
+// and measures the time spent in each class of opcodes.
+// Context::loop_ shows every instruction to count() before executing it while the profiler is enabled
+// (Context::enableProfiler). The instructions run as native code (JIT and modules) are not counted,
+// so the JIT is better left off while profiling.
+//
+// A quickened instruction is counted under its quickened opcode, and once more under the generic opcode
+// when its type guard fails, after uncount() has taken the first count back.
+//
+// The profiler keeps a copy of the code of each prototype it has seen, so a report does not look into
+// a prototype which the collector may have freed. detachPrototypes() is called before the collection,
+// then a prototype executed again starts a new entry.
+class Profiler
+{
+public:
+	// The classes of opcodes whose time is measured
+	enum OpcodeClass {
+		MOVE,       // registers, constants, globals and upvalues
+		TABLE,      // indexing and creating of tables and arrays
+		ARITHMETIC, // arithmetic and bitwise operations
+		COMPARE,    // comparisons and NOT
+		JUMP,       // jumps, branches, fused compare-and-jumps and counting loops
+		CALL,       // function creation, calls and returns
+		CLASS_END   // the number of classes, not an actual class
+	};
+
+	explicit             Profiler();
+	                     ~Profiler();
+	                     Profiler(const Profiler&) = delete;
+	const Profiler&      operator=(const Profiler&) = delete;
+
+	void                 count(const Prototype& prototype, uint32_t offset, uint32_t opcode);
+	void                 uncount();
+	void                 pause(); // stops the clock until the next count()
+	void                 reset();
+	void                 detachPrototypes();
+
+	uint64_t             numExecuted() const;
+	uint64_t             numExecuted(uint32_t opcode) const;
+	uint64_t             numExecuted(const Prototype& prototype, uint32_t offset) const; // 0 if it is not seen
+	uint64_t             numExecuted(OpcodeClass opcodeClass) const;
+	uint64_t             time(OpcodeClass opcodeClass) const; // in nanoseconds
+
+	static OpcodeClass   opcodeClass(uint32_t opcode);
+	static const wchar_t* className(OpcodeClass opcodeClass);
+
+	// The report lists the opcodes, the classes and the hottest instructions. A function is identified
+	// by the order it was first executed in, and the JSON report has every instruction executed.
+	std::wstring         report(uint32_t numHottest = 20) const;
+	std::wstring         reportJson() const;
+
+private:
+	typedef std::chrono::steady_clock Clock_;
+
+	struct Function_
+	{
+		std::vector<Instruction>  code;
+		std::vector<uint32_t>     lines;
+		std::vector<uint64_t>     counts; // of each instruction
+	};
+
+	typedef std::vector<Function_> FunctionVector_;
+	typedef std::unordered_map<const Prototype*, uint32_t> FunctionIndex_;
+
+	uint32_t             index_(const Prototype& prototype);
+
+	uint64_t             counts_[Instruction::OPCODE_END];
+	uint64_t             times_[Instruction::OPCODE_END];
+	FunctionVector_      functions_;
+	FunctionIndex_       functionIndex_;     // the entry in functions_ of each prototype seen since detached
+	const Prototype*     lastPrototype_;
+	uint32_t             lastFunction_;
+	uint32_t             lastOffset_;
+	uint32_t             lastOpcode_;
+	Clock_::time_point   lastTime_;
+	bool                 running_;           // the last instruction is still running
+};
+
+inline void Profiler::count(const Prototype& prototype, uint32_t offset, uint32_t opcode)
+{
+	const Clock_::time_point now = Clock_::now();
+
+	if (running_) {
+		times_[lastOpcode_] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - lastTime_).count();
+	}
+	if (&prototype != lastPrototype_) {
+		lastFunction_ = index_(prototype);
+		lastPrototype_ = &prototype;
+	}
+
+	functions_[lastFunction_].counts[offset]++;
+	counts_[opcode]++;
+	lastOffset_ = offset;
+	lastOpcode_ = opcode;
+	lastTime_ = now;
+	running_ = true;
+}
+
+inline void Profiler::uncount()
+{
+	if (running_) {
+		functions_[lastFunction_].counts[lastOffset_]--;
+		counts_[lastOpcode_]--;
+	}
+}
+
+inline void Profiler::pause()
+{
+	if (running_) {
+		times_[lastOpcode_] += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock_::now() - lastTime_).count();
+		running_ = false;
+	}
+}
+
+
+// Samples the call stack of the interpreter at an interval, and counts the samples of each stack.
+// A thread raises a flag at each interval, and Context::loop_ takes the sample at the next call or backward jump,
+// so the interpreter pays for a load and a branch there only. A loop which runs in native code is not sampled.
+//
+// A frame is named after the line its function is defined at and the line it is executing, such as
+// "function@12:15" ("chunk:3" for the code outside functions), and foldedStacks() writes a line per stack
+// such as "chunk:20;function@12:15 42", which is the input of the flame graph tools.
+class Sampler
+{
+public:
+	explicit             Sampler();
+	                     ~Sampler();
+	                     Sampler(const Sampler&) = delete;
+	const Sampler&       operator=(const Sampler&) = delete;
+
+	void                 start(uint32_t intervalMicroseconds);
+	void                 stop();
+	void                 reset();
+	bool                 isDue() const;
+
+	// Context::loop_ gives the frames of a sample from the bottom of the call stack
+	void                 addFrame(const Prototype& prototype, uint32_t offset);
+	void                 endSample();
+
+	uint64_t             numSamples() const;
+	std::wstring         foldedStacks() const;
+
+private:
+	typedef std::map<std::wstring, uint64_t> StackMap_;
+
+	StackMap_                stacks_;    // the number of samples of each stack, which is sorted for the output
+	std::wstring             stack_;     // the stack being sampled
+	uint64_t                 numSamples_;
+	std::atomic<bool>        due_;
+	std::thread              thread_;
+	std::mutex               mutex_;
+	std::condition_variable  wakeUp_;
+	bool                     stopping_;
+};
+
+inline bool Sampler::isDue() const
+{
+	return due_.load(std::memory_order_relaxed);
+}
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
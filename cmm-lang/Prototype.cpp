@@ -1,10 +1,29 @@
 #include "StdAfx.h"
 #include "Prototype.h"
 
+#include "Config.h"
+#include "Jit.h"
+
 
 namespace cmm
 {
 
+namespace
+{
+
+const uint8_t MAX_DEQUICKEN = 4; // an instruction de-quickened this many times stays generic
+
+const int8_t ABSOLUTE_LINE = INT8_MIN;  // the difference of an instruction whose line is kept in absoluteLines_
+const uint32_t MAX_RELATIVE_LINES = 64; // the most differences line() adds up
+
+} // The end of anomymous namespace
+
+
+Prototype::Prototype(ObjectManager* objectManager)
+: Object(objectManager), jitCounter_(0), jitFailed_(false), nativeCode_(nullptr), lineDefined_(0), lastLine_(0)
+{
+}
+
 Prototype::~Prototype()
 {
 }
@@ -24,4 +43,97 @@ void Prototype::forEachObject_(const std::function<void(const Object&)>& func)
 	);
 }
 
+void Prototype::addLine_(uint32_t line)
+{
+	const uint32_t offset = static_cast<uint32_t>(lineDeltas_.size());
+	const uint32_t lastAbsolute = absoluteLines_.empty() ? 0 : absoluteLines_.back().offset;
+	const int64_t delta = static_cast<int64_t>(line) - (lineDeltas_.empty() ? lineDefined_ : lastLine_);
+
+	if (delta <= ABSOLUTE_LINE || delta > INT8_MAX || offset - lastAbsolute >= MAX_RELATIVE_LINES) {
+		AbsoluteLine_ absoluteLine = { offset, line };
+		absoluteLines_.push_back(absoluteLine);
+		lineDeltas_.push_back(ABSOLUTE_LINE);
+	} else {
+		lineDeltas_.push_back(static_cast<int8_t>(delta));
+	}
+	lastLine_ = line;
+}
+
+uint32_t Prototype::line(const uint32_t offset) const
+{
+	if (offset >= lineDeltas_.size()) {
+		return 0;
+	}
+
+	// The last absolute line at or before the offset, then the differences after it
+	auto absoluteLine = std::upper_bound(absoluteLines_.begin(), absoluteLines_.end(), offset,
+		[](uint32_t offset, const AbsoluteLine_& absoluteLine) { return offset < absoluteLine.offset; });
+	uint32_t line = lineDefined_;
+	uint32_t from = 0;
+
+	if (absoluteLine != absoluteLines_.begin()) {
+		--absoluteLine;
+		line = absoluteLine->line;
+		from = absoluteLine->offset + 1;
+	}
+	for (uint32_t i = from; i <= offset; i++) {
+		line += lineDeltas_[i];
+	}
+	return line;
+}
+
+bool Prototype::quicken(const uint32_t offset, const uint32_t opcode)
+{
+	assert(offset < code_.size() && Instruction::generic[opcode] == code_[offset].opcode());
+
+	if (dequickenCount_.empty()) {
+		dequickenCount_.resize(code_.size(), 0);
+	}
+	if (dequickenCount_[offset] >= MAX_DEQUICKEN) {
+		return false;
+	}
+
+	code_[offset].setOpcode(opcode);
+	return true;
+}
+
+void Prototype::dequicken(const uint32_t offset)
+{
+	assert(offset < code_.size() && dequickenCount_.empty() == false);
+
+	code_[offset].setOpcode(Instruction::generic[code_[offset].opcode()]);
+	dequickenCount_[offset]++;
+}
+
+const JitCode* Prototype::compileJit_()
+{
+	if (jitFailed_ || ++jitCounter_ < CMM_JIT_THRESHOLD) {
+		return nullptr;
+	}
+
+	jitCode_.reset(JitCode::compile(*this));
+	jitFailed_ = (jitCode_ == nullptr);
+	return jitCode_.get();
+}
+
+// Defined here, where JitCode is a complete type
+Prototype::LoopTrace::LoopTrace()
+: counter(0), failed(false)
+{
+}
+
+Prototype::LoopTrace::LoopTrace(LoopTrace&& rhs)
+: counter(rhs.counter), failed(rhs.failed), code(std::move(rhs.code))
+{
+}
+
+Prototype::LoopTrace::~LoopTrace()
+{
+}
+
+void Prototype::allocateLoopTraces_()
+{
+	loopTraces_.resize(code_.size());
+}
+
 } // namespace"cmm"
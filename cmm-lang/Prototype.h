@@ -6,6 +6,7 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <memory>
 
 #include "Instruction.h"
 #include "DataType.h"
@@ -15,25 +16,94 @@ namespace cmm
 {
 
 class ObjectManager;
+class JitCode;
 
 class Prototype : public Object
 {
 	friend class CodeGenerator;
+	friend struct Module;
+	friend class Script;
 
 public:
 	uint32_t              functionLevel() const;
 	uint32_t              numArgs() const;
 	uint32_t              localSize() const;
+	uint32_t              numUpValue() const;
                          
 	uint32_t              numPrototype() const;
 	uint32_t              numConstant() const;
 	uint32_t              numInstruction() const;
                          
+	// Tells where NEWFUNC finds an upvalue of a new function
+	struct UpValueInfo
+	{
+		bool      isLocal;  // true : a register of the creating function, false : an upvalue of it
+		uint32_t  index;
+	};
+
 	Ref<Prototype>        localPrototype(const uint32_t index) const;
+	const UpValueInfo&    upValueInfo(const uint32_t index) const;
 	const Variable&       constant(const uint32_t index) const;
 	const Instruction&    instruction(const uint32_t offset) const;
+
+	const Variable*       constants() const;
+	const Instruction*    code() const;
+
+	// The source line of the instruction at the offset, and of the start of the function.
+	// 0 if the line is not known, which is the case for a module generated without the lines.
+	uint32_t              line(const uint32_t offset) const;
+	uint32_t              lineDefined() const;
+
+	// Remembers where GETGLOBAL and SETGLOBAL found the global named by a constant.
+	// The slot is reused while the global table keeps the same version, so the name is not hashed again.
+	struct GlobalCache
+	{
+		GlobalCache() : table(nullptr), version(0), slot(nullptr) {}
+
+		const Table*  table;
+		uint32_t      version;
+		Variable*     slot;     // nullptr if the global does not exist
+	};
+
+	GlobalCache&          globalCache(const uint32_t index);
+
+	// Rewrites the instruction at the offset to a quickened opcode, and back to its generic opcode.
+	// quicken() refuses when the instruction has been de-quickened too many times, since it is polymorphic.
+	bool                  quicken(const uint32_t offset, const uint32_t opcode);
+	void                  dequicken(const uint32_t offset);
+
+	// Replaces a whole instruction, which is used by the load-time passes over the code
+	void                  rewrite(const uint32_t offset, const Instruction& instruction);
+
+	// Counts a call or a backward jump of the prototype, and returns its native code once it is hot.
+	// Returns nullptr while the prototype is cold, and when the JIT can not translate it.
+	const JitCode*        jitCode();
+
+	// The trace of a loop recorded by TraceRecorder, found by the first instruction of the loop
+	struct LoopTrace
+	{
+		LoopTrace();
+		LoopTrace(LoopTrace&& rhs);
+		~LoopTrace();
+
+		uint32_t                  counter; // backward jumps to the loop so far
+		bool                      failed;  // the loop can not be traced
+		std::unique_ptr<JitCode>  code;
+	};
+
+	LoopTrace&            loopTrace(const uint32_t head);
+
+	// The code of a prototype compiled ahead of time (Module.h), which runs from the offset like JitCode::run
+	// and counts the ticks down the same way. nullptr for a prototype compiled at runtime.
+	typedef uint32_t (*NativeCode)(Variable* base, const Variable* constants, uint32_t offset, int32_t* ticks);
+
+	NativeCode            nativeCode() const;
 	
 private:
+	const JitCode*        compileJit_();
+	void                  addLine_(uint32_t line); // the line of the instruction appended last
+	void                  allocateLoopTraces_();
+
 	virtual void          forEachObject_(const std::function<void(const Object&)>& func);
 
 	explicit              Prototype(ObjectManager* objectManager = nullptr);
@@ -45,22 +115,43 @@ private:
 	typedef std::vector<Ref<Prototype>> PrototypeVector_;
 	typedef std::vector<Variable> VariableVector_;
 	typedef std::vector<Instruction> InstructionVector_;
+	typedef std::vector<UpValueInfo> UpValueInfoVector_;
+	typedef std::vector<uint8_t> CounterVector_;
+	typedef std::vector<GlobalCache> GlobalCacheVector_;
+
+	// The lines are kept as the difference from the line of the previous instruction, which mostly fits in a byte.
+	// A difference which does not fit, and every MAX_RELATIVE_LINES-th instruction, has its line kept as is,
+	// so line() adds up a limited number of differences after a binary search.
+	struct AbsoluteLine_
+	{
+		uint32_t  offset;
+		uint32_t  line;
+	};
+
+	typedef std::vector<int8_t> LineDeltaVector_;
+	typedef std::vector<AbsoluteLine_> AbsoluteLineVector_;
 
 	PrototypeVector_      localPrototypes_;
 	VariableVector_       constants_;
 	InstructionVector_    code_;
+	UpValueInfoVector_    upValues_;
+	CounterVector_        dequickenCount_; // per instruction, allocated on the first quickening
+	GlobalCacheVector_    globalCaches_;   // per constant
+	std::unique_ptr<JitCode> jitCode_;
+	uint32_t              jitCounter_;
+	bool                  jitFailed_;
+	std::vector<LoopTrace> loopTraces_;    // per instruction, allocated on the first backward jump
+	NativeCode            nativeCode_;
+	LineDeltaVector_      lineDeltas_;     // per instruction
+	AbsoluteLineVector_   absoluteLines_;  // sorted by the offset
+	uint32_t              lineDefined_;
+	uint32_t              lastLine_;       // the line of the last instruction, the first one is from lineDefined_
 
 	uint32_t              localSize_;
 	uint32_t              functionLevel_;
 	uint32_t              numArgs_;
 };
 
-inline Prototype::Prototype(ObjectManager* objectManager)
-: Object(objectManager)
-{
-}
-
-
 inline uint32_t Prototype::functionLevel() const
 {
 	return functionLevel_;
@@ -76,6 +167,11 @@ inline uint32_t Prototype::localSize() const
 	return localSize_;
 }
 
+inline uint32_t Prototype::numUpValue() const
+{
+	return upValues_.size();
+}
+
 inline uint32_t Prototype::numPrototype() const
 {
 	return localPrototypes_.size();
@@ -96,6 +192,12 @@ inline Ref<Prototype> Prototype::localPrototype(const uint32_t index) const
 	return localPrototypes_[index];
 }
 
+inline const Prototype::UpValueInfo& Prototype::upValueInfo(const uint32_t index) const
+{
+	assert(index >= 0 && index < upValues_.size());
+	return upValues_[index];
+}
+
 inline const Variable& Prototype::constant(const uint32_t index) const
 {
 	return constants_[index];
@@ -107,6 +209,52 @@ inline const Instruction& Prototype::instruction(const uint32_t offset) const
 	return code_[offset];
 }
 
+inline const Variable* Prototype::constants() const
+{
+	return constants_.data();
+}
+
+inline const Instruction* Prototype::code() const
+{
+	return code_.data();
+}
+
+inline void Prototype::rewrite(const uint32_t offset, const Instruction& instruction)
+{
+	assert(offset < code_.size());
+	code_[offset] = instruction;
+}
+
+inline uint32_t Prototype::lineDefined() const
+{
+	return lineDefined_;
+}
+
+inline const JitCode* Prototype::jitCode()
+{
+	return (jitCode_ != nullptr) ? jitCode_.get() : compileJit_();
+}
+
+inline Prototype::LoopTrace& Prototype::loopTrace(const uint32_t head)
+{
+	assert(head < code_.size());
+	if (loopTraces_.empty()) {
+		allocateLoopTraces_();
+	}
+	return loopTraces_[head];
+}
+
+inline Prototype::NativeCode Prototype::nativeCode() const
+{
+	return nativeCode_;
+}
+
+inline Prototype::GlobalCache& Prototype::globalCache(const uint32_t index)
+{
+	assert(index < globalCaches_.size());
+	return globalCaches_[index];
+}
+
 } // namespace "cmm"
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cstdint>
 #include <cwchar>
+#include <cwctype>
 #include <cstdio>
 
 #include "Error.h"
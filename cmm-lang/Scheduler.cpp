@@ -0,0 +1,306 @@
+#include "StdAfx.h"
+#include "Scheduler.h"
+
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <string>
+
+#include "Context.h"
+#include "Error.h"
+#include "Script.h"
+
+namespace cmm
+{
+
+Scheduler::Scheduler(uint32_t numThreads, uint32_t sliceTicks)
+: sliceTicks_(sliceTicks), nextWorker_(0), numQueued_(0), numSubmitted_(0), numFinished_(0), stopping_(false)
+{
+	if (numThreads == 0) {
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	// Every deque is in place before a thread can steal from it
+	for (uint32_t i = 0; i < numThreads; i++) {
+		std::unique_ptr<Worker_> worker(new Worker_());
+		worker->numFailed = 0;
+		worker->startedTurn = false;
+		worker->numSlices = 0;
+		worker->numSteals = 0;
+		workers_.push_back(std::move(worker));
+	}
+	for (uint32_t i = 0; i < numThreads; i++) {
+		workers_[i]->thread = std::thread([this, i]() { work_(i); });
+	}
+}
+
+Scheduler::~Scheduler()
+{
+	wait();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wakeUp_.notify_all();
+
+	std::for_each(workers_.begin(), workers_.end(), [](std::unique_ptr<Worker_>& worker) {
+		worker->thread.join();
+	});
+}
+
+// The tasks are spread over the deques in turn, and the idle threads steal them from there
+void Scheduler::submit(Task task)
+{
+	if (task.script.get() == nullptr) {
+		throw Error(L"a task needs a script");
+	}
+
+	TaskPtr_ queued(new Task_());
+	queued->task = std::move(task);
+	queued->step = Task_::LOAD;
+	queued->submitted = Clock_::now();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (numSubmitted_ == 0) {
+			started_ = queued->submitted;
+		}
+		numSubmitted_++;
+	}
+	push_(nextWorker_++ % workers_.size(), std::move(queued));
+}
+
+void Scheduler::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	finished_.wait(lock, [this]() { return numFinished_ == numSubmitted_; });
+}
+
+uint32_t Scheduler::numThreads() const
+{
+	return static_cast<uint32_t>(workers_.size());
+}
+
+Scheduler::Statistics Scheduler::statistics() const
+{
+	Statistics statistics = {};
+	std::vector<double> latencies;
+
+	std::for_each(workers_.begin(), workers_.end(), [&](const std::unique_ptr<Worker_>& worker) {
+		std::lock_guard<std::mutex> lock(worker->mutex);
+		latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+		statistics.numFailed += worker->numFailed;
+		statistics.numSlices += worker->numSlices.load(std::memory_order_relaxed);
+		statistics.numSteals += worker->numSteals.load(std::memory_order_relaxed);
+	});
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		statistics.numSubmitted = numSubmitted_;
+		statistics.numFinished = numFinished_;
+		if (numFinished_ != 0) {
+			const double seconds = std::chrono::duration<double>(lastFinished_ - started_).count();
+			statistics.throughput = (seconds > 0.0) ? numFinished_ / seconds : 0.0;
+		}
+	}
+
+	if (latencies.empty() == false) {
+		std::sort(latencies.begin(), latencies.end());
+		const size_t last = latencies.size() - 1;
+		double sum = 0.0;
+
+		std::for_each(latencies.begin(), latencies.end(), [&sum](double latency) { sum += latency; });
+		statistics.meanLatency = sum / latencies.size();
+		statistics.medianLatency = latencies[last / 2];
+		statistics.p99Latency = latencies[last * 99 / 100];
+		statistics.maxLatency = latencies[last];
+	}
+	return statistics;
+}
+
+
+void Scheduler::work_(uint32_t index)
+{
+	Worker_& worker = *workers_[index];
+
+	for (;;) {
+		TaskPtr_ task = next_(index);
+
+		if (task.get() == nullptr) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			wakeUp_.wait(lock, [this]() { return numQueued_.load() != 0 || stopping_; });
+			if (stopping_) {
+				return; // stopped by the destructor once every task is finished
+			}
+			continue;
+		}
+
+		// Anything thrown by the task or its callbacks is kept from the thread, which would terminate the process
+		bool finished;
+		worker.numSlices.fetch_add(1, std::memory_order_relaxed);
+
+		try {
+			finished = runSlice_(*task);
+		} catch (Error& error) {
+			finish_(worker, *task, &error);
+			continue;
+		} catch (std::exception& exception) {
+			const std::string message(exception.what());
+			const Error error(L"%ls", std::wstring(message.begin(), message.end()).c_str());
+			finish_(worker, *task, &error);
+			continue;
+		} catch (...) {
+			const Error error(L"unknown exception");
+			finish_(worker, *task, &error);
+			continue;
+		}
+
+		if (finished) {
+			finish_(worker, *task, nullptr);
+		} else {
+			worker.started.push_back(std::move(task));
+		}
+	}
+}
+
+// Takes turns between the started tasks and the new ones, so that neither holds up the other,
+// and steals a new task if the thread has none of either
+Scheduler::TaskPtr_ Scheduler::next_(uint32_t index)
+{
+	Worker_& worker = *workers_[index];
+	TaskPtr_ task;
+
+	worker.startedTurn = !worker.startedTurn;
+	if (worker.startedTurn == false || worker.started.empty()) {
+		task = pop_(index);
+	}
+	if (task.get() == nullptr && worker.started.empty() == false) {
+		task = std::move(worker.started.front());
+		worker.started.pop_front();
+	}
+	if (task.get() == nullptr) {
+		task = steal_(index);
+	}
+	return task;
+}
+
+void Scheduler::push_(uint32_t index, TaskPtr_ task)
+{
+	Worker_& worker = *workers_[index];
+
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+		numQueued_++;
+	}
+
+	// The idle threads check numQueued_ under the lock, so they can not miss the wake up between the check and the wait
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+	}
+	wakeUp_.notify_one();
+}
+
+Scheduler::TaskPtr_ Scheduler::pop_(uint32_t index)
+{
+	Worker_& worker = *workers_[index];
+	std::lock_guard<std::mutex> lock(worker.mutex);
+
+	if (worker.tasks.empty()) {
+		return nullptr;
+	}
+
+	TaskPtr_ task = std::move(worker.tasks.front());
+	worker.tasks.pop_front();
+	numQueued_--;
+	return task;
+}
+
+// Tries the other deques in turn, starting next to its own so that the thieves spread over the victims
+Scheduler::TaskPtr_ Scheduler::steal_(uint32_t index)
+{
+	const uint32_t numWorkers = static_cast<uint32_t>(workers_.size());
+
+	for (uint32_t i = 1; i < numWorkers; i++) {
+		Worker_& victim = *workers_[(index + i) % numWorkers];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+
+		if (victim.tasks.empty() == false) {
+			TaskPtr_ task = std::move(victim.tasks.back());
+			victim.tasks.pop_back();
+			numQueued_--;
+			workers_[index]->numSteals.fetch_add(1, std::memory_order_relaxed);
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+// Runs the task for a slice of ticks, and returns true if it is finished. The context is created at the first turn,
+// then the task goes through its steps until the budget suspends it.
+bool Scheduler::runSlice_(Task_& task)
+{
+	if (task.context.get() == nullptr) {
+		task.context.reset(new Context());
+		if (task.task.setUp) {
+			task.task.setUp(*task.context);
+		}
+	}
+
+	Context& context = *task.context;
+	context.setBudget(sliceTicks_, 0, true);
+
+	if (context.isSuspended()) {
+		context.resume();
+	}
+
+	while (context.isSuspended() == false && task.step != Task_::DONE) {
+		if (task.step == Task_::LOAD) {
+			task.step = Task_::CALL;
+			context.load(task.task.script);
+			context.run(0, 0);
+		} else {
+			task.step = Task_::DONE;
+			if (task.task.call) {
+				context.clear();
+				task.task.call(context);
+				context.run(context.stackSize() - 1, 1);
+			}
+		}
+	}
+	return context.isSuspended() == false;
+}
+
+void Scheduler::finish_(Worker_& worker, Task_& task, const Error* error)
+{
+	bool failed = (error != nullptr);
+
+	if (task.task.done && task.context.get() != nullptr) {
+		try {
+			task.task.done(*task.context, error);
+		} catch (...) {
+			failed = true;
+		}
+	}
+	task.context.reset();
+
+	const Clock_::time_point now = Clock_::now();
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.latencies.push_back(std::chrono::duration<double, std::micro>(now - task.submitted).count());
+		if (failed) {
+			worker.numFailed++;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	numFinished_++;
+	lastFinished_ = now;
+	if (numFinished_ == numSubmitted_) {
+		finished_.notify_all();
+	}
+}
+
+} // namespace "cmm"
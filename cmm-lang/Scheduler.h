@@ -0,0 +1,133 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Config.h"
+
+namespace cmm
+{
+
+class Context;
+class Error;
+class Script;
+
+// Runs many small script tasks on a fixed pool of threads. Each task runs in a context of its own, which is
+// created when the task starts and destroyed when it ends, so the tasks share nothing but their script (Script.h).
+// A task runs for a slice of ticks at a turn (Context::setBudget), then it is suspended and queued again,
+// so a long task does not hold up the short ones behind it.
+//
+// Every thread has a deque of the tasks which are not started yet, and a queue of its suspended tasks. A thread takes
+// turns between the oldest task of either, and a thread which has neither steals the newest task from the deque of
+// another. The suspended tasks are never stolen, so a context stays on the thread which has created it, and a new task
+// is handed over by the lock of the deque. A task which throws anything is finished as failed, so is a task whose
+// done callback throws.
+class Scheduler
+{
+public:
+	// The callbacks are called on the threads of the scheduler, and any of them can be empty.
+	// setUp registers the C functions before the script is loaded. When the script has run, call places
+	// a function and its arguments on the communication stack to be run with one result; without it, the task
+	// is the script alone. done finds the result on the communication stack, or gets the error which has
+	// stopped the task.
+	struct Task
+	{
+		std::shared_ptr<const Script>                script;
+		std::function<void(Context&)>                setUp;
+		std::function<void(Context&)>                call;
+		std::function<void(Context&, const Error*)>  done;
+	};
+
+	// The latencies are from the submission of the tasks to their end, in microseconds
+	struct Statistics
+	{
+		uint64_t  numSubmitted;
+		uint64_t  numFinished;    // including the failed ones
+		uint64_t  numFailed;
+		uint64_t  numSlices;      // the turns the tasks have run
+		uint64_t  numSteals;
+		double    throughput;     // the finished tasks per second, since the first submission
+		double    meanLatency;
+		double    medianLatency;
+		double    p99Latency;
+		double    maxLatency;
+	};
+
+	// numThreads is the number of the hardware threads if it is 0
+	explicit             Scheduler(uint32_t numThreads = 0, uint32_t sliceTicks = CMM_SCHEDULER_SLICE);
+	                     ~Scheduler(); // waits for the tasks
+	                     Scheduler(const Scheduler&) = delete;
+	const Scheduler&     operator=(const Scheduler&) = delete;
+
+	void                 submit(Task task);
+	void                 wait(); // until every task submitted so far is finished
+
+	uint32_t             numThreads() const;
+	Statistics           statistics() const;
+
+private:
+	typedef std::chrono::steady_clock Clock_;
+
+	struct Task_
+	{
+		enum Step {
+			LOAD,
+			CALL,
+			DONE
+		};
+
+		Task                      task;
+		std::unique_ptr<Context>  context;
+		Step                      step;
+		Clock_::time_point        submitted;
+	};
+
+	typedef std::unique_ptr<Task_> TaskPtr_;
+
+	struct Worker_
+	{
+		std::deque<TaskPtr_>   tasks;        // not started yet, and stolen from the back
+		std::vector<double>    latencies;
+		uint64_t               numFailed;
+		mutable std::mutex     mutex;        // guards the members above
+		std::deque<TaskPtr_>   started;      // suspended, used by the thread alone like the members below
+		bool                   startedTurn;  // whether the next turn is of a started task
+		std::atomic<uint64_t>  numSlices;
+		std::atomic<uint64_t>  numSteals;
+		std::thread            thread;
+	};
+
+	void                 work_(uint32_t index);
+	TaskPtr_             next_(uint32_t index);
+	void                 push_(uint32_t index, TaskPtr_ task);
+	TaskPtr_             pop_(uint32_t index);
+	TaskPtr_             steal_(uint32_t index);
+	bool                 runSlice_(Task_& task);
+	void                 finish_(Worker_& worker, Task_& task, const Error* error);
+
+	const uint32_t                         sliceTicks_;
+	std::vector<std::unique_ptr<Worker_>>  workers_;
+	std::atomic<uint32_t>                  nextWorker_;  // the deque of the next submission
+	std::atomic<uint64_t>                  numQueued_;   // the tasks in the deques, which are not started yet
+	mutable std::mutex                     mutex_;       // guards the members below
+	std::condition_variable                wakeUp_;      // for the idle threads
+	std::condition_variable                finished_;    // for wait()
+	uint64_t                               numSubmitted_;
+	uint64_t                               numFinished_;
+	Clock_::time_point                     started_;     // the first submission
+	Clock_::time_point                     lastFinished_;
+	bool                                   stopping_;
+};
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
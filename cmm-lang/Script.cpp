@@ -0,0 +1,87 @@
+#include "StdAfx.h"
+#include "Script.h"
+
+#include <cassert>
+#include <cstdint>
+
+#include "Compiler.h"
+#include "DataType.h"
+#include "Prototype.h"
+
+namespace cmm
+{
+
+Script::Script(const wchar_t code[])
+: heap_(), numStrings_(0)
+{
+	Compiler compiler(heap_);
+	StringMap_ strings;
+
+	main_ = compiler.compile(code, false, false);
+	intern_(*main_, strings);
+	numStrings_ = static_cast<uint32_t>(strings.size());
+	strings.clear();
+
+	heap_.freeze();
+}
+
+Script::~Script()
+{
+}
+
+Ref<Prototype> Script::instantiate(ObjectManager& objectManager) const
+{
+	return instantiate_(*main_, objectManager);
+}
+
+uint32_t Script::numStrings() const
+{
+	return numStrings_;
+}
+
+// Replaces each string constant with the first string of the same value, so the others are freed before freezing
+void Script::intern_(Prototype& prototype, StringMap_& strings)
+{
+	for (auto& constant : prototype.constants_) {
+		if (constant.t != TypeString) {
+			continue;
+		}
+
+		const std::wstring& value = static_cast<String*>(constant.v.obj)->value();
+		auto string = strings.find(value);
+		if (string == strings.end()) {
+			strings.insert(std::make_pair(value, constant));
+		} else {
+			constant = string->second;
+		}
+	}
+
+	for (auto& localPrototype : prototype.localPrototypes_) {
+		intern_(*localPrototype, strings);
+	}
+}
+
+// Only what the code generator creates is copied, and the rest of the state starts over as in a new prototype
+Ref<Prototype> Script::instantiate_(const Prototype& frozen, ObjectManager& objectManager)
+{
+	Ref<Prototype> prototype = Ref<Prototype>(new Prototype(&objectManager));
+
+	prototype->constants_ = frozen.constants_;
+	prototype->code_ = frozen.code_;
+	prototype->upValues_ = frozen.upValues_;
+	prototype->lineDeltas_ = frozen.lineDeltas_;
+	prototype->absoluteLines_ = frozen.absoluteLines_;
+	prototype->lineDefined_ = frozen.lineDefined_;
+	prototype->lastLine_ = frozen.lastLine_;
+	for (const auto& localPrototype : frozen.localPrototypes_) {
+		prototype->localPrototypes_.push_back(instantiate_(*localPrototype, objectManager));
+	}
+
+	prototype->globalCaches_.resize(prototype->constants_.size());
+	prototype->localSize_ = frozen.localSize_;
+	prototype->functionLevel_ = frozen.functionLevel_;
+	prototype->numArgs_ = frozen.numArgs_;
+	return prototype;
+}
+
+} // namespace "cmm"
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "Object.h"
+#include "Memory.h"
+
+namespace cmm
+{
+
+class Prototype;
+
+// A script compiled once, which any number of contexts load on any threads (Context::load).
+// The compiled prototypes and their constants are kept in a heap of their own, and the string constants
+// are interned across the prototypes, then the heap is frozen (ObjectManager::freeze). A context loads
+// the script by creating its prototypes from the frozen ones like it does for a module (Module.h): the code
+// is copied, since the quickening, the linking of globals and the native code are of each context,
+// while the constants still refer to the frozen strings.
+// The script is read only after it is created, so it can be shared without a lock, and it has to
+// outlive the contexts which have loaded it, which is what Context::load keeps a shared_ptr for.
+class Script
+{
+public:
+	explicit              Script(const wchar_t code[]);
+	                      ~Script();
+	                      Script(const Script&) = delete;
+	const Script&         operator=(const Script&) = delete;
+
+	// Creates the prototype of the main function, and its local prototypes
+	Ref<Prototype>        instantiate(ObjectManager& objectManager) const;
+
+	uint32_t              numStrings() const; // the distinct string constants
+
+private:
+	typedef std::unordered_map<std::wstring, Variable> StringMap_;
+
+	void                  intern_(Prototype& prototype, StringMap_& strings);
+	static Ref<Prototype> instantiate_(const Prototype& frozen, ObjectManager& objectManager);
+
+	ObjectManager         heap_;
+	Ref<Prototype>        main_;
+	uint32_t              numStrings_;
+};
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
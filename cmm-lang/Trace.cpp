@@ -0,0 +1,394 @@
+#include "StdAfx.h"
+#include "Trace.h"
+
+#include <cassert>
+#include <cstdint>
+
+#include "Config.h"
+#include "Prototype.h"
+#include "Instruction.h"
+#include "Jit.h"
+
+namespace cmm
+{
+
+namespace // Anonymous namespace for utility functions only for the trace recorder
+{
+
+const size_t MAX_TRACE_LENGTH = 500; // the number of instructions a trace can have
+const int8_t UNKNOWN = -1;
+const uint32_t NUM_REGISTERS = Instruction::MAX_A + 1;
+
+inline bool IsObject(Type type)
+{
+	return type > TypeCFunc;
+}
+
+// Whether operand C of the opcode is K(C) instead of R(C)
+inline bool IsConstantC(uint32_t opcode)
+{
+	switch (opcode) {
+	case Instruction::GETTABLEK: case Instruction::SETTABLEK:
+	case Instruction::ADDK: case Instruction::SUBK: case Instruction::MULK: case Instruction::DIVK: case Instruction::MODK:
+	case Instruction::EQK: case Instruction::NOTEQK: case Instruction::LTK: case Instruction::LEK:
+	case Instruction::GTK: case Instruction::GEK:
+	case Instruction::JEQK: case Instruction::JLTK: case Instruction::JLEK: case Instruction::JGTK: case Instruction::JGEK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether operand C of the opcode is R(C), which is not for the step of FORPREP and FORLOOP
+inline bool IsRegisterC(uint32_t opcode)
+{
+	return IsConstantC(opcode) == false && opcode != Instruction::FORPREP && opcode != Instruction::FORLOOP;
+}
+
+inline Trace::Operator OperatorOf(uint32_t opcode)
+{
+	switch (opcode) {
+	case Instruction::ADD: case Instruction::ADDK: return Trace::ADD;
+	case Instruction::SUB: case Instruction::SUBK: return Trace::SUB;
+	case Instruction::MUL: case Instruction::MULK: return Trace::MUL;
+	case Instruction::DIV: case Instruction::DIVK: return Trace::DIV;
+	case Instruction::MOD: case Instruction::MODK: return Trace::MOD;
+	case Instruction::EQ: case Instruction::EQK: case Instruction::JEQ: case Instruction::JEQK: return Trace::EQ;
+	case Instruction::NOTEQ: case Instruction::NOTEQK: return Trace::NOTEQ;
+	case Instruction::LT: case Instruction::LTK: case Instruction::JLT: case Instruction::JLTK: return Trace::LT;
+	case Instruction::LE: case Instruction::LEK: case Instruction::JLE: case Instruction::JLEK: return Trace::LE;
+	case Instruction::GTK: case Instruction::JGTK: return Trace::GT;
+	default: return Trace::GE;
+	}
+}
+
+} // The end of anomymous namespace
+
+
+TraceRecorder::TraceRecorder()
+: prototype_(nullptr), base_(nullptr), head_(0)
+{
+}
+
+void TraceRecorder::start(Prototype& prototype, const Variable* base, uint32_t head)
+{
+	assert(isRecording() == false);
+
+	prototype_ = &prototype;
+	base_ = base;
+	head_ = head;
+	steps_.clear();
+}
+
+// The loop is not recorded again, and the baseline JIT takes it
+void TraceRecorder::abort()
+{
+	if (isRecording()) {
+		prototype_->loopTrace(head_).failed = true;
+		prototype_ = nullptr;
+	}
+}
+
+bool TraceRecorder::record(const Prototype* prototype, const Variable* base, uint32_t offset)
+{
+	assert(isRecording());
+
+	if (prototype != prototype_ || base != base_) {
+		abort(); // the frame of the loop has been left
+		return false;
+	}
+
+	if (steps_.empty() == false) {
+		if (steps_.back().offset == offset) {
+			return true; // dispatched again after the de-quickening
+		}
+		steps_.back().next = offset;
+
+		if (offset == head_) {
+			finish_();
+			return false;
+		}
+	}
+
+	const Instruction& inst = prototype_->instruction(offset);
+	if (steps_.size() >= MAX_TRACE_LENGTH || traceable_(inst, offset) == false) {
+		abort();
+		return false;
+	}
+
+	// Only the registers named by the instruction are looked at, since K(C) may be out of the frame
+	const uint32_t opcode = Instruction::generic[inst.opcode()];
+	Step_ step;
+	step.offset = offset;
+	step.next = offset;
+	step.types[0] = step.types[1] = step.types[2] = TypeNull;
+
+	switch (Instruction::type[opcode]) {
+	case Instruction::THREE_OP:
+		if (IsRegisterC(opcode)) { step.types[2] = base[inst.c()].t; }
+		// fall through
+	case Instruction::TWO_OP:
+		step.types[1] = base[inst.b()].t;
+		// fall through
+	case Instruction::ONE_OP:
+	case Instruction::WIDE_OP:
+	case Instruction::BRANCH_OP:
+		step.types[0] = base[inst.a()].t;
+		break;
+	default:
+		break;
+	}
+
+	steps_.push_back(step);
+	return true;
+}
+
+bool TraceRecorder::traceable_(const Instruction& inst, uint32_t offset) const
+{
+	int32_t target;
+
+	switch (Instruction::generic[inst.opcode()]) {
+	case Instruction::ASSIGN:    case Instruction::GETCONST:
+	case Instruction::GETTABLE:  case Instruction::GETTABLEK:
+	case Instruction::SETTABLE:  case Instruction::SETTABLEK:
+	case Instruction::ADD:  case Instruction::SUB:  case Instruction::MUL:  case Instruction::DIV:  case Instruction::MOD:
+	case Instruction::UNM:
+	case Instruction::ADDK: case Instruction::SUBK: case Instruction::MULK: case Instruction::DIVK: case Instruction::MODK:
+	case Instruction::EQ:   case Instruction::NOTEQ: case Instruction::LT:  case Instruction::LE:
+	case Instruction::EQK:  case Instruction::NOTEQK: case Instruction::LTK: case Instruction::LEK:
+	case Instruction::GTK:  case Instruction::GEK:
+		return true;
+
+	// A backward jump to anywhere but the head belongs to an inner loop, which would be unrolled
+	case Instruction::JUMP:
+		target = offset + inst.sax();
+		break;
+	case Instruction::BRANCH: case Instruction::BRANCHNOT:
+		target = offset + inst.sbx();
+		break;
+	case Instruction::JEQ:  case Instruction::JLT:  case Instruction::JLE:
+	case Instruction::JEQK: case Instruction::JLTK: case Instruction::JLEK: case Instruction::JGTK: case Instruction::JGEK:
+	case Instruction::FORPREP: case Instruction::FORLOOP:
+		target = offset + 1 + prototype_->instruction(offset + 1).sax();
+		break;
+
+	default:
+		return false; // calls, upvalues, globals, object creation and bit operations
+	}
+
+	return target > static_cast<int32_t>(offset) || target == static_cast<int32_t>(head_);
+}
+
+void TraceRecorder::finish_()
+{
+	Trace trace;
+	trace.head = head_;
+	trace.loopStart = 0;
+
+	TypeMap_ known(NUM_REGISTERS, UNKNOWN);
+	bool traced = emit_(trace.nodes, known);
+
+	if (traced) {
+		// The loop body assumes the types known after the peeled iteration.
+		// If an iteration can change one of them, the loop goes back to the peeled iteration instead.
+		const TypeMap_ entry = known;
+		const size_t loopStart = trace.nodes.size();
+		emit_(trace.nodes, known);
+
+		bool stable = true;
+		for (uint32_t i = 0; i < NUM_REGISTERS; i++) {
+			if (entry[i] != UNKNOWN && entry[i] != known[i]) {
+				stable = false;
+			}
+		}
+		if (stable) {
+			trace.loopStart = static_cast<uint32_t>(loopStart);
+		} else {
+			trace.nodes.erase(trace.nodes.begin() + loopStart, trace.nodes.end());
+		}
+		trace.nodes.push_back(Trace::Node(Trace::LOOP, 0, 0, 0, head_));
+	}
+
+	Prototype::LoopTrace& loopTrace = prototype_->loopTrace(head_);
+	if (traced) {
+		loopTrace.code.reset(JitCode::compile(*prototype_, trace));
+	}
+	loopTrace.failed = (loopTrace.code == nullptr);
+	prototype_ = nullptr;
+}
+
+// Translates the recorded steps to nodes, starting with the types known in advance.
+// Returns false if the types observed on the way can not be specialized.
+bool TraceRecorder::emit_(Trace::NodeVector& nodes, TypeMap_& known) const
+{
+	auto guard = [&nodes, &known](uint32_t reg, Type type, uint32_t exit) {
+		if (known[reg] != type) {
+			nodes.push_back(Trace::Node(Trace::GUARD_TYPE, reg, type, 0, exit));
+			known[reg] = type;
+		}
+	};
+	// The register to be overwritten should not hold an object, which would have to be released
+	auto guardDest = [&nodes, &known](uint32_t reg, uint32_t exit) {
+		if (known[reg] == UNKNOWN) {
+			nodes.push_back(Trace::Node(Trace::GUARD_NOTOBJECT, reg, 0, 0, exit));
+		}
+	};
+	auto write = [&nodes, &known](Trace::Node node, Type type) {
+		node.storeType = (known[node.a] != type);
+		nodes.push_back(node);
+		known[node.a] = type;
+	};
+
+	for (auto step = steps_.begin(); step != steps_.end(); step++) {
+		const Instruction& inst = prototype_->instruction(step->offset);
+		const uint32_t opcode = Instruction::generic[inst.opcode()];
+		const uint32_t exit = step->offset;
+		const bool isConstant = IsConstantC(opcode);
+		const Type typeA = step->types[0];
+		const Type typeB = step->types[1];
+		const Type typeC = isConstant ? prototype_->constant(inst.c()).t : step->types[2];
+
+		switch (opcode) {
+		case Instruction::ASSIGN:
+			if (IsObject(typeA) || IsObject(typeB)) {
+				nodes.push_back(Trace::Node(Trace::MOVE_OBJECT, inst.a(), inst.b(), 0, exit));
+				known[inst.a()] = known[inst.b()];
+			} else {
+				guard(inst.b(), typeB, exit);
+				guardDest(inst.a(), exit);
+				write(Trace::Node(Trace::MOVE, inst.a(), inst.b(), 0, exit), typeB);
+			}
+			break;
+
+		case Instruction::GETCONST: {
+			const Type typeK = prototype_->constant(inst.bx()).t;
+			if (IsObject(typeA) || IsObject(typeK)) {
+				nodes.push_back(Trace::Node(Trace::LOADK_OBJECT, inst.a(), inst.bx(), 0, exit));
+				known[inst.a()] = IsObject(typeK) ? UNKNOWN : typeK;
+			} else {
+				guardDest(inst.a(), exit);
+				write(Trace::Node(Trace::LOADK, inst.a(), inst.bx(), 0, exit), typeK);
+			}
+			break;
+		}
+
+		case Instruction::ADD:  case Instruction::SUB:  case Instruction::MUL:  case Instruction::DIV:  case Instruction::MOD:
+		case Instruction::ADDK: case Instruction::SUBK: case Instruction::MULK: case Instruction::DIVK: case Instruction::MODK:
+		case Instruction::EQ:   case Instruction::NOTEQ: case Instruction::LT:  case Instruction::LE:
+		case Instruction::EQK:  case Instruction::NOTEQK: case Instruction::LTK: case Instruction::LEK:
+		case Instruction::GTK:  case Instruction::GEK: {
+			const Trace::Operator op = OperatorOf(opcode);
+			const bool isCompare = (op >= Trace::EQ);
+			// Mixed operands and strings are left to the interpreter, and so is the float equality for its NaN
+			if (typeB != typeC || IsObject(typeA) || (typeB != TypeInt && typeB != TypeFloat)) { return false; }
+			if (typeB == TypeFloat && (op == Trace::MOD || op == Trace::EQ || op == Trace::NOTEQ)) { return false; }
+
+			guard(inst.b(), typeB, exit);
+			if (isConstant == false) { guard(inst.c(), typeC, exit); }
+			guardDest(inst.a(), exit);
+
+			Trace::Node node(isCompare ? (typeB == TypeInt ? Trace::COMPARE_INT : Trace::COMPARE_FLOAT)
+			                           : (typeB == TypeInt ? Trace::ARITH_INT : Trace::ARITH_FLOAT),
+			                 inst.a(), inst.b(), inst.c(), exit);
+			node.op = op;
+			node.constant = isConstant;
+			write(node, isCompare ? TypeInt : typeB);
+			break;
+		}
+
+		case Instruction::UNM:
+			if ((typeB != TypeInt && typeB != TypeFloat) || IsObject(typeA)) { return false; }
+			guard(inst.b(), typeB, exit);
+			guardDest(inst.a(), exit);
+			write(Trace::Node((typeB == TypeInt) ? Trace::NEG_INT : Trace::NEG_FLOAT, inst.a(), inst.b(), 0, exit), typeB);
+			break;
+
+		case Instruction::JUMP:
+			break; // the trace simply goes on
+
+		case Instruction::BRANCH:
+		case Instruction::BRANCHNOT: {
+			const uint32_t target = step->offset + inst.sbx();
+			if (target == step->offset + 1) { break; }
+			if (typeA != TypeInt) { return false; }
+
+			const bool taken = (step->next == target);
+			guard(inst.a(), TypeInt, exit);
+			Trace::Node node(Trace::TEST_TRUTH, inst.a(), 0, 0, taken ? step->offset + 1 : target);
+			node.expect = (opcode == Instruction::BRANCH) ? taken : !taken;
+			nodes.push_back(node);
+			break;
+		}
+
+		case Instruction::JEQ:  case Instruction::JLT:  case Instruction::JLE:
+		case Instruction::JEQK: case Instruction::JLTK: case Instruction::JLEK: case Instruction::JGTK: case Instruction::JGEK: {
+			const uint32_t target = step->offset + 1 + prototype_->instruction(step->offset + 1).sax();
+			if (target == step->offset + 2) { break; }
+
+			const Trace::Operator op = OperatorOf(opcode);
+			if (typeB != typeC || (typeB != TypeInt && typeB != TypeFloat) || (typeB == TypeFloat && op == Trace::EQ)) {
+				return false;
+			}
+
+			// The jump is taken when the result of the comparison is same as A
+			const bool taken = (step->next == target);
+			guard(inst.b(), typeB, exit);
+			if (isConstant == false) { guard(inst.c(), typeC, exit); }
+			Trace::Node node((typeB == TypeInt) ? Trace::TEST_INT : Trace::TEST_FLOAT,
+			                 0, inst.b(), inst.c(), taken ? step->offset + 2 : target);
+			node.op = op;
+			node.constant = isConstant;
+			node.expect = (taken == (inst.a() != 0));
+			nodes.push_back(node);
+			break;
+		}
+
+		// FORLOOP steps the counter, then both jump on the comparison of the counter and the limit
+		case Instruction::FORPREP:
+		case Instruction::FORLOOP: {
+			const uint32_t target = step->offset + 1 + prototype_->instruction(step->offset + 1).sax();
+			if (typeA != TypeInt || typeB != TypeInt) { return false; }
+
+			const bool taken = (step->next == target);
+			guard(inst.a(), TypeInt, exit);
+			guard(inst.b(), TypeInt, exit);
+			if (opcode == Instruction::FORLOOP) {
+				write(Trace::Node(Trace::STEP_INT, inst.a(), 0, static_cast<uint32_t>(inst.forStep()), exit), TypeInt);
+			}
+			Trace::Node node(Trace::TEST_INT, 0, inst.forInverted() ? inst.b() : inst.a(),
+			                 inst.forInverted() ? inst.a() : inst.b(), taken ? step->offset + 2 : target);
+			node.op = inst.forInclusive() ? Trace::LE : Trace::LT;
+			node.expect = (opcode == Instruction::FORLOOP) ? taken : !taken;
+			nodes.push_back(node);
+			break;
+		}
+
+		case Instruction::GETTABLE:
+		case Instruction::GETTABLEK:
+			if (typeB != TypeTable && (typeB != TypeArray || typeC != TypeInt)) { return false; }
+			{
+				Trace::Node node(Trace::GETINDEX, inst.a(), inst.b(), inst.c(), exit);
+				node.constant = isConstant;
+				nodes.push_back(node);
+				known[inst.a()] = UNKNOWN;
+			}
+			break;
+
+		case Instruction::SETTABLE:
+		case Instruction::SETTABLEK:
+			if (typeA != TypeTable && (typeA != TypeArray || typeC != TypeInt)) { return false; }
+			{
+				Trace::Node node(Trace::SETINDEX, inst.a(), inst.b(), inst.c(), exit);
+				node.constant = isConstant;
+				nodes.push_back(node);
+			}
+			break;
+
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace "cmm"
@@ -0,0 +1,123 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Memory.h"
+#include "Instruction.h"
+
+namespace cmm
+{
+
+class Prototype;
+
+// A linear, type-specialized form of one iteration of a hot loop, built from the instructions
+// the interpreter executed while it was recorded.
+//
+// The type of every operand is known to a node. Where a type was only observed while recording, a guard
+// checks it once, and later nodes rely on it. A guard or a branch that goes another way than the recorded one
+// leaves the trace, and the interpreter continues from the instruction the node names as its exit.
+// The first iteration is peeled off, so the guards of the registers whose types stay the same through
+// an iteration are checked only once, before the loop body is entered.
+struct Trace
+{
+	enum Opcode
+	{
+		GUARD_TYPE,      // exit unless R(A) is of type B
+		GUARD_NOTOBJECT, // exit if R(A) is an object
+		MOVE,            // R(A) = R(B), neither is an object
+		MOVE_OBJECT,     // R(A) = R(B), with the reference counting
+		LOADK,           // R(A) = K(B), which is not an object
+		LOADK_OBJECT,    // R(A) = K(B), with the reference counting
+		ARITH_INT,       // R(A) = R(B) op RK(C), integers
+		ARITH_FLOAT,     // R(A) = R(B) op RK(C), floats
+		NEG_INT,         // R(A) = -R(B), an integer
+		NEG_FLOAT,       // R(A) = -R(B), a float
+		STEP_INT,        // R(A) = R(A) + C, an integer and the step of FORLOOP
+		COMPARE_INT,     // R(A) = R(B) op RK(C), integers
+		COMPARE_FLOAT,   // R(A) = R(B) op RK(C), floats
+		TEST_INT,        // exit unless (R(B) op RK(C)) == expect, integers
+		TEST_FLOAT,      // exit unless (R(B) op RK(C)) == expect, floats
+		TEST_TRUTH,      // exit unless (R(A) != 0) == expect, an integer
+		GETINDEX,        // R(A) = R(B)[RK(C)], exit unless R(B) is an array or a table
+		SETINDEX,        // R(A)[RK(C)] = R(B), exit unless R(A) is an array or a table
+		LOOP             // back to the start of the loop body, counting a tick of the budget
+	};
+
+	enum Operator
+	{
+		ADD, SUB, MUL, DIV, MOD, EQ, NOTEQ, LT, LE, GT, GE
+	};
+
+	struct Node
+	{
+		Node(Opcode opcode, uint32_t a, uint32_t b, uint32_t c, uint32_t exit)
+		: opcode(opcode), op(ADD), constant(false), storeType(true), expect(true), a(a), b(b), c(c), exit(exit) {}
+
+		Opcode    opcode;
+		Operator  op;
+		bool      constant;  // RK(C) is K(C)
+		bool      storeType; // the type of R(A) has to be written, since it may differ from the result
+		bool      expect;    // the result of a test on the recorded path
+		uint32_t  a;
+		uint32_t  b;
+		uint32_t  c;
+		uint32_t  exit;      // the instruction the interpreter continues from when the node leaves the trace
+	};
+
+	typedef std::vector<Node> NodeVector;
+
+	uint32_t    head;       // the first instruction of the loop
+	uint32_t    loopStart;  // the first node of the loop body, the nodes before it run once
+	NodeVector  nodes;
+};
+
+
+// Records the instructions of a loop iteration while the interpreter executes them.
+// Context::loop_ shows every instruction to record() before executing it, until the loop head comes back.
+// The recording is given up at an instruction which can not be traced (calls, upvalues, nested loops ...),
+// and the loop is left to the baseline JIT.
+class TraceRecorder
+{
+public:
+	explicit        TraceRecorder();
+
+	bool            isRecording() const;
+
+	void            start(Prototype& prototype, const Variable* base, uint32_t head);
+	void            abort();
+
+	// Returns false once the recording is over, whether the trace is compiled or given up
+	bool            record(const Prototype* prototype, const Variable* base, uint32_t offset);
+
+private:
+	// An executed instruction with the types of its operands at that time
+	struct Step_
+	{
+		uint32_t  offset;
+		uint32_t  next;      // the instruction executed after it
+		Type      types[3];  // R(A), R(B) and R(C), TypeNull if an operand is not a register
+	};
+
+	typedef std::vector<Step_> StepVector_;
+	typedef std::vector<int8_t> TypeMap_; // the type known for each register, -1 if it is unknown
+
+	bool            traceable_(const Instruction& inst, uint32_t offset) const;
+	void            finish_();
+	bool            emit_(Trace::NodeVector& nodes, TypeMap_& known) const;
+
+	Prototype*         prototype_;
+	const Variable*    base_;
+	uint32_t           head_;
+	StepVector_        steps_;
+};
+
+inline bool TraceRecorder::isRecording() const
+{
+	return prototype_ != nullptr;
+}
+
+} // namespace "cmm"
+
+#endif
\ No newline at end of file
@@ -43,6 +43,8 @@ BinaryOpFuncObject(OpEqual, ==);
 BinaryOpFuncObject(OpNotEqual, !=);
 BinaryOpFuncObject(OpLess, <);
 BinaryOpFuncObject(OpLessEqual, <=);
+BinaryOpFuncObject(OpGreater, >);
+BinaryOpFuncObject(OpGreaterEqual, >=);
 UnaryOpFuncObject (OpLogicNot, !);
 
 
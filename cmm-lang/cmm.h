@@ -2,6 +2,9 @@
 #define CMM_H
 
 #include "Context.h"
+#include "Binding.h"
 #include "Error.h"
+#include "Scheduler.h"
+#include "Script.h"
 
 #endif
\ No newline at end of file
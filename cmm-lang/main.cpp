@@ -1,11 +1,19 @@
 ﻿#include "StdAfx.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <locale>
 #include <iostream>
+#include <fstream>
+#include <chrono>
 
 #include "cmm.h"
+#include "Config.h"
 #include "TextLoader.h"
+#include "Compiler.h"
+#include "CppGenerator.h"
+#include "CodePrinter.h"
+#include "Prototype.h"
 
 void print(cmm::Context& context)
 {
@@ -18,6 +26,7 @@ void print(cmm::Context& context)
 		case cmm::TypeArray:  wprintf(L"array\n"); break;
 		case cmm::TypeTable:  wprintf(L"table\n"); break;
 		case cmm::TypeFunc:   wprintf(L"function\n"); break;
+		case cmm::TypeCoroutine: wprintf(L"coroutine\n"); break;
 		case cmm::TypeCFunc:  wprintf(L"C function\n"); break;
 		}
 	}
@@ -45,6 +54,11 @@ void size(cmm::Context& context)
 	}
 }
 
+void silentPrint(cmm::Context& context)
+{
+	context.clear();
+}
+
 void RunInterpreter(cmm::Context& context)
 {
 	std::wcout << L"C-- 0.01 by Summerlight" << std::endl;
@@ -95,6 +109,155 @@ void RunFile(cmm::Context& context, std::wstring& fileName)
 	}
 }
 
+// Compiles a script to the C++ source of a module (CppGenerator.h). The source is built with the runtime,
+// and RegisterModule_<moduleName> which it defines lets Context::loadModule load the script without compiling it.
+void GenerateModule(const wchar_t fileName[], const wchar_t outputName[], const wchar_t moduleName[])
+{
+	TextLoader loader;
+
+	if (loader.load(fileName) == false) {
+		std::wcout << L"File " << fileName << L" does not exist." << std::endl;
+		return;
+	}
+
+	try {
+		cmm::ObjectManager objectManager;
+		cmm::Compiler compiler(objectManager);
+		cmm::Ref<cmm::Prototype> prototype = compiler.compile(loader.string());
+		cmm::CppGenerator generator;
+		const std::wstring& source = generator.generate(*prototype, moduleName);
+
+		std::ofstream output(outputName, std::ios::binary);
+		output << std::string(source.begin(), source.end()); // the source is written in ASCII
+	} catch (cmm::Error& error) {
+		std::wcout << error.errorStr() << std::endl;
+	}
+}
+
+// Runs a file with the profiler enabled (CMM_USE_PROFILER), then prints the code annotated with
+// the count of each instruction and the report, or the report in JSON only.
+void ProfileFile(const wchar_t fileName[], bool json)
+{
+	TextLoader loader;
+
+	if (loader.load(fileName) == false) {
+		std::wcout << L"File " << fileName << L" does not exist." << std::endl;
+		return;
+	}
+	if (CMM_USE_PROFILER == 0) {
+		std::wcout << L"The profiler is not built (CMM_USE_PROFILER)." << std::endl;
+		return;
+	}
+
+	cmm::Context context;
+	context.registerCfunction(L"print", silentPrint);
+	context.registerCfunction(L"sizeof", size);
+	context.enableProfiler(true);
+
+	try {
+		context.load(loader.string());
+
+		// The loaded function is kept to print its code, since the profiler counts the instructions of this prototype
+		cmm::Ref<cmm::Prototype> prototype = context.getPrototype(0);
+
+		context.run(0, 0);
+		context.getGlobal(L"main");
+		context.run(0, 0);
+
+		if (json) {
+			std::wcout << context.profiler().reportJson();
+		} else {
+			cmm::CodePrinter printer;
+			std::wcout << printer.print(*prototype, context.profiler()) << std::endl;
+			std::wcout << context.profiler().report();
+		}
+	} catch (cmm::Error& error) {
+		std::wcout << error.errorStr() << std::endl;
+	}
+}
+
+// Runs a file with the call stack sampled every interval, and prints the folded stacks,
+// which are the input of the flame graph tools (flamegraph.pl and others).
+void SampleFile(uint32_t intervalMicroseconds, const wchar_t fileName[])
+{
+	TextLoader loader;
+
+	if (loader.load(fileName) == false) {
+		std::wcout << L"File " << fileName << L" does not exist." << std::endl;
+		return;
+	}
+	if (CMM_USE_PROFILER == 0) {
+		std::wcout << L"The profiler is not built (CMM_USE_PROFILER)." << std::endl;
+		return;
+	}
+
+	cmm::Context context;
+	context.registerCfunction(L"print", silentPrint);
+	context.registerCfunction(L"sizeof", size);
+
+	try {
+		context.load(loader.string());
+		context.run(0, 0);
+
+		context.enableSampler(intervalMicroseconds);
+		context.getGlobal(L"main");
+		context.run(0, 0);
+		context.enableSampler(0);
+
+		std::wcout << context.sampler().foldedStacks();
+	} catch (cmm::Error& error) {
+		std::wcout << error.errorStr() << std::endl;
+	}
+}
+
+// Runs the main function of each file repeatedly and reports the elapsed time.
+// print() is replaced by a function that prints nothing, so only the virtual machine is measured.
+// Build once with CMM_USE_QUICKENING=0 and once with the default to see how much the quickened instructions gain.
+// MSVC has only the switch dispatch (Config.h), so the dispatch techniques are compared on Linux with
+// `make -C benchmark compare-dispatch`, which builds the runner of benchmark/ with either.
+// The JIT is compared at runtime by adding -jit to the command line, and CMM_USE_TRACING=0 leaves it the baseline JIT only.
+void RunBenchmark(uint32_t repeat, int numFiles, wchar_t* fileNames[], bool enableJit)
+{
+	std::wcout << L"dispatch: " << (CMM_USE_COMPUTED_GOTO ? L"threaded" : L"switch")
+	           << L", quickening: " << (CMM_USE_QUICKENING ? L"on" : L"off")
+	           << L", jit: " << ((enableJit && CMM_USE_JIT) ? (CMM_USE_TRACING ? L"tracing" : L"baseline") : L"off")
+	           << L", repeat: " << repeat << std::endl;
+
+	for (int i = 0; i < numFiles; i++) {
+		TextLoader loader;
+
+		if (loader.load(fileNames[i]) == false) {
+			std::wcout << L"File " << fileNames[i] << L" does not exist." << std::endl;
+			continue;
+		}
+
+		cmm::Context context;
+		context.enableJit(enableJit);
+		context.registerCfunction(L"print", silentPrint);
+		context.registerCfunction(L"sizeof", size);
+
+		try {
+			context.load(loader.string());
+			context.run(0, 0);
+
+			auto begin = std::chrono::steady_clock::now();
+			for (uint32_t j = 0; j < repeat; j++) {
+				context.getGlobal(L"main");
+				context.run(0, 0);
+			}
+			auto end = std::chrono::steady_clock::now();
+
+			double elapsed = std::chrono::duration<double, std::milli>(end - begin).count();
+			std::wcout << fileNames[i] << L": " << elapsed << L" ms total, "
+			           << elapsed * 1000.0 / repeat << L" us per run, "
+			           << context.numQuickened() << L" quickened, "
+			           << context.numDequickened() << L" de-quickened" << std::endl;
+		} catch (cmm::Error& error) {
+			std::wcout << fileNames[i] << L": " << error.errorStr() << std::endl;
+		}
+	}
+}
+
 int wmain(int argc, wchar_t* argv[])
 {
 	std::locale::global(std::locale("kor"));
@@ -102,11 +265,28 @@ int wmain(int argc, wchar_t* argv[])
 	std::wcin.imbue(std::locale("korean"));
 	std::wcout.imbue(std::locale("korean")); 
 
+	// -jit runs hot functions and loops as native code
+	bool enableJit = false;
+	if (argc >= 2 && std::wstring(argv[1]) == L"-jit") {
+		enableJit = true;
+		argc--;
+		argv++;
+	}
+
 	cmm::Context context;
+	context.enableJit(enableJit);
 	context.registerCfunction(L"print", print);
 	context.registerCfunction(L"sizeof", size);
 
-	if (argc < 2) {
+	if (argc >= 4 && std::wstring(argv[1]) == L"-benchmark") {
+		RunBenchmark(wcstoul(argv[2], nullptr, 10), argc - 3, &argv[3], enableJit);
+	} else if (argc == 3 && (std::wstring(argv[1]) == L"-profile" || std::wstring(argv[1]) == L"-profile-json")) {
+		ProfileFile(argv[2], std::wstring(argv[1]) == L"-profile-json");
+	} else if (argc == 4 && std::wstring(argv[1]) == L"-sample") {
+		SampleFile(wcstoul(argv[2], nullptr, 10), argv[3]);
+	} else if (argc == 5 && std::wstring(argv[1]) == L"-aot") {
+		GenerateModule(argv[2], argv[3], argv[4]);
+	} else if (argc < 2) {
 		RunInterpreter(context);
 	} else {
 		std::wstring fileName(argv[1]);